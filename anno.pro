@@ -17,11 +17,49 @@ win32 {
 
 SOURCES += main.cpp \
     mainwindow.cpp \
+    folderscanner.cpp \
+    folderindex.cpp \
+    filelistmodel.cpp \
+    filenameindex.cpp \
+    imageloader.cpp \
+    imagepyramid.cpp \
+    inferenceresults.cpp \
+    maskdelta.cpp \
+    maskjournal.cpp \
+    maskpalette.cpp \
+    masksaver.cpp \
+    resultscache.cpp \
+    sparsemask.cpp \
+    thingannotationedit.cpp \
+    thingannotationsaver.cpp \
+    tiledmask.cpp \
+    undohistorystore.cpp \
     QResultImageView/QResultImageView.cpp \
     QResultImageView/qt-image-flood-fill/qfloodfill.cpp \
     cpp-move-file-to-trash/move-file-to-trash.cpp
 
 HEADERS  += mainwindow.h \
+    folderscanner.h \
+    folderindex.h \
+    filelistmodel.h \
+    filenameindex.h \
+    imageloader.h \
+    imagepyramid.h \
+    binaryio.h \
+    inferenceresults.h \
+    lrucache.h \
+    maskdelta.h \
+    maskjournal.h \
+    maskpalette.h \
+    masksaver.h \
+    resultscache.h \
+    sparsemask.h \
+    thingannotationedit.h \
+    thingannotationsaver.h \
+    tiledmask.h \
+    undohistorystore.h \
+    undostack.h \
+    parallelsort.h \
     QResultImageView/QResultImageView.h \
     QResultImageView/qt-image-flood-fill/qfloodfill.h \
     version.h
@@ -0,0 +1,92 @@
+#ifndef BINARYIO_H
+#define BINARYIO_H
+
+#include <QByteArray>
+#include <QIODevice>
+#include <QString>
+#include <QtEndian>
+
+// Little-endian helpers for the binary cache files. The reader works on memory
+// (typically a mapped file) and checks every read against the size, as the
+// files may be truncated or otherwise corrupt. The writer buffers its output.
+
+class BinaryReader
+{
+public:
+    BinaryReader(const uchar* data, qint64 size, qint64 position)
+        : data(data)
+        , size(size)
+        , position(position)
+    {}
+
+    template <typename T>
+    bool read(T& value) {
+        if (position < 0 || position + static_cast<qint64>(sizeof(T)) > size) {
+            return false;
+        }
+        value = qFromLittleEndian<T>(data + position);
+        position += sizeof(T);
+        return true;
+    }
+
+    bool readString(QString& value) {
+        quint16 length = 0;
+        if (!read(length) || position + length > size) {
+            return false;
+        }
+        value = QString::fromUtf8(reinterpret_cast<const char*>(data + position), length);
+        position += length;
+        return true;
+    }
+
+private:
+    const uchar* const data;
+    const qint64 size;
+    qint64 position;
+};
+
+class BinaryWriter
+{
+public:
+    explicit BinaryWriter(QIODevice& device)
+        : device(device)
+    {}
+
+    template <typename T>
+    void write(T value) {
+        char bytes[sizeof(T)];
+        qToLittleEndian<T>(value, bytes);
+        buffer.append(bytes, sizeof(T));
+    }
+
+    bool writeString(const QString& value) {
+        const QByteArray utf8 = value.toUtf8();
+        if (utf8.size() > 0xffff) {
+            return false;
+        }
+        write<quint16>(static_cast<quint16>(utf8.size()));
+        buffer.append(utf8);
+        return buffer.size() < 1024 * 1024 || flush();
+    }
+
+    bool writeBytes(const QByteArray& bytes) {
+        buffer.append(bytes);
+        return buffer.size() < 1024 * 1024 || flush();
+    }
+
+    qint64 position() const {
+        return device.pos() + buffer.size();
+    }
+
+    bool flush() {
+        const bool ok = device.write(buffer) == buffer.size();
+        buffer.clear();
+        return ok;
+    }
+
+private:
+    QIODevice& device;
+    QByteArray buffer;
+};
+
+#endif // BINARYIO_H
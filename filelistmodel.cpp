@@ -0,0 +1,882 @@
+#include "filelistmodel.h"
+
+#include <QColor>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QtConcurrent/QtConcurrentRun>
+#include <QtAlgorithms>
+#include <algorithm>
+#include <memory>
+#include <string.h>
+
+namespace {
+    const QColor hasAnnotationsColor = QColor(192, 255, 192);
+    const QColor hasInferenceResultsColor = Qt::black;
+    const QColor hasInferenceResultsFileColor = Qt::gray;
+    const QColor hasNoInferenceResultsFileColor = Qt::lightGray;
+
+    bool statusHasAnnotations(quint8 status)
+    {
+        return (status & (FolderScanner::HasMask | FolderScanner::HasThingAnnotations)) != 0;
+    }
+
+    QColor getTextColor(quint8 status)
+    {
+        if (!(status & FolderScanner::HasInferenceResultPath)) {
+            return hasNoInferenceResultsFileColor;
+        }
+        return (status & FolderScanner::HasNonTrivialInferenceResultPath) ? hasInferenceResultsColor : hasInferenceResultsFileColor;
+    }
+
+    struct Span {
+        const char* data;
+        int size;
+    };
+
+    // Compares the concatenation a1 + a2 against b1 + b2, without actually concatenating
+    int compareConcatenated(Span a1, Span a2, Span b1, Span b2)
+    {
+        const Span a[2] = { a1, a2 };
+        const Span b[2] = { b1, b2 };
+        int ai = 0, ao = 0, bi = 0, bo = 0;
+        while (true) {
+            while (ai < 2 && ao == a[ai].size) {
+                ++ai;
+                ao = 0;
+            }
+            while (bi < 2 && bo == b[bi].size) {
+                ++bi;
+                bo = 0;
+            }
+            if (ai == 2 || bi == 2) {
+                return (ai == 2 ? 0 : 1) - (bi == 2 ? 0 : 1);
+            }
+            const int n = std::min(a[ai].size - ao, b[bi].size - bo);
+            const int comparison = memcmp(a[ai].data + ao, b[bi].data + bo, n);
+            if (comparison != 0) {
+                return comparison;
+            }
+            ao += n;
+            bo += n;
+        }
+    }
+
+    bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    // Reads the display name of a file (given as a directory and a file name) as a
+    // sequence of bytes. In natural order, each run of digits is replaced by a
+    // marker, the number of significant digits, and the significant digits, so
+    // that comparing the sequences byte by byte compares the numbers by value.
+    class SortSequence
+    {
+    public:
+        SortSequence(Span directory, Span name, int start, bool natural)
+            : directory(directory)
+            , name(name)
+            , size(directory.size + name.size)
+            , position(start)
+            , natural(natural)
+        {}
+
+        // Returns -1 at the end
+        int next() {
+            if (state == State::Length) {
+                state = State::Digits;
+                return std::min(digitsEnd - position, 255);
+            }
+            if (state == State::Digits) {
+                if (position < digitsEnd) {
+                    return at(position++);
+                }
+                state = State::Normal;
+            }
+            if (position >= size) {
+                return -1;
+            }
+            const unsigned char c = at(position);
+            if (!natural || !isDigit(c)) {
+                ++position;
+                return c;
+            }
+            digitsEnd = position;
+            while (digitsEnd < size && isDigit(at(digitsEnd))) {
+                ++digitsEnd;
+            }
+            while (position < digitsEnd && at(position) == '0') {
+                ++position; // leading zeros are not significant
+            }
+            state = State::Length;
+            return '0'; // the marker compares against other characters just like any digit would
+        }
+
+    private:
+        unsigned char at(int i) const {
+            return i < directory.size ? directory.data[i] : name.data[i - directory.size];
+        }
+
+        enum class State { Normal, Length, Digits };
+
+        const Span directory;
+        const Span name;
+        const int size;
+        int position;
+        const bool natural;
+        State state = State::Normal;
+        int digitsEnd = 0;
+    };
+
+    int compareSequences(SortSequence lhs, SortSequence rhs)
+    {
+        while (true) {
+            const int l = lhs.next();
+            const int r = rhs.next();
+            if (l != r) {
+                return l < r ? -1 : 1;
+            }
+            if (l < 0) {
+                return 0;
+            }
+        }
+    }
+
+    // The first 8 bytes of the sequence, so that comparing two prefixes as integers
+    // gives the same result as comparing the sequences, or else a tie
+    quint64 getSortKeyPrefix(SortSequence sequence)
+    {
+        quint64 prefix = 0;
+        for (int i = 0; i < 8; ++i) {
+            const int c = sequence.next();
+            prefix = (prefix << 8) | static_cast<quint64>(c < 0 ? 0 : c);
+        }
+        return prefix;
+    }
+
+    struct SortItem {
+        quint64 key;
+        quint32 fileId;
+    };
+
+    const int statusValueCount = 32; // 2^(the number of status flags)
+
+    bool matches(FileListModel::Filter filter, quint8 status)
+    {
+        const bool hasMask = (status & FolderScanner::HasMask) != 0;
+        const bool hasThings = (status & FolderScanner::HasThingAnnotations) != 0;
+        const bool hasResults = (status & FolderScanner::HasNonTrivialInferenceResultPath) != 0;
+
+        switch (filter) {
+        case FileListModel::Filter::Annotated: return hasMask || hasThings;
+        case FileListModel::Filter::Unannotated: return !hasMask && !hasThings;
+        case FileListModel::Filter::HasResults: return hasResults;
+        case FileListModel::Filter::StuffOnly: return hasMask && !hasThings;
+        case FileListModel::Filter::ThingsOnly: return hasThings && !hasMask;
+        case FileListModel::Filter::AnnotatedWithoutResults: return (hasMask || hasThings) && !hasResults;
+        case FileListModel::Filter::UnannotatedWithResults: return !hasMask && !hasThings && hasResults;
+        default: return true;
+        }
+    }
+
+    // Returns the position of the first bit set at or after the given position, or -1
+    qint64 findSetBitForward(const std::vector<quint64>& bits, qint64 position)
+    {
+        size_t word = static_cast<size_t>(position / 64);
+        if (word >= bits.size()) {
+            return -1;
+        }
+        quint64 w = bits[word] & (~0ull << (position % 64));
+        while (w == 0) {
+            if (++word >= bits.size()) {
+                return -1;
+            }
+            w = bits[word];
+        }
+        return static_cast<qint64>(word * 64 + qCountTrailingZeroBits(w));
+    }
+
+    // Returns the position of the last bit set at or before the given position, or -1
+    qint64 findSetBitBackward(const std::vector<quint64>& bits, qint64 position)
+    {
+        if (position < 0) {
+            return -1;
+        }
+        size_t word = static_cast<size_t>(position / 64);
+        if (word >= bits.size()) {
+            word = bits.size() - 1;
+            position = static_cast<qint64>(word * 64 + 63);
+        }
+        quint64 w = bits[word] & (~0ull >> (63 - position % 64));
+        while (w == 0) {
+            if (word == 0) {
+                return -1;
+            }
+            w = bits[--word];
+        }
+        return static_cast<qint64>(word * 64 + 63 - qCountLeadingZeroBits(w));
+    }
+}
+
+const quint32 FileListModel::noPosition;
+
+FileListModel::FileListModel(QObject* parent)
+    : QAbstractListModel(parent)
+{}
+
+void FileListModel::clear(const QString& rootDirectory)
+{
+    beginResetModel();
+
+    rootPrefix = rootDirectory;
+    if (!rootPrefix.isEmpty() && !rootPrefix.endsWith('/') && !rootPrefix.endsWith('\\')) {
+        rootPrefix += '/';
+    }
+
+    // Swap with empty containers, so that the memory actually gets released
+    std::vector<QByteArray>().swap(directories);
+    std::vector<char>().swap(nameArena);
+    std::vector<File>().swap(files);
+    std::vector<quint8>().swap(statuses);
+    std::vector<quint64>().swap(searchMatches);
+    nameIndex = FileNameIndex();
+    dropSearchIndexBuild();
+    std::vector<qint64>().swap(lastModified);
+    std::vector<qint64>().swap(fileSizes);
+    std::vector<quint64>().swap(pixelCounts);
+    std::vector<quint8>().swap(details);
+    std::vector<quint32>().swap(order);
+    std::vector<quint32>().swap(rows);
+    std::vector<quint32>().swap(orderPositions);
+    std::vector<quint32>().swap(rowPositions);
+
+    endResetModel();
+}
+
+int FileListModel::addFiles(const FolderScanner::Batch& batch)
+{
+    const int firstFileId = static_cast<int>(files.size());
+
+    std::vector<quint32> newRows;
+
+    for (const FolderScanner::DirectoryListing& listing : batch) {
+        if (listing.images.empty()) {
+            continue;
+        }
+
+        const quint32 directoryId = static_cast<quint32>(directories.size());
+        directories.push_back(listing.path.isEmpty() ? QByteArray() : listing.path.toUtf8() + '/');
+
+        for (const FolderScanner::ImageEntry& image : listing.images) {
+            const QByteArray name = image.name.toUtf8();
+
+            File file;
+            file.directoryId = directoryId;
+            file.nameOffset = static_cast<quint32>(nameArena.size());
+            file.nameLength = static_cast<quint16>(std::min(name.size(), 0xffff));
+
+            nameArena.insert(nameArena.end(), name.constData(), name.constData() + file.nameLength);
+
+            const quint32 fileId = static_cast<quint32>(files.size());
+            files.push_back(file);
+            statuses.push_back(image.status);
+            orderPositions.push_back(static_cast<quint32>(order.size()));
+            order.push_back(fileId);
+            rowPositions.push_back(noPosition);
+
+            lastModified.push_back(image.lastModified);
+            fileSizes.push_back(image.size);
+            pixelCounts.push_back(0); // read only if needed (see updateSortKeys)
+            details.push_back(listing.fromIndex ? 0 : FileInfoChecked);
+
+            if (!searchMatcher.isEmpty()) {
+                searchMatches.resize(fileId / 64 + 1);
+                if (searchMatcher.matches(displayName(fileId))) {
+                    searchMatches[fileId / 64] |= 1ull << (fileId % 64);
+                }
+            }
+
+            if (isShown(fileId)) {
+                newRows.push_back(fileId);
+            }
+        }
+    }
+
+    if (!newRows.empty()) {
+        // When reversed, the rows appended end up at the top
+        const int first = reversed ? 0 : static_cast<int>(rows.size());
+        beginInsertRows(QModelIndex(), first, first + static_cast<int>(newRows.size()) - 1);
+        for (quint32 fileId : newRows) {
+            rowPositions[fileId] = static_cast<quint32>(rows.size());
+            rows.push_back(fileId);
+        }
+        matchBits.clear();
+        endInsertRows();
+    }
+
+    return firstFileId;
+}
+
+bool FileListModel::sort(SortBy sortBy, bool natural, const ParallelProgressCallback& progress)
+{
+    // The part that all the paths have in common does not affect the order
+    const int start = getCommonPrefixLength(natural);
+
+    const auto getSortSequence = [this, start, natural](quint32 fileId) {
+        const File& file = files[fileId];
+        const QByteArray& directory = directories[file.directoryId];
+        return SortSequence({ directory.constData(), directory.size() }, { nameArena.data() + file.nameOffset, file.nameLength }, start, natural);
+    };
+
+    std::vector<SortItem> items(order.size());
+
+    parallel::forEachChunk(order.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const quint32 fileId = order[i];
+            items[i].key = sortBy == SortBy::Name
+                    ? getSortKeyPrefix(getSortSequence(fileId))
+                    : getSortKey(sortBy, fileId);
+            items[i].fileId = fileId;
+        }
+    });
+
+    // When sorting by name, equal keys mean just that the first 8 bytes are equal.
+    // Otherwise, the files with equal keys are ordered by name.
+    const auto compare = [&](const SortItem& lhs, const SortItem& rhs) {
+        if (lhs.key != rhs.key) {
+            return lhs.key < rhs.key;
+        }
+        int comparison = 0;
+        if (natural) {
+            comparison = compareSequences(getSortSequence(lhs.fileId), getSortSequence(rhs.fileId));
+        }
+        if (comparison == 0) {
+            comparison = compareDisplayNames(lhs.fileId, rhs.fileId);
+        }
+        return comparison < 0;
+    };
+
+    if (!parallel::sort(items, compare, progress)) {
+        return false;
+    }
+
+    for (size_t i = 0, end = items.size(); i < end; ++i) {
+        order[i] = items[i].fileId;
+        orderPositions[items[i].fileId] = static_cast<quint32>(i);
+    }
+
+    rebuildRows();
+
+    return true;
+}
+
+bool FileListModel::updateSortKeys(SortBy sortBy, const ParallelProgressCallback& progress)
+{
+    quint8 needed = 0;
+    if (sortBy == SortBy::LastModified || sortBy == SortBy::Size) {
+        needed = FileInfoChecked;
+    }
+    else if (sortBy == SortBy::ImageDimensions) {
+        needed = FileInfoChecked | DimensionsKnown;
+    }
+
+    std::vector<quint32> fileIds;
+    if (needed != 0) {
+        for (quint32 fileId = 0, fileCount = static_cast<quint32>(files.size()); fileId < fileCount; ++fileId) {
+            if ((details[fileId] & needed) != needed) {
+                fileIds.push_back(fileId);
+            }
+        }
+    }
+
+    if (fileIds.empty()) {
+        return true;
+    }
+
+    // Each file id is in one chunk only, so the chunks write to different elements
+    return parallel::forEachChunk(fileIds.size(), [&](size_t begin, size_t end) {
+        for (size_t i = begin; i < end; ++i) {
+            const quint32 fileId = fileIds[i];
+            const QString filename = fullName(fileId);
+            quint8 flags = details[fileId];
+
+            if (!(flags & FileInfoChecked)) {
+                const QFileInfo fileInfo(filename);
+                const qint64 modified = fileInfo.lastModified().toMSecsSinceEpoch();
+                if (modified != lastModified[fileId] || fileInfo.size() != fileSizes[fileId]) {
+                    lastModified[fileId] = modified;
+                    fileSizes[fileId] = fileInfo.size();
+                    flags &= ~DimensionsKnown; // the image may have changed too
+                }
+                flags |= FileInfoChecked;
+            }
+
+            if ((needed & DimensionsKnown) && !(flags & DimensionsKnown)) {
+                // Reads just the header, not the whole image
+                const QSize dimensions = QImageReader(filename).size();
+                pixelCounts[fileId] = dimensions.isValid() ? static_cast<quint64>(dimensions.width()) * dimensions.height() : 0;
+                flags |= DimensionsKnown;
+            }
+
+            details[fileId] = flags;
+        }
+    }, progress);
+}
+
+void FileListModel::setReversed(bool reverse)
+{
+    if (reverse == reversed) {
+        return;
+    }
+
+    emit layoutAboutToBeChanged();
+
+    reversed = reverse;
+
+    // Every row just moves to the mirrored position
+    const int lastRow = static_cast<int>(rows.size()) - 1;
+    const QModelIndexList oldPersistentIndexes = persistentIndexList();
+    QModelIndexList newPersistentIndexes;
+    for (const QModelIndex& oldIndex : oldPersistentIndexes) {
+        newPersistentIndexes.append(index(lastRow - oldIndex.row()));
+    }
+
+    changePersistentIndexList(oldPersistentIndexes, newPersistentIndexes);
+
+    emit layoutChanged();
+}
+
+void FileListModel::setHideUnannotated(bool hide)
+{
+    if (hide != hideUnannotated) {
+        hideUnannotated = hide;
+        rebuildRows();
+    }
+}
+
+bool FileListModel::setSearch(const QString& pattern, FileNameIndex::Syntax syntax)
+{
+    const FileNameMatcher matcher(pattern, syntax);
+    if (!matcher.isValid()) {
+        return false;
+    }
+
+    searchMatcher = matcher;
+
+    updateSearchMatches();
+    rebuildRows();
+
+    return true;
+}
+
+void FileListModel::buildSearchIndex()
+{
+    dropSearchIndexBuild();
+
+    // The names are copied, so that files can be added (or the list cleared)
+    // while the index is being built. The directories are implicitly shared.
+    struct Names {
+        std::vector<QByteArray> directories;
+        std::vector<char> nameArena;
+        std::vector<File> files;
+    };
+
+    const auto names = std::make_shared<Names>();
+    names->directories = directories;
+    names->nameArena = nameArena;
+    names->files = files;
+
+    nameIndexWatcher = new QFutureWatcher<FileNameIndex>(this);
+    connect(nameIndexWatcher, SIGNAL(finished()), this, SLOT(onSearchIndexBuilt()));
+
+    nameIndexWatcher->setFuture(QtConcurrent::run([names]() {
+        FileNameIndex index;
+        index.build(static_cast<quint32>(names->files.size()), [&names](quint32 fileId, std::string& displayName) {
+            const File& file = names->files[fileId];
+            const QByteArray& directory = names->directories[file.directoryId];
+            displayName.assign(directory.constData(), directory.size());
+            displayName.append(names->nameArena.data() + file.nameOffset, file.nameLength);
+        });
+        return index;
+    }));
+}
+
+void FileListModel::onSearchIndexBuilt()
+{
+    if (sender() != nameIndexWatcher) {
+        return; // dropped meanwhile
+    }
+
+    nameIndex = nameIndexWatcher->result();
+
+    nameIndexWatcher->deleteLater();
+    nameIndexWatcher = nullptr;
+}
+
+void FileListModel::dropSearchIndexBuild()
+{
+    if (nameIndexWatcher) {
+        // The build still runs to completion, but its result is not used
+        nameIndexWatcher->disconnect(this);
+        nameIndexWatcher->deleteLater();
+        nameIndexWatcher = nullptr;
+    }
+}
+
+void FileListModel::setFilter(Filter newFilter)
+{
+    if (newFilter != filter) {
+        filter = newFilter;
+        rebuildRows();
+    }
+}
+
+int FileListModel::findMatchingRow(int row, Filter filter, bool forward) const
+{
+    const qint64 rowCount = static_cast<qint64>(rows.size());
+    if (rowCount == 0) {
+        return -1;
+    }
+
+    updateMatchBits(getMatchingStatuses(filter));
+
+    // The bits are in the order of the rows vector, which is upside down if reversed
+    const bool forwardInBits = forward != reversed;
+    const qint64 position = reversed ? rowCount - 1 - row : row;
+
+    const qint64 found = forwardInBits
+            ? findSetBitForward(matchBits, std::max<qint64>(position + 1, 0))
+            : findSetBitBackward(matchBits, std::min(position - 1, rowCount - 1));
+
+    if (found < 0 || found >= rowCount) {
+        return -1;
+    }
+    return static_cast<int>(reversed ? rowCount - 1 - found : found);
+}
+
+int FileListModel::rowCount(const QModelIndex& parent) const
+{
+    return parent.isValid() ? 0 : static_cast<int>(rows.size());
+}
+
+QVariant FileListModel::data(const QModelIndex& index, int role) const
+{
+    if (!index.isValid() || index.row() < 0 || index.row() >= static_cast<int>(rows.size())) {
+        return QVariant();
+    }
+
+    const quint32 fileId = rows[rowIndex(index.row())];
+
+    switch (role) {
+    case Qt::DisplayRole:
+        return displayName(fileId);
+    case FullnameRole:
+        return fullName(fileId);
+    case Qt::BackgroundRole:
+        return statusHasAnnotations(statuses[fileId]) ? QVariant(hasAnnotationsColor) : QVariant();
+    case Qt::ForegroundRole:
+        return getTextColor(statuses[fileId]);
+    default:
+        return QVariant();
+    }
+}
+
+int FileListModel::fileCount() const
+{
+    return static_cast<int>(files.size());
+}
+
+int FileListModel::fileIdAt(int row) const
+{
+    if (row < 0 || row >= static_cast<int>(rows.size())) {
+        return -1;
+    }
+    return static_cast<int>(rows[rowIndex(row)]);
+}
+
+int FileListModel::rowOf(int fileId) const
+{
+    if (fileId < 0 || fileId >= static_cast<int>(rowPositions.size()) || rowPositions[fileId] == noPosition) {
+        return -1;
+    }
+    return static_cast<int>(rowIndex(static_cast<int>(rowPositions[fileId]))); // the mapping is its own inverse
+}
+
+const std::vector<quint32>& FileListModel::sortedFileIds() const
+{
+    return order;
+}
+
+QString FileListModel::displayName(int fileId) const
+{
+    const File& file = files[fileId];
+    QByteArray utf8 = directories[file.directoryId];
+    utf8.append(nameArena.data() + file.nameOffset, file.nameLength);
+    return QString::fromUtf8(utf8);
+}
+
+QString FileListModel::fullName(int fileId) const
+{
+    return rootPrefix + displayName(fileId);
+}
+
+quint8 FileListModel::status(int fileId) const
+{
+    return statuses[fileId];
+}
+
+void FileListModel::setStatus(int fileId, quint8 status)
+{
+    if (statuses[fileId] == status) {
+        return;
+    }
+
+    statuses[fileId] = status;
+
+    const int row = rowOf(fileId);
+    if (row >= 0) {
+        if (!matchBits.empty()) {
+            const size_t i = rowIndex(row);
+            const quint64 bit = 1ull << (i % 64);
+            if ((matchBitsStatuses >> status) & 1) {
+                matchBits[i / 64] |= bit;
+            }
+            else {
+                matchBits[i / 64] &= ~bit;
+            }
+        }
+
+        const QModelIndex changed = index(row);
+        emit dataChanged(changed, changed);
+    }
+}
+
+bool FileListModel::hasAnnotations(int fileId) const
+{
+    return statusHasAnnotations(statuses[fileId]);
+}
+
+void FileListModel::removeFile(int fileId)
+{
+    erasePosition(order, orderPositions, static_cast<quint32>(fileId));
+
+    const int row = rowOf(fileId);
+    if (row >= 0) {
+        beginRemoveRows(QModelIndex(), row, row);
+        erasePosition(rows, rowPositions, static_cast<quint32>(fileId));
+        matchBits.clear();
+        endRemoveRows();
+    }
+}
+
+void FileListModel::erasePosition(std::vector<quint32>& ids, std::vector<quint32>& positions, quint32 fileId)
+{
+    const quint32 position = positions[fileId];
+    if (position == noPosition) {
+        return;
+    }
+
+    ids.erase(ids.begin() + position);
+    positions[fileId] = noPosition;
+
+    // Only the ones after it move
+    for (size_t i = position, end = ids.size(); i < end; ++i) {
+        positions[ids[i]] = static_cast<quint32>(i);
+    }
+}
+
+quint32 FileListModel::getMatchingStatuses(Filter filter)
+{
+    quint32 matchingStatuses = 0;
+    for (int status = 0; status < statusValueCount; ++status) {
+        if (matches(filter, static_cast<quint8>(status))) {
+            matchingStatuses |= 1u << status;
+        }
+    }
+    return matchingStatuses;
+}
+
+bool FileListModel::isShown(quint32 fileId) const
+{
+    if (!((shownStatuses >> statuses[fileId]) & 1)) {
+        return false;
+    }
+    return searchMatches.empty() || ((searchMatches[fileId / 64] >> (fileId % 64)) & 1);
+}
+
+void FileListModel::updateSearchMatches()
+{
+    if (searchMatcher.isEmpty()) {
+        std::vector<quint64>().swap(searchMatches);
+        return;
+    }
+
+    static_assert(FileNameIndex::blockSize == 64, "Each block of the index should map to one word of the bits");
+
+    const quint32 fileCount = static_cast<quint32>(files.size());
+    const quint32 blockCount = (fileCount + 63) / 64;
+
+    searchMatches.assign(blockCount, 0);
+
+    std::vector<quint32> blocks;
+    const bool isIndexed = nameIndex.fileCount() == fileCount
+            && nameIndex.getCandidateBlocks(searchMatcher.requiredLiterals(), blocks);
+
+    if (!isIndexed) {
+        blocks.resize(blockCount);
+        for (quint32 block = 0; block < blockCount; ++block) {
+            blocks[block] = block;
+        }
+    }
+
+    // Each block is a word of its own, so the chunks can be checked in parallel
+    parallel::forEachChunk(blocks.size(), [&](size_t begin, size_t end) {
+        const FileNameMatcher matcher = searchMatcher;
+        for (size_t i = begin; i < end; ++i) {
+            const quint32 firstFileId = blocks[i] * 64;
+            const quint32 endFileId = std::min(firstFileId + 64, fileCount);
+            quint64 bits = 0;
+            for (quint32 fileId = firstFileId; fileId < endFileId; ++fileId) {
+                if (matcher.matches(displayName(fileId))) {
+                    bits |= 1ull << (fileId - firstFileId);
+                }
+            }
+            searchMatches[blocks[i]] = bits;
+        }
+    });
+}
+
+void FileListModel::updateMatchBits(quint32 matchingStatuses) const
+{
+    if (!matchBits.empty() && matchingStatuses == matchBitsStatuses) {
+        return;
+    }
+
+    const size_t rowCount = rows.size();
+
+    matchBits.assign((rowCount + 63) / 64, 0);
+    matchBitsStatuses = matchingStatuses;
+
+    for (size_t i = 0; i < rowCount; ++i) {
+        if ((matchingStatuses >> statuses[rows[i]]) & 1) {
+            matchBits[i / 64] |= 1ull << (i % 64);
+        }
+    }
+}
+
+quint64 FileListModel::getSortKey(SortBy sortBy, quint32 fileId) const
+{
+    const quint8 status = statuses[fileId];
+
+    switch (sortBy) {
+    case SortBy::LastModified:
+        return static_cast<quint64>(lastModified[fileId]) ^ (1ull << 63); // so that negative values come first
+    case SortBy::Size:
+        return static_cast<quint64>(fileSizes[fileId]);
+    case SortBy::AnnotationStatus:
+        return status & (FolderScanner::HasMask | FolderScanner::HasThingAnnotations);
+    case SortBy::InferenceResults:
+        return (status & FolderScanner::HasNonTrivialInferenceResultPath) ? 2
+             : (status & FolderScanner::HasInferenceResultPath) ? 1
+             : 0;
+    case SortBy::ImageDimensions:
+        return pixelCounts[fileId];
+    default:
+        return 0;
+    }
+}
+
+size_t FileListModel::rowIndex(int row) const
+{
+    return reversed ? rows.size() - 1 - row : static_cast<size_t>(row);
+}
+
+int FileListModel::compareDisplayNames(quint32 lhs, quint32 rhs) const
+{
+    const File& a = files[lhs];
+    const File& b = files[rhs];
+
+    const Span aName = { nameArena.data() + a.nameOffset, a.nameLength };
+    const Span bName = { nameArena.data() + b.nameOffset, b.nameLength };
+
+    if (a.directoryId == b.directoryId) {
+        const Span empty = { nullptr, 0 };
+        return compareConcatenated(empty, aName, empty, bName);
+    }
+
+    const QByteArray& aDirectory = directories[a.directoryId];
+    const QByteArray& bDirectory = directories[b.directoryId];
+
+    return compareConcatenated({ aDirectory.constData(), aDirectory.size() }, aName,
+                               { bDirectory.constData(), bDirectory.size() }, bName);
+}
+
+int FileListModel::getCommonPrefixLength(bool natural) const
+{
+    if (directories.empty()) {
+        return 0;
+    }
+
+    const QByteArray& first = directories.front();
+    int length = first.size();
+
+    for (const QByteArray& directory : directories) {
+        length = std::min(length, directory.size());
+        for (int i = 0; i < length; ++i) {
+            if (directory[i] != first[i]) {
+                length = i;
+                break;
+            }
+        }
+    }
+
+    if (natural) {
+        // Do not cut a number in half
+        while (length > 0 && isDigit(first[length - 1])) {
+            --length;
+        }
+    }
+
+    return length;
+}
+
+void FileListModel::rebuildRows()
+{
+    emit layoutAboutToBeChanged();
+
+    shownStatuses = getMatchingStatuses(filter);
+    if (hideUnannotated) {
+        shownStatuses &= getMatchingStatuses(Filter::Annotated);
+    }
+    matchBits.clear();
+
+    const QModelIndexList oldPersistentIndexes = persistentIndexList();
+
+    std::vector<int> persistentFileIds;
+    persistentFileIds.reserve(oldPersistentIndexes.size());
+    for (const QModelIndex& oldIndex : oldPersistentIndexes) {
+        persistentFileIds.push_back(fileIdAt(oldIndex.row()));
+    }
+
+    rows.clear();
+    rows.reserve(order.size());
+    rowPositions.assign(files.size(), noPosition);
+    for (quint32 fileId : order) {
+        if (isShown(fileId)) {
+            rowPositions[fileId] = static_cast<quint32>(rows.size());
+            rows.push_back(fileId);
+        }
+    }
+
+    // There are typically just a few persistent indexes (such as the current one)
+    QModelIndexList newPersistentIndexes;
+    for (int fileId : persistentFileIds) {
+        const int newRow = fileId >= 0 ? rowOf(fileId) : -1;
+        newPersistentIndexes.append(newRow >= 0 ? index(newRow) : QModelIndex());
+    }
+
+    changePersistentIndexList(oldPersistentIndexes, newPersistentIndexes);
+
+    emit layoutChanged();
+}
@@ -0,0 +1,181 @@
+#ifndef FILELISTMODEL_H
+#define FILELISTMODEL_H
+
+#include "folderscanner.h"
+#include "filenameindex.h"
+#include "parallelsort.h"
+
+#include <QAbstractListModel>
+#include <QByteArray>
+#include <QFutureWatcher>
+#include <vector>
+
+// The model behind the file list. Instead of one item object per image, the
+// paths are kept in a compact store: each directory prefix is stored once, and
+// the file names are packed into one contiguous (UTF-8) arena. The display
+// strings are created only for the rows actually shown.
+//
+// The annotation status of each file is kept in a table of status bits (see
+// FolderScanner::StatusFlag), filled from the sidecar files seen during the
+// scan, and kept up to date as annotations are saved or deleted. Everything
+// that needs to know whether an image has annotations or results reads the
+// table, instead of touching the file system.
+//
+// Files are identified by ids that stay valid until the list is cleared; rows
+// are just the current presentation order of (a subset of) those ids.
+class FileListModel : public QAbstractListModel
+{
+    Q_OBJECT
+
+public:
+    enum Role {
+        FullnameRole = Qt::UserRole + 0
+    };
+
+    enum class SortBy {
+        Name,
+        LastModified,
+        Size,
+        AnnotationStatus,
+        InferenceResults,
+        ImageDimensions
+    };
+
+    enum class Filter {
+        All,
+        Annotated,
+        Unannotated,
+        HasResults,
+        StuffOnly, // has a mask, but no thing annotations
+        ThingsOnly, // has thing annotations, but no mask
+        AnnotatedWithoutResults,
+        UnannotatedWithResults
+    };
+
+    explicit FileListModel(QObject* parent = nullptr);
+
+    void clear(const QString& rootDirectory);
+
+    // Appends the images in the batch, and returns the id of the first one added.
+    // The rest get consecutive ids, in the order in which they appear in the batch.
+    int addFiles(const FolderScanner::Batch& batch);
+
+    // Sorts by the given key, and then by the display name. In natural order,
+    // numbers within the names are compared by their value, so that "img2" comes
+    // before "img10". Returns false, if canceled.
+    bool sort(SortBy sortBy, bool natural, const ParallelProgressCallback& progress = ParallelProgressCallback());
+
+    // Reads from the files what sorting by the key needs but is not known yet:
+    // the image dimensions (from the headers), and the modification times and
+    // sizes of the files that were taken from the folder index (as they may have
+    // been rewritten since). Done in parallel; returns false, if canceled.
+    bool updateSortKeys(SortBy sortBy, const ParallelProgressCallback& progress = ParallelProgressCallback());
+
+    // Just flips the rows shown, without sorting anything
+    void setReversed(bool reverse);
+
+    void setHideUnannotated(bool hide);
+    void setFilter(Filter filter); // applied together with hiding the unannotated files
+
+    // Returns the next (or the previous) row after the given one with a file that
+    // matches the filter, or -1 if there is none. Pass -1 (or rowCount()) to start
+    // from the top (or from the bottom).
+    int findMatchingRow(int row, Filter filter, bool forward) const;
+
+    // Shows only the files whose display name matches the pattern (if not empty).
+    // Returns false if the pattern is not valid.
+    bool setSearch(const QString& pattern, FileNameIndex::Syntax syntax);
+
+    // Starts indexing the names of the files added so far, in the background.
+    // Until the index is ready (and for the files added afterwards), searching
+    // just goes through all the names.
+    void buildSearchIndex();
+
+    int rowCount(const QModelIndex& parent = QModelIndex()) const override;
+    QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const override;
+
+    int fileCount() const;
+    int fileIdAt(int row) const;
+    int rowOf(int fileId) const; // -1, if not currently shown
+
+    // All the files (whether shown or not), in the current sort order (ignoring reversal)
+    const std::vector<quint32>& sortedFileIds() const;
+
+    QString displayName(int fileId) const;
+    QString fullName(int fileId) const;
+
+    quint8 status(int fileId) const;
+    void setStatus(int fileId, quint8 status);
+    bool hasAnnotations(int fileId) const;
+
+    void removeFile(int fileId);
+
+private slots:
+    void onSearchIndexBuilt();
+
+private:
+    struct File {
+        quint32 directoryId;
+        quint32 nameOffset;
+        quint16 nameLength;
+    };
+
+    enum DetailFlag : quint8 {
+        FileInfoChecked = 1 << 0, // the modification time and the size are as listed, not from the index
+        DimensionsKnown = 1 << 1,
+    };
+
+    // The statuses matching a filter, as a set of bits: one for each possible
+    // status value (there are only five status flags)
+    static quint32 getMatchingStatuses(Filter filter);
+
+    bool isShown(quint32 fileId) const;
+    void updateSearchMatches();
+    void updateMatchBits(quint32 matchingStatuses) const;
+    quint64 getSortKey(SortBy sortBy, quint32 fileId) const;
+    size_t rowIndex(int row) const; // maps a row to an index in rows
+    int compareDisplayNames(quint32 lhs, quint32 rhs) const;
+    int getCommonPrefixLength(bool natural) const;
+    void rebuildRows();
+    void dropSearchIndexBuild();
+    static void erasePosition(std::vector<quint32>& ids, std::vector<quint32>& positions, quint32 fileId);
+
+    QString rootPrefix;
+
+    std::vector<QByteArray> directories; // relative to the root, and with a trailing slash (except for the root itself)
+    std::vector<char> nameArena;
+    std::vector<File> files;
+    std::vector<quint8> statuses; // indexed by file id
+
+    // The alternative sort keys, as packed columns indexed by file id
+    std::vector<qint64> lastModified;
+    std::vector<qint64> fileSizes;
+    std::vector<quint64> pixelCounts;
+    std::vector<quint8> details; // DetailFlags
+
+    std::vector<quint32> order; // all the files, sorted
+    std::vector<quint32> rows; // the files shown, in ascending order
+
+    // The inverses of the above: the position of each file id in order and in
+    // rows, or noPosition if it is not there
+    static const quint32 noPosition = ~0u;
+    std::vector<quint32> orderPositions;
+    std::vector<quint32> rowPositions;
+
+    bool reversed = false;
+    bool hideUnannotated = false;
+    Filter filter = Filter::All;
+    quint32 shownStatuses = ~0u;
+
+    // For finding the next matching row: one bit for each row, in the order of
+    // the rows vector. Cleared whenever the rows change.
+    mutable std::vector<quint64> matchBits;
+    mutable quint32 matchBitsStatuses = 0;
+
+    FileNameIndex nameIndex;
+    QFutureWatcher<FileNameIndex>* nameIndexWatcher = nullptr; // while being built
+    FileNameMatcher searchMatcher;
+    std::vector<quint64> searchMatches; // one bit per file id; empty when not searching
+};
+
+#endif // FILELISTMODEL_H
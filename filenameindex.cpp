@@ -0,0 +1,288 @@
+#include "filenameindex.h"
+
+#include <QFuture>
+#include <QThread>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+
+namespace {
+    unsigned char toLowerAscii(unsigned char c)
+    {
+        return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+
+    template <typename Function>
+    void forEachTrigram(const char* data, size_t size, Function function)
+    {
+        if (size < 3) {
+            return;
+        }
+        quint32 trigram = (toLowerAscii(data[0]) << 8) | toLowerAscii(data[1]);
+        for (size_t i = 2; i < size; ++i) {
+            trigram = ((trigram << 8) | toLowerAscii(data[i])) & 0xffffff;
+            function(trigram);
+        }
+    }
+
+    bool isAscii(quint32 trigram)
+    {
+        return (trigram & 0x808080) == 0;
+    }
+
+    void appendLiteral(std::vector<QByteArray>& literals, QString& literal)
+    {
+        if (!literal.isEmpty()) {
+            literals.push_back(literal.toUtf8());
+            literal.clear();
+        }
+    }
+
+    std::vector<QByteArray> getWildcardLiterals(const QString& pattern)
+    {
+        std::vector<QByteArray> literals;
+        QString literal;
+
+        for (int i = 0, end = pattern.length(); i < end; ++i) {
+            const QChar c = pattern[i];
+            if (c == '*' || c == '?') {
+                appendLiteral(literals, literal);
+            }
+            else if (c == '[') {
+                appendLiteral(literals, literal);
+                while (i < end && pattern[i] != ']') {
+                    ++i;
+                }
+            }
+            else {
+                literal += c;
+            }
+        }
+
+        appendLiteral(literals, literal);
+        return literals;
+    }
+
+    // Collects the literal runs outside of any groups, and gives up on alternation.
+    // Being conservative is fine, as the matches are checked anyway.
+    std::vector<QByteArray> getRegularExpressionLiterals(const QString& pattern)
+    {
+        std::vector<QByteArray> literals;
+
+        if (pattern.contains('|')) {
+            return literals;
+        }
+
+        QString literal;
+        int depth = 0;
+
+        for (int i = 0, end = pattern.length(); i < end; ++i) {
+            const QChar c = pattern[i];
+            if (c == '\\') {
+                appendLiteral(literals, literal);
+                ++i; // whether an escaped character or a class like \d, just skip it
+            }
+            else if (c == '(') {
+                appendLiteral(literals, literal);
+                ++depth;
+            }
+            else if (c == ')') {
+                --depth;
+            }
+            else if (c == '[') {
+                appendLiteral(literals, literal);
+                while (i < end && pattern[i] != ']') {
+                    ++i;
+                }
+            }
+            else if (c == '*' || c == '?' || c == '{') {
+                // the previous character is optional
+                literal.chop(1);
+                appendLiteral(literals, literal);
+                while (c == '{' && i < end && pattern[i] != '}') {
+                    ++i;
+                }
+            }
+            else if (c == '.' || c == '+' || c == '^' || c == '$') {
+                appendLiteral(literals, literal);
+            }
+            else if (depth == 0) {
+                literal += c;
+            }
+        }
+
+        appendLiteral(literals, literal);
+        return literals;
+    }
+}
+
+void FileNameIndex::build(quint32 fileCount, const NameGetter& getName)
+{
+    typedef std::unordered_map<quint32, std::vector<quint32>> Partition;
+
+    // Each thread goes through all the names, but handles only its own share of
+    // the trigrams, so that no locking is needed
+    const int partitionCount = std::max(1, QThread::idealThreadCount());
+    std::vector<Partition> partitions(partitionCount);
+
+    std::vector<QFuture<void>> futures;
+    futures.reserve(partitionCount);
+
+    for (int partition = 0; partition < partitionCount; ++partition) {
+        futures.push_back(QtConcurrent::run([&, partition]() {
+            Partition& blocksByTrigram = partitions[partition];
+            std::string name;
+            for (quint32 fileId = 0; fileId < fileCount; ++fileId) {
+                getName(fileId, name);
+                const quint32 block = fileId / blockSize;
+                forEachTrigram(name.data(), name.size(), [&](quint32 trigram) {
+                    if (static_cast<int>(trigram % partitionCount) == partition) {
+                        std::vector<quint32>& blocks = blocksByTrigram[trigram];
+                        if (blocks.empty() || blocks.back() != block) {
+                            blocks.push_back(block);
+                        }
+                    }
+                });
+            }
+        }));
+    }
+
+    for (QFuture<void>& future : futures) {
+        future.waitForFinished();
+    }
+
+    std::vector<std::pair<quint32, const std::vector<quint32>*>> entries;
+    size_t postingCount = 0;
+
+    for (const Partition& partition : partitions) {
+        for (const auto& entry : partition) {
+            entries.push_back(std::make_pair(entry.first, &entry.second));
+            postingCount += entry.second.size();
+        }
+    }
+
+    std::sort(entries.begin(), entries.end(), [](const std::pair<quint32, const std::vector<quint32>*>& lhs, const std::pair<quint32, const std::vector<quint32>*>& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    trigrams.clear();
+    postingOffsets.clear();
+    postings.clear();
+
+    trigrams.reserve(entries.size());
+    postingOffsets.reserve(entries.size() + 1);
+    postings.reserve(postingCount);
+
+    for (const auto& entry : entries) {
+        trigrams.push_back(entry.first);
+        postingOffsets.push_back(static_cast<quint32>(postings.size()));
+        postings.insert(postings.end(), entry.second->begin(), entry.second->end());
+    }
+    postingOffsets.push_back(static_cast<quint32>(postings.size()));
+
+    indexedFileCount = fileCount;
+}
+
+quint32 FileNameIndex::fileCount() const
+{
+    return indexedFileCount;
+}
+
+bool FileNameIndex::getCandidateBlocks(const std::vector<QByteArray>& literals, std::vector<quint32>& blocks) const
+{
+    typedef std::pair<const quint32*, const quint32*> Range;
+    std::vector<Range> ranges;
+
+    for (const QByteArray& literal : literals) {
+        bool found = true;
+        forEachTrigram(literal.constData(), literal.size(), [&](quint32 trigram) {
+            if (!isAscii(trigram)) {
+                return; // case-insensitive matching of other characters is not that simple
+            }
+            const auto i = std::lower_bound(trigrams.begin(), trigrams.end(), trigram);
+            if (i == trigrams.end() || *i != trigram) {
+                found = false;
+                return;
+            }
+            const size_t t = i - trigrams.begin();
+            ranges.push_back(Range(postings.data() + postingOffsets[t], postings.data() + postingOffsets[t + 1]));
+        });
+        if (!found) {
+            blocks.clear(); // a required trigram does not appear anywhere
+            return true;
+        }
+    }
+
+    if (ranges.empty()) {
+        return false;
+    }
+
+    // Intersect, starting from the shortest lists
+    std::sort(ranges.begin(), ranges.end(), [](const Range& lhs, const Range& rhs) {
+        return lhs.second - lhs.first < rhs.second - rhs.first;
+    });
+
+    blocks.assign(ranges.front().first, ranges.front().second);
+
+    std::vector<quint32> intersection;
+    for (size_t i = 1; i < ranges.size() && !blocks.empty(); ++i) {
+        intersection.clear();
+        std::set_intersection(blocks.begin(), blocks.end(), ranges[i].first, ranges[i].second, std::back_inserter(intersection));
+        blocks.swap(intersection);
+    }
+
+    return true;
+}
+
+FileNameMatcher::FileNameMatcher(const QString& pattern, FileNameIndex::Syntax syntax)
+    : pattern(pattern)
+    , syntax(syntax)
+{
+    switch (syntax) {
+    case FileNameIndex::Syntax::Substring:
+        literals.push_back(pattern.toUtf8());
+        break;
+    case FileNameIndex::Syntax::Wildcard:
+        regularExpression.setPattern(QRegularExpression::wildcardToRegularExpression(pattern));
+        regularExpression.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+        matchFileNameOnly = !pattern.contains('/');
+        literals = getWildcardLiterals(pattern);
+        break;
+    case FileNameIndex::Syntax::RegularExpression:
+        regularExpression.setPattern(pattern);
+        regularExpression.setPatternOptions(QRegularExpression::CaseInsensitiveOption);
+        literals = getRegularExpressionLiterals(pattern);
+        break;
+    }
+}
+
+bool FileNameMatcher::isEmpty() const
+{
+    return pattern.isEmpty();
+}
+
+bool FileNameMatcher::isValid() const
+{
+    return syntax == FileNameIndex::Syntax::Substring || regularExpression.isValid();
+}
+
+bool FileNameMatcher::matches(const QString& displayName) const
+{
+    switch (syntax) {
+    case FileNameIndex::Syntax::Substring:
+        return displayName.contains(pattern, Qt::CaseInsensitive);
+    case FileNameIndex::Syntax::Wildcard:
+        if (matchFileNameOnly) {
+            return regularExpression.match(displayName.midRef(displayName.lastIndexOf('/') + 1)).hasMatch();
+        }
+        return regularExpression.match(displayName).hasMatch();
+    default:
+        return regularExpression.match(displayName).hasMatch();
+    }
+}
+
+const std::vector<QByteArray>& FileNameMatcher::requiredLiterals() const
+{
+    return literals;
+}
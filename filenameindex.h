@@ -0,0 +1,76 @@
+#ifndef FILENAMEINDEX_H
+#define FILENAMEINDEX_H
+
+#include <QByteArray>
+#include <QRegularExpression>
+#include <QString>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A trigram index over the display names of the files in the list, so that the
+// files matching a search pattern can be found without looking at every name.
+//
+// The files are grouped in blocks of 64 consecutive ids, and for each trigram,
+// the index lists the blocks in which it appears. The files of a directory get
+// consecutive ids, so the names within a block tend to share most of their
+// trigrams, which keeps the index small. A lookup gives just the candidate
+// blocks; their files still need to be checked against the actual pattern.
+//
+// Trigrams are indexed case-insensitively (as far as ASCII is concerned).
+class FileNameIndex
+{
+public:
+    static const int blockSize = 64;
+
+    enum class Syntax {
+        Substring,
+        Wildcard,
+        RegularExpression
+    };
+
+    // Writes the display name of the file (in UTF-8) to the buffer given
+    typedef std::function<void(quint32 fileId, std::string& displayName)> NameGetter;
+
+    // Called from the GUI thread, but the work is split across the global thread pool
+    void build(quint32 fileCount, const NameGetter& getName);
+
+    quint32 fileCount() const;
+
+    // Returns false if the literals do not contain anything to look up, in which
+    // case all the blocks need to be checked
+    bool getCandidateBlocks(const std::vector<QByteArray>& literals, std::vector<quint32>& blocks) const;
+
+private:
+    quint32 indexedFileCount = 0;
+
+    std::vector<quint32> trigrams; // sorted
+    std::vector<quint32> postingOffsets; // where the blocks of each trigram start (plus one more for the end)
+    std::vector<quint32> postings; // the block numbers; sorted, for each trigram
+};
+
+// Matches display names against a search pattern
+class FileNameMatcher
+{
+public:
+    FileNameMatcher() = default; // matches everything
+    FileNameMatcher(const QString& pattern, FileNameIndex::Syntax syntax);
+
+    bool isEmpty() const;
+    bool isValid() const;
+
+    bool matches(const QString& displayName) const;
+
+    // Strings that every match must contain (case-insensitively). Some may be
+    // missing from the list, but the list never has anything extra.
+    const std::vector<QByteArray>& requiredLiterals() const;
+
+private:
+    QString pattern;
+    FileNameIndex::Syntax syntax = FileNameIndex::Syntax::Substring;
+    QRegularExpression regularExpression;
+    bool matchFileNameOnly = false; // a wildcard without a slash is matched against the file name only
+    std::vector<QByteArray> literals;
+};
+
+#endif // FILENAMEINDEX_H
@@ -0,0 +1,229 @@
+#include "folderindex.h"
+#include "binaryio.h"
+
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <string.h>
+
+namespace {
+    const char magic[8] = { 'A', 'N', 'N', 'O', 'I', 'D', 'X', '1' };
+    const quint32 currentVersion = 4;
+
+    // magic, version, directory count, scan start time, offset of the directory table
+    const qint64 headerSize = 8 + 4 + 4 + 8 + 8;
+
+    // Directory timestamps are not necessarily any more precise than this,
+    // so a directory modified this close to the scan may have changed again
+    // without its timestamp changing
+    const qint64 timestampGranularityMsec = 2000;
+
+    void writeHeader(BinaryWriter& writer, quint32 directoryCount, qint64 scanStartedAt, qint64 directoryTableOffset)
+    {
+        for (char c : magic) {
+            writer.write<qint8>(c);
+        }
+        writer.write<quint32>(currentVersion);
+        writer.write<quint32>(directoryCount);
+        writer.write<qint64>(scanStartedAt);
+        writer.write<qint64>(directoryTableOffset);
+    }
+}
+
+QString FolderIndex::getIndexFilename(const QString& rootDirectory)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty() || rootDirectory.isEmpty()) {
+        return QString();
+    }
+
+    const QString canonicalRoot = QDir::cleanPath(QDir(rootDirectory).absolutePath());
+    const QByteArray key = QCryptographicHash::hash(canonicalRoot.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    return cacheDirectory + "/folder-index/" + QString::fromLatin1(key) + ".idx";
+}
+
+std::shared_ptr<const FolderIndex> FolderIndex::load(const QString& filename)
+{
+    std::shared_ptr<FolderIndex> index(new FolderIndex);
+
+    index->file.setFileName(filename);
+    if (!index->file.open(QIODevice::ReadOnly)) {
+        return nullptr;
+    }
+
+    index->size = index->file.size();
+    if (index->size < headerSize) {
+        return nullptr;
+    }
+
+    index->data = index->file.map(0, index->size);
+    if (index->data == nullptr || memcmp(index->data, magic, sizeof(magic)) != 0) {
+        return nullptr;
+    }
+
+    BinaryReader header(index->data, index->size, sizeof(magic));
+    quint32 version = 0;
+    quint32 directoryCount = 0;
+    qint64 directoryTableOffset = 0;
+
+    if (!header.read(version) || version != currentVersion
+            || !header.read(directoryCount)
+            || !header.read(index->scanStartedAt)
+            || !header.read(directoryTableOffset)) {
+        return nullptr;
+    }
+
+    index->directoryOffsets.reserve(directoryCount);
+
+    BinaryReader directoryTable(index->data, index->size, directoryTableOffset);
+    for (quint32 i = 0; i < directoryCount; ++i) {
+        qint64 offset = 0;
+        if (!directoryTable.read(offset)) {
+            return nullptr;
+        }
+
+        // skip the timestamp and the counts, and read just the path
+        BinaryReader record(index->data, index->size, offset + 8 + 4 + 4);
+        QString path;
+        if (!record.readString(path)) {
+            return nullptr;
+        }
+
+        index->directoryOffsets.insert(path, offset);
+    }
+
+    return index;
+}
+
+bool FolderIndex::save(const QString& filename, qint64 scanStartedAt, std::vector<FolderScanner::DirectoryListing> listings)
+{
+    if (filename.isEmpty() || !QDir().mkpath(QFileInfo(filename).absolutePath())) {
+        return false;
+    }
+
+    std::sort(listings.begin(), listings.end(), [](const FolderScanner::DirectoryListing& lhs, const FolderScanner::DirectoryListing& rhs) {
+        return lhs.path < rhs.path;
+    });
+
+    QSaveFile file(filename);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    BinaryWriter writer(file);
+
+    writeHeader(writer, 0, 0, 0); // a placeholder, until we know the offsets
+
+    std::vector<qint64> offsets;
+    offsets.reserve(listings.size());
+
+    for (FolderScanner::DirectoryListing& listing : listings) {
+        std::sort(listing.images.begin(), listing.images.end(), [](const FolderScanner::ImageEntry& lhs, const FolderScanner::ImageEntry& rhs) {
+            return lhs.name < rhs.name;
+        });
+
+        offsets.push_back(writer.position());
+
+        writer.write<qint64>(listing.lastModified);
+        writer.write<quint32>(static_cast<quint32>(listing.images.size()));
+        writer.write<quint32>(static_cast<quint32>(listing.subdirectories.size()));
+
+        bool ok = writer.writeString(listing.path);
+
+        for (const QString& subdirectory : listing.subdirectories) {
+            ok = ok && writer.writeString(subdirectory);
+        }
+
+        for (const FolderScanner::ImageEntry& image : listing.images) {
+            writer.write<quint8>(image.status);
+            writer.write<qint64>(image.lastModified);
+            writer.write<qint64>(image.size);
+            ok = ok && writer.writeString(image.name);
+        }
+
+        if (!ok) {
+            file.cancelWriting();
+            return false;
+        }
+    }
+
+    const qint64 directoryTableOffset = writer.position();
+
+    for (qint64 offset : offsets) {
+        writer.write<qint64>(offset);
+    }
+
+    if (!writer.flush() || !file.seek(0)) {
+        file.cancelWriting();
+        return false;
+    }
+
+    writeHeader(writer, static_cast<quint32>(listings.size()), scanStartedAt, directoryTableOffset);
+
+    if (!writer.flush()) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool FolderIndex::getListing(const QString& relativePath, qint64 lastModified, FolderScanner::DirectoryListing& listing) const
+{
+    if (lastModified > scanStartedAt - timestampGranularityMsec) {
+        return false;
+    }
+
+    const auto i = directoryOffsets.constFind(relativePath);
+    if (i == directoryOffsets.constEnd()) {
+        return false;
+    }
+
+    BinaryReader reader(data, size, i.value());
+
+    qint64 indexedLastModified = 0;
+    quint32 imageCount = 0;
+    quint32 subdirectoryCount = 0;
+    QString path;
+
+    if (!reader.read(indexedLastModified) || indexedLastModified != lastModified
+            || !reader.read(imageCount)
+            || !reader.read(subdirectoryCount)
+            || !reader.readString(path)) {
+        return false;
+    }
+
+    FolderScanner::DirectoryListing result;
+    result.path = path;
+    result.lastModified = lastModified;
+
+    // the counts come from the file, so do not trust them blindly when reserving
+    result.subdirectories.reserve(std::min<quint32>(subdirectoryCount, 65536));
+    result.images.reserve(std::min<quint32>(imageCount, 65536));
+
+    for (quint32 j = 0; j < subdirectoryCount; ++j) {
+        QString subdirectory;
+        if (!reader.readString(subdirectory)) {
+            return false;
+        }
+        result.subdirectories.push_back(subdirectory);
+    }
+
+    for (quint32 j = 0; j < imageCount; ++j) {
+        FolderScanner::ImageEntry image;
+        if (!reader.read(image.status)
+                || !reader.read(image.lastModified)
+                || !reader.read(image.size)
+                || !reader.readString(image.name)) {
+            return false;
+        }
+        result.images.push_back(image);
+    }
+
+    listing = std::move(result);
+    return true;
+}
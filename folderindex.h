@@ -0,0 +1,45 @@
+#ifndef FOLDERINDEX_H
+#define FOLDERINDEX_H
+
+#include "folderscanner.h"
+
+#include <QFile>
+#include <QHash>
+#include <QString>
+#include <memory>
+#include <vector>
+
+// A compact binary snapshot of a scanned folder tree: for each directory, its
+// modification time, its subdirectories, and its (sorted) image files along
+// with their annotation status, modification time and size. When the same
+// folder is opened again, the directories whose modification time has not
+// changed can be taken from the index instead of being listed again.
+//
+// The file is memory-mapped when loaded, and the listings are decoded only
+// for the directories that are actually asked for.
+class FolderIndex
+{
+public:
+    static QString getIndexFilename(const QString& rootDirectory);
+
+    // Returns nullptr if the file does not exist, or is not a valid index
+    static std::shared_ptr<const FolderIndex> load(const QString& filename);
+
+    static bool save(const QString& filename, qint64 scanStartedAt, std::vector<FolderScanner::DirectoryListing> listings);
+
+    // Returns false if the directory is not in the index, or if it may have
+    // changed since it was indexed
+    bool getListing(const QString& relativePath, qint64 lastModified, FolderScanner::DirectoryListing& listing) const;
+
+private:
+    FolderIndex() = default;
+
+    QFile file;
+    const uchar* data = nullptr;
+    qint64 size = 0;
+    qint64 scanStartedAt = 0;
+
+    QHash<QString, qint64> directoryOffsets;
+};
+
+#endif // FOLDERINDEX_H
@@ -0,0 +1,338 @@
+#include "folderscanner.h"
+#include "folderindex.h"
+
+#include <QDirIterator>
+#include <QFileInfo>
+#include <QDateTime>
+#include <QHash>
+#include <QRunnable>
+#include <QThread>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+
+namespace {
+    const QLatin1String maskSuffix("_mask.png");
+    const QLatin1String tiledMaskSuffix("_mask.tiles");
+    const QLatin1String thingAnnotationsSuffix("_annotation_paths.json");
+    const QLatin1String inferenceResultPathSuffix("_result_path.json");
+    const QLatin1String inferenceResultImageSuffix("_result.png");
+
+    QString withoutSuffix(const QString& filename, const QLatin1String& suffix)
+    {
+        return filename.left(filename.length() - suffix.size());
+    }
+}
+
+struct FolderScanner::Scan
+{
+    QString rootDirectory; // either empty, or ends with a separator
+    QString indexFilename;
+    qint64 startedAt = 0;
+
+    std::shared_ptr<const FolderIndex> index; // loaded by the task listing the root directory
+
+    std::atomic<bool> canceled { false };
+    std::atomic<int> pendingDirectories { 0 };
+    std::atomic<int> directoriesScanned { 0 };
+    std::atomic<int> directoriesReused { 0 };
+    bool finished = false; // accessed from the GUI thread only
+
+    QMutex mutex;
+    Batch pendingListings;
+    Batch allListings; // collected only when there is an index to write
+};
+
+class FolderScanner::Task : public QRunnable
+{
+public:
+    explicit Task(const std::function<void()>& function)
+        : function(function)
+    {}
+
+    void run() override {
+        function();
+    }
+
+private:
+    const std::function<void()> function;
+};
+
+FolderScanner::FolderScanner(QObject* parent)
+    : QObject(parent)
+{
+    // Listing directories is mostly waiting for the (possibly networked) file system,
+    // so it pays off to have more threads than there are cores
+    threadPool.setMaxThreadCount(std::max(8, 2 * QThread::idealThreadCount()));
+
+    // One at a time, so that saves of the same index never overlap
+    indexThreadPool.setMaxThreadCount(1);
+
+    flushTimer.setInterval(200);
+    connect(&flushTimer, SIGNAL(timeout()), this, SLOT(flush()));
+}
+
+FolderScanner::~FolderScanner()
+{
+    cancel();
+    threadPool.waitForDone();
+    indexThreadPool.waitForDone();
+}
+
+void FolderScanner::start(const QString& rootDirectory, const QString& indexFilename)
+{
+    cancel();
+
+    auto scan = std::make_shared<Scan>();
+    scan->rootDirectory = rootDirectory;
+    if (!rootDirectory.isEmpty() && !rootDirectory.endsWith('/') && !rootDirectory.endsWith('\\')) {
+        scan->rootDirectory += '/';
+    }
+    scan->indexFilename = indexFilename;
+    scan->startedAt = QDateTime::currentMSecsSinceEpoch();
+
+    currentScan = scan;
+
+    schedule(scan, QString());
+
+    flushTimer.start();
+}
+
+void FolderScanner::cancel()
+{
+    if (currentScan && !currentScan->finished) {
+        currentScan->canceled = true;
+        currentScan->finished = true;
+        flushTimer.stop();
+        threadPool.clear(); // drop the directories that have not been started yet
+    }
+}
+
+bool FolderScanner::isRunning() const
+{
+    return currentScan && !currentScan->finished;
+}
+
+int FolderScanner::directoriesScanned() const
+{
+    return currentScan ? currentScan->directoriesScanned.load() : 0;
+}
+
+int FolderScanner::directoriesReused() const
+{
+    return currentScan ? currentScan->directoriesReused.load() : 0;
+}
+
+FolderScanner::EntryType FolderScanner::classify(const QString& filename)
+{
+    if (filename.endsWith(thingAnnotationsSuffix)) {
+        return EntryType::ThingAnnotations;
+    }
+    if (filename.endsWith(inferenceResultPathSuffix)) {
+        return EntryType::InferenceResultPath;
+    }
+    if (filename.endsWith(tiledMaskSuffix)) {
+        return EntryType::TiledMask;
+    }
+
+    const bool isImage = filename.endsWith(QLatin1String(".jpg"), Qt::CaseInsensitive)
+            || filename.endsWith(QLatin1String(".jpeg"), Qt::CaseInsensitive)
+            || filename.endsWith(QLatin1String(".png"), Qt::CaseInsensitive);
+
+    if (!isImage) {
+        return EntryType::Other;
+    }
+    if (filename.endsWith(maskSuffix)) {
+        return EntryType::Mask;
+    }
+    if (filename.endsWith(inferenceResultImageSuffix)) {
+        return EntryType::InferenceResultImage;
+    }
+    return EntryType::Image;
+}
+
+void FolderScanner::flush()
+{
+    const std::shared_ptr<Scan> scan = currentScan;
+    if (!scan || scan->finished) {
+        return;
+    }
+
+    Batch batch;
+    {
+        QMutexLocker locker(&scan->mutex);
+        batch.swap(scan->pendingListings);
+    }
+
+    if (!batch.empty()) {
+        emit batchReady(batch);
+
+        if (!scan->indexFilename.isEmpty()) {
+            QMutexLocker locker(&scan->mutex);
+            std::move(batch.begin(), batch.end(), std::back_inserter(scan->allListings));
+        }
+    }
+
+    if (scan != currentScan || scan->finished) {
+        return; // a receiver may have started a new scan, or canceled this one
+    }
+
+    if (scan->pendingDirectories == 0) {
+        scan->finished = true;
+        flushTimer.stop();
+
+        if (!scan->indexFilename.isEmpty()) {
+            // Not in the directory pool, which cancel() clears
+            indexThreadPool.start(new Task([scan]() {
+                FolderIndex::save(scan->indexFilename, scan->startedAt, std::move(scan->allListings));
+            }));
+        }
+
+        emit finished(false);
+    }
+}
+
+void FolderScanner::schedule(const std::shared_ptr<Scan>& scan, const QString& relativePath)
+{
+    ++scan->pendingDirectories;
+    threadPool.start(new Task([this, scan, relativePath]() {
+        scanDirectory(scan, relativePath);
+    }));
+}
+
+void FolderScanner::scanDirectory(const std::shared_ptr<Scan>& scan, const QString& relativePath)
+{
+    if (relativePath.isEmpty() && !scan->indexFilename.isEmpty()) {
+        // This is the root directory, so nothing else has been scheduled yet
+        scan->index = FolderIndex::load(scan->indexFilename);
+    }
+
+    if (!scan->canceled) {
+        const QString absolutePath = scan->rootDirectory + relativePath;
+        const qint64 lastModified = QFileInfo(absolutePath).lastModified().toMSecsSinceEpoch();
+
+        DirectoryListing listing;
+
+        if (scan->index && scan->index->getListing(relativePath, lastModified, listing)) {
+            refreshSidecarStatus(scan->rootDirectory, listing);
+            listing.fromIndex = true;
+            ++scan->directoriesReused;
+        }
+        else {
+            listing = listDirectory(scan->rootDirectory, relativePath, scan->canceled);
+            listing.lastModified = lastModified;
+        }
+
+        // Schedule the subdirectories before this directory is marked done,
+        // so that the pending counter cannot drop to zero prematurely
+        for (const QString& subdirectory : listing.subdirectories) {
+            schedule(scan, relativePath.isEmpty() ? subdirectory : relativePath + '/' + subdirectory);
+        }
+
+        ++scan->directoriesScanned;
+
+        // The listings with images go to the index only once they have been
+        // handed over (see flush), so that nothing needs to be copied
+        QMutexLocker locker(&scan->mutex);
+        if (!listing.images.empty()) {
+            scan->pendingListings.push_back(std::move(listing));
+        }
+        else if (!scan->indexFilename.isEmpty()) {
+            scan->allListings.push_back(std::move(listing));
+        }
+    }
+
+    if (--scan->pendingDirectories == 0) {
+        QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+    }
+}
+
+void FolderScanner::refreshSidecarStatus(const QString& rootDirectory, DirectoryListing& listing)
+{
+    // Creating or deleting a file changes the modification time of the directory,
+    // but rewriting one does not. Of the statuses, only whether the inference
+    // results are trivial depends on the contents of a file, so only those files
+    // need to be looked at again.
+    const QString directory = rootDirectory + (listing.path.isEmpty() ? QString() : listing.path + '/');
+
+    for (ImageEntry& entry : listing.images) {
+        if (entry.status & HasInferenceResultPath) {
+            const QFileInfo fileInfo(directory + entry.name + inferenceResultPathSuffix);
+            if (fileInfo.size() > 2) {
+                entry.status |= HasNonTrivialInferenceResultPath;
+            }
+            else {
+                entry.status &= ~HasNonTrivialInferenceResultPath;
+            }
+        }
+    }
+}
+
+FolderScanner::DirectoryListing FolderScanner::listDirectory(const QString& rootDirectory, const QString& relativePath, const std::atomic<bool>& canceled)
+{
+    DirectoryListing listing;
+    listing.path = relativePath;
+
+    const QString absolutePath = rootDirectory + relativePath;
+
+    // Maps image file names to the status implied by the sidecar files found
+    QHash<QString, quint8> sidecarStatus;
+
+    QDirIterator it(absolutePath, QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot);
+    while (it.hasNext() && !canceled) {
+        it.next();
+        const QString filename = it.fileName();
+        const QFileInfo fileInfo = it.fileInfo();
+
+        if (fileInfo.isDir()) {
+            if (!fileInfo.isSymLink()) {
+                listing.subdirectories.push_back(filename);
+            }
+            continue;
+        }
+
+        switch (classify(filename)) {
+        case EntryType::Image: {
+            ImageEntry entry;
+            entry.name = filename;
+            entry.lastModified = fileInfo.lastModified().toMSecsSinceEpoch();
+            entry.size = fileInfo.size();
+            listing.images.push_back(entry);
+            break;
+        }
+        case EntryType::Mask:
+            sidecarStatus[withoutSuffix(filename, maskSuffix)] |= HasMask;
+            break;
+        case EntryType::TiledMask:
+            sidecarStatus[withoutSuffix(filename, tiledMaskSuffix)] |= HasMask;
+            break;
+        case EntryType::ThingAnnotations:
+            sidecarStatus[withoutSuffix(filename, thingAnnotationsSuffix)] |= HasThingAnnotations;
+            break;
+        case EntryType::InferenceResultPath: {
+            quint8& status = sidecarStatus[withoutSuffix(filename, inferenceResultPathSuffix)];
+            status |= HasInferenceResultPath;
+            if (fileInfo.size() > 2) {
+                status |= HasNonTrivialInferenceResultPath;
+            }
+            break;
+        }
+        case EntryType::InferenceResultImage:
+            sidecarStatus[withoutSuffix(filename, inferenceResultImageSuffix)] |= HasInferenceResultImage;
+            break;
+        default:
+            break;
+        }
+    }
+
+    if (!sidecarStatus.isEmpty()) {
+        for (ImageEntry& entry : listing.images) {
+            const auto i = sidecarStatus.constFind(entry.name);
+            if (i != sidecarStatus.constEnd()) {
+                entry.status = i.value();
+            }
+        }
+    }
+
+    return listing;
+}
@@ -0,0 +1,101 @@
+#ifndef FOLDERSCANNER_H
+#define FOLDERSCANNER_H
+
+#include <QObject>
+#include <QString>
+#include <QMutex>
+#include <QThreadPool>
+#include <QTimer>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class FolderIndex;
+
+// Walks a folder tree in the background, so that each subdirectory is listed
+// as a separate task in a thread pool. The images found, along with their
+// annotation status, are handed back to the GUI thread in batches while the
+// scan is still in progress.
+//
+// If an index file is given, the directories that have not been modified
+// since the previous scan are taken from the index instead of being listed
+// again (only the inference result files that were there are looked at again,
+// as they may have been rewritten in place), and the index is rewritten when
+// the scan completes.
+class FolderScanner : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum class EntryType {
+        Other,
+        Image,
+        Mask,
+        TiledMask,
+        ThingAnnotations,
+        InferenceResultPath,
+        InferenceResultImage
+    };
+
+    enum StatusFlag : quint8 {
+        HasMask = 1 << 0,
+        HasThingAnnotations = 1 << 1,
+        HasInferenceResultPath = 1 << 2,
+        HasNonTrivialInferenceResultPath = 1 << 3,
+        HasInferenceResultImage = 1 << 4,
+    };
+
+    struct ImageEntry {
+        QString name; // just the file name, without the directory
+        quint8 status = 0;
+        qint64 lastModified = 0; // msecs since epoch
+        qint64 size = 0; // in bytes
+    };
+
+    struct DirectoryListing {
+        QString path; // relative to the root directory; empty for the root itself
+        qint64 lastModified = 0;
+        std::vector<QString> subdirectories; // just the names
+        std::vector<ImageEntry> images;
+        bool fromIndex = false; // if so, the files may have been rewritten since (see lastModified and size)
+    };
+
+    typedef std::vector<DirectoryListing> Batch;
+
+    explicit FolderScanner(QObject* parent = nullptr);
+    ~FolderScanner();
+
+    void start(const QString& rootDirectory, const QString& indexFilename = QString());
+    void cancel();
+
+    bool isRunning() const;
+    int directoriesScanned() const;
+    int directoriesReused() const;
+
+    // Does not allocate; just looks at the suffix of the file name
+    static EntryType classify(const QString& filename);
+
+signals:
+    void batchReady(const FolderScanner::Batch& batch);
+    void finished(bool canceled);
+
+private slots:
+    void flush();
+
+private:
+    struct Scan;
+    class Task;
+
+    void schedule(const std::shared_ptr<Scan>& scan, const QString& relativePath);
+    void scanDirectory(const std::shared_ptr<Scan>& scan, const QString& relativePath);
+
+    static void refreshSidecarStatus(const QString& rootDirectory, DirectoryListing& listing);
+    static DirectoryListing listDirectory(const QString& rootDirectory, const QString& relativePath, const std::atomic<bool>& canceled);
+
+    QThreadPool threadPool;
+    QThreadPool indexThreadPool; // for saving the index
+    QTimer flushTimer;
+    std::shared_ptr<Scan> currentScan;
+};
+
+#endif // FOLDERSCANNER_H
@@ -0,0 +1,418 @@
+#include "imageloader.h"
+#include "imagepyramid.h"
+#include "resultscache.h"
+#include "tiledmask.h"
+
+#include <QFuture>
+#include <QImageReader>
+#include <QRunnable>
+#include <QtConcurrent/QtConcurrentRun>
+
+namespace {
+    const size_t defaultCacheSize = 1024 * 1024 * 1024;
+
+    // Smaller images decode (and draw) fast enough as such
+    const qint64 previewMinimumPixelCount = 16 * 1024 * 1024;
+
+    QImage toDisplayFormat(const QImage& image)
+    {
+        switch (image.format()) {
+        case QImage::Format_Invalid:
+        case QImage::Format_RGB32:
+        case QImage::Format_ARGB32:
+        case QImage::Format_Grayscale8:
+            return image;
+        default:
+            break;
+        }
+
+        if (image.isGrayscale() && !image.hasAlphaChannel()) {
+            return image.convertToFormat(QImage::Format_Grayscale8);
+        }
+
+        // The channel selection expects (non-premultiplied) 32-bit pixels
+        return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    }
+
+    size_t estimateResultBytes(const InferenceResults& results)
+    {
+        size_t bytes = 0;
+        for (const QResultImageView::Result& result : results.results) {
+            bytes += sizeof(result) + result.contour.size() * sizeof(QPointF);
+        }
+        return bytes;
+    }
+}
+
+class ImageLoader::Worker : public QRunnable
+{
+public:
+    explicit Worker(ImageLoader* loader)
+        : loader(loader)
+    {}
+
+    void run() override {
+        loader->work();
+    }
+
+private:
+    ImageLoader* const loader;
+};
+
+class ImageLoader::Prefetcher : public QRunnable
+{
+public:
+    Prefetcher(ImageLoader* loader, const Request& request, quint64 generation)
+        : loader(loader)
+        , request(request)
+        , generation(generation)
+    {}
+
+    void run() override {
+        if (generation == loader->prefetchGeneration) {
+            loader->getBundle(request);
+        }
+    }
+
+private:
+    ImageLoader* const loader;
+    const Request request;
+    const quint64 generation;
+};
+
+class ImageLoader::PyramidBuilder : public QRunnable
+{
+public:
+    PyramidBuilder(const QImage& image, const Request& request)
+        : image(image)
+        , request(request)
+    {}
+
+    void run() override {
+        const QFileInfo source(request.imageFilename);
+        if (!ImagePyramid::isCached(request.pyramidCacheFilename, source)) {
+            ImagePyramid::build(image)->save(request.pyramidCacheFilename, source);
+        }
+    }
+
+private:
+    const QImage image;
+    const Request request;
+};
+
+ImageLoader::ImageLoader(QObject* parent)
+    : QObject(parent)
+    , cache(defaultCacheSize)
+{
+    // One request at a time; the decoding itself is parallelized within the request
+    threadPool.setMaxThreadCount(1);
+
+    // Leave most of the cores for loading the image actually asked for
+    prefetchThreadPool.setMaxThreadCount(2);
+
+    pyramidThreadPool.setMaxThreadCount(1);
+
+    // The full image being decoded, and possibly one that has been left to
+    // finish into the cache after a newer request came in
+    decodeThreadPool.setMaxThreadCount(2);
+}
+
+ImageLoader::~ImageLoader()
+{
+    cancel();
+    pyramidThreadPool.clear();
+    threadPool.waitForDone();
+    decodeThreadPool.waitForDone();
+    prefetchThreadPool.waitForDone();
+    pyramidThreadPool.waitForDone();
+}
+
+void ImageLoader::load(const Request& request)
+{
+    QMutexLocker locker(&mutex);
+
+    pendingRequest = request;
+    pendingGeneration = ++generation;
+
+    requestChanged.wakeAll(); // no need to wait for the full image of an earlier request
+
+    if (!workerRunning) {
+        workerRunning = true;
+        threadPool.start(new Worker(this));
+    }
+}
+
+void ImageLoader::cancel()
+{
+    ++prefetchGeneration;
+    prefetchThreadPool.clear();
+
+    QMutexLocker locker(&mutex);
+
+    ++generation;
+    pendingGeneration = 0;
+    completedGeneration = 0;
+    completedBundle.reset();
+
+    requestChanged.wakeAll();
+}
+
+void ImageLoader::prefetch(const std::vector<Request>& requests)
+{
+    const quint64 currentGeneration = ++prefetchGeneration;
+
+    prefetchThreadPool.clear();
+
+    for (const Request& request : requests) {
+        {
+            QMutexLocker locker(&cacheMutex);
+            if (cache.contains(request.imageFilename)) {
+                continue;
+            }
+        }
+        prefetchThreadPool.start(new Prefetcher(this, request, currentGeneration));
+    }
+}
+
+void ImageLoader::setCacheSize(size_t maxBytes)
+{
+    QMutexLocker locker(&cacheMutex);
+    cache.setMaxBytes(maxBytes);
+}
+
+void ImageLoader::clearCache()
+{
+    QMutexLocker locker(&cacheMutex);
+    cache.clear();
+}
+
+void ImageLoader::invalidate(const QString& imageFilename)
+{
+    QMutexLocker locker(&cacheMutex);
+
+    cache.remove(imageFilename);
+
+    if (loadingFilenames.contains(imageFilename)) {
+        // What is being loaded now may be older than what was just written
+        invalidatedAt[imageFilename] = ++tick;
+    }
+}
+
+ImageLoader::Bundle ImageLoader::loadBundle(const Request& request)
+{
+    const auto readImage = [](const QString& filename) {
+        return QImage(filename);
+    };
+
+    QFuture<SparseMask> maskFuture = QtConcurrent::run(TiledMask::readNewest, request.maskFilename, request.tiledMaskFilename);
+    QFuture<InferenceResults> thingAnnotationsFuture = QtConcurrent::run(readResultsJSON, request.thingAnnotationsFilename);
+    QFuture<InferenceResults> inferenceResultsFuture = QtConcurrent::run(ResultsCache::read, request.inferenceResultsFilename, request.inferenceResultsCacheFilename);
+
+    Bundle bundle;
+    bundle.request = request;
+    bundle.image = toDisplayFormat(readImage(request.imageFilename));
+    bundle.isGrayscale = bundle.image.isGrayscale();
+
+    bundle.mask = maskFuture.result();
+    bundle.thingAnnotations = thingAnnotationsFuture.result();
+    bundle.inferenceResults = inferenceResultsFuture.result();
+
+    return bundle;
+}
+
+ImageLoader::Bundle ImageLoader::loadPreview(const Request& request)
+{
+    Bundle bundle;
+    bundle.request = request;
+    bundle.isPreview = true;
+
+    if (!request.previewSize.isValid()) {
+        return bundle;
+    }
+
+    QImageReader reader(request.imageFilename);
+    const QSize fullSize = reader.size();
+
+    if (!fullSize.isValid()
+            || static_cast<qint64>(fullSize.width()) * fullSize.height() < previewMinimumPixelCount
+            || fullSize.width() < 2 * request.previewSize.width()
+            || fullSize.height() < 2 * request.previewSize.height()) {
+        return bundle;
+    }
+
+    const QSize previewSize = fullSize.scaled(request.previewSize, Qt::KeepAspectRatioByExpanding);
+
+    QImage preview = ImagePyramid::readLevel(request.pyramidCacheFilename, QFileInfo(request.imageFilename), previewSize);
+
+    if (preview.isNull()) {
+        reader.setScaledSize(previewSize);
+        preview = reader.read();
+    }
+
+    if (preview.isNull()) {
+        return bundle;
+    }
+
+    bundle.image = toDisplayFormat(preview);
+    bundle.fullSize = fullSize;
+    bundle.isGrayscale = bundle.image.isGrayscale();
+
+    return bundle;
+}
+
+std::shared_ptr<const ImageLoader::Bundle> ImageLoader::getCachedBundle(const QString& imageFilename)
+{
+    QMutexLocker locker(&cacheMutex);
+    return cache.get(imageFilename);
+}
+
+std::shared_ptr<const ImageLoader::Bundle> ImageLoader::getBundle(const Request& request)
+{
+    const QString& key = request.imageFilename;
+
+    QMutexLocker locker(&cacheMutex);
+
+    while (true) {
+        std::shared_ptr<const Bundle> cached = cache.get(key);
+        if (cached) {
+            return cached;
+        }
+        if (!loadingFilenames.contains(key)) {
+            break;
+        }
+        loadingFinished.wait(&cacheMutex);
+    }
+
+    loadingFilenames.insert(key);
+    const quint64 startedAt = ++tick;
+
+    locker.unlock();
+
+    std::shared_ptr<Bundle> bundle = std::make_shared<Bundle>(loadBundle(request));
+
+    locker.relock();
+
+    loadingFilenames.remove(key);
+
+    const auto i = invalidatedAt.constFind(key);
+    const bool isStale = i != invalidatedAt.constEnd() && i.value() > startedAt;
+
+    if (!isStale) {
+        cache.insert(key, bundle, estimateBytes(*bundle));
+    }
+
+    if (loadingFilenames.isEmpty()) {
+        invalidatedAt.clear();
+    }
+
+    loadingFinished.wakeAll();
+
+    if (isStale) {
+        // The files were written while they were being read, so read them again
+        locker.unlock();
+        return getBundle(request);
+    }
+
+    return bundle;
+}
+
+size_t ImageLoader::estimateBytes(const Bundle& bundle)
+{
+    return static_cast<size_t>(bundle.image.sizeInBytes())
+            + bundle.mask.bytes()
+            + estimateResultBytes(bundle.thingAnnotations)
+            + estimateResultBytes(bundle.inferenceResults);
+}
+
+void ImageLoader::work()
+{
+    while (true) {
+        Request request;
+        quint64 requestGeneration = 0;
+
+        {
+            QMutexLocker locker(&mutex);
+            if (pendingGeneration == 0) {
+                workerRunning = false;
+                return;
+            }
+            request = pendingRequest;
+            requestGeneration = pendingGeneration;
+            pendingGeneration = 0;
+        }
+
+        std::shared_ptr<const Bundle> bundle = getCachedBundle(request.imageFilename);
+
+        if (!bundle) {
+            // Decode the full image in parallel with the preview
+            const auto isDecoded = std::make_shared<bool>(false); // guarded by the mutex
+
+            QFuture<std::shared_ptr<const Bundle>> bundleFuture = QtConcurrent::run(&decodeThreadPool, [this, request, isDecoded]() {
+                std::shared_ptr<const Bundle> bundle = getBundle(request);
+                QMutexLocker locker(&mutex);
+                *isDecoded = true;
+                requestChanged.wakeAll();
+                return bundle;
+            });
+
+            const Bundle preview = loadPreview(request);
+            if (!preview.image.isNull() && !bundleFuture.isFinished()) {
+                setCompleted(std::make_shared<Bundle>(preview), requestGeneration);
+            }
+
+            bool isStale = false;
+            {
+                QMutexLocker locker(&mutex);
+                while (!*isDecoded && requestGeneration == generation) {
+                    requestChanged.wait(&mutex);
+                }
+                isStale = !*isDecoded;
+            }
+
+            if (isStale) {
+                // A newer request came in: it is taken on right away, and the
+                // full image of this one is left to finish into the cache
+                continue;
+            }
+
+            bundle = bundleFuture.result();
+        }
+
+        setCompleted(bundle, requestGeneration);
+
+        const QImage& image = bundle->image;
+        if (!request.pyramidCacheFilename.isEmpty() && static_cast<qint64>(image.width()) * image.height() >= previewMinimumPixelCount
+                && !ImagePyramid::isCached(request.pyramidCacheFilename, QFileInfo(request.imageFilename))) {
+            // Only the pyramid of the latest image is worth building, so at most
+            // one build (holding on to a full image) is kept waiting
+            pyramidThreadPool.clear();
+            pyramidThreadPool.start(new PyramidBuilder(image, request));
+        }
+    }
+}
+
+void ImageLoader::setCompleted(const std::shared_ptr<const Bundle>& bundle, quint64 requestGeneration)
+{
+    QMutexLocker locker(&mutex);
+    if (requestGeneration == generation) {
+        completedBundle = bundle;
+        completedGeneration = requestGeneration;
+        QMetaObject::invokeMethod(this, "deliver", Qt::QueuedConnection);
+    }
+}
+
+void ImageLoader::deliver()
+{
+    std::shared_ptr<const Bundle> bundle;
+
+    {
+        QMutexLocker locker(&mutex);
+        if (completedGeneration == 0 || completedGeneration != generation) {
+            return; // a newer request was made after this one was completed
+        }
+        bundle.swap(completedBundle);
+        completedGeneration = 0;
+    }
+
+    emit loaded(*bundle);
+}
@@ -0,0 +1,137 @@
+#ifndef IMAGELOADER_H
+#define IMAGELOADER_H
+
+#include "inferenceresults.h"
+#include "lrucache.h"
+#include "sparsemask.h"
+
+#include <QHash>
+#include <QImage>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QSize>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// Loads the image to be shown, along with its mask and annotations, in the
+// background. Only the latest request counts: the requests made while an
+// earlier one is still being loaded replace each other, so that just the last
+// one gets loaded next, and a result that has become stale in the meantime is
+// dropped instead of being delivered. The next request does not wait for the
+// full image of an overtaken one, which is left to finish into the cache.
+//
+// The image is converted to the format used for showing it already in the
+// background. The mask is kept sparse, so that a cached bundle takes memory
+// only for the part of the mask that is annotated.
+//
+// For large images that are not in the cache, a preview is first decoded at a
+// reduced resolution (for JPEG, the decoder can do this at a fraction of the
+// cost of a full decode), and delivered while the full-resolution image is
+// still being decoded. The preview is delivered at its reduced size, together
+// with the size of the full image, so that it can be shown stretched to where
+// the full image will be, without a full-size copy of it. If enabled,
+// an image pyramid of each large image is built in the background and cached
+// on disk, and next time, the preview is taken from there.
+//
+// The images next to the current one can be prefetched into a cache (bounded
+// by the number of bytes), so that stepping through them is instant. When the
+// annotations of an image are written, its cached copy must be invalidated.
+class ImageLoader : public QObject
+{
+    Q_OBJECT
+
+public:
+    struct Request {
+        QString imageFilename;
+        QString maskFilename;
+        QString tiledMaskFilename; // if it is newer than the PNG mask, it is read instead
+        QString thingAnnotationsFilename;
+        QString inferenceResultsFilename;
+        QString inferenceResultsCacheFilename; // empty, if the parsed results are not cached
+        QSize previewSize; // roughly the size of the viewport; if not valid, no preview is made
+        QString pyramidCacheFilename; // empty, if the pyramids are not cached
+    };
+
+    struct Bundle {
+        Request request;
+        bool isPreview = false; // if so, there is just the image, and the full bundle follows
+        QImage image;
+        QSize fullSize; // of a preview, the size of the full image (which the preview is smaller than)
+        bool isGrayscale = false; // checking may require looking at every pixel, so it's done here
+        SparseMask mask; // null, if there is no mask
+        InferenceResults thingAnnotations;
+        InferenceResults inferenceResults;
+    };
+
+    explicit ImageLoader(QObject* parent = nullptr);
+    ~ImageLoader();
+
+    void load(const Request& request);
+    void cancel(); // nothing gets delivered before the next request
+
+    // Replaces any earlier prefetch requests not yet started. The requests are
+    // handled in the order given, so the most important ones should come first.
+    void prefetch(const std::vector<Request>& requests);
+
+    void setCacheSize(size_t maxBytes);
+    void clearCache();
+
+    // To be called after any of the files of the image has been written
+    void invalidate(const QString& imageFilename);
+
+    // Does the actual work; safe to call from any thread
+    static Bundle loadBundle(const Request& request);
+    static Bundle loadPreview(const Request& request); // the image may be null, if no preview is needed
+
+signals:
+    void loaded(const ImageLoader::Bundle& bundle);
+
+private slots:
+    void deliver();
+
+private:
+    class Worker;
+    class Prefetcher;
+    class PyramidBuilder;
+
+    void work();
+
+    // Returns the cached bundle, or loads it (or waits for another thread already
+    // loading it)
+    std::shared_ptr<const Bundle> getBundle(const Request& request);
+    std::shared_ptr<const Bundle> getCachedBundle(const QString& imageFilename);
+
+    void setCompleted(const std::shared_ptr<const Bundle>& bundle, quint64 requestGeneration);
+
+    static size_t estimateBytes(const Bundle& bundle);
+
+    QThreadPool threadPool;
+    QThreadPool prefetchThreadPool;
+    QThreadPool pyramidThreadPool;
+    QThreadPool decodeThreadPool;
+
+    std::atomic<quint64> generation { 0 }; // incremented for each request (and cancel)
+    std::atomic<quint64> prefetchGeneration { 0 };
+
+    QMutex mutex;
+    QWaitCondition requestChanged; // or the full image has been decoded
+    Request pendingRequest;
+    quint64 pendingGeneration = 0; // 0 if there is no pending request
+    bool workerRunning = false;
+    std::shared_ptr<const Bundle> completedBundle;
+    quint64 completedGeneration = 0; // 0 if there is nothing to deliver
+
+    QMutex cacheMutex;
+    QWaitCondition loadingFinished;
+    LruCache<QString, Bundle> cache;
+    QSet<QString> loadingFilenames;
+    quint64 tick = 0; // for telling whether a load started before an invalidation
+    QHash<QString, quint64> invalidatedAt; // needed only while something is being loaded
+};
+
+#endif // IMAGELOADER_H
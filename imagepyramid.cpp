@@ -0,0 +1,344 @@
+#include "imagepyramid.h"
+#include "binaryio.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFuture>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+#include <string.h>
+
+namespace {
+    const char magic[8] = { 'A', 'N', 'N', 'O', 'P', 'Y', 'R', '1' };
+    const quint32 currentVersion = 1;
+
+    // magic, version, source size, source modification time, alpha, level count, offset of the level table
+    const qint64 headerSize = 8 + 4 + 8 + 8 + 1 + 4 + 8;
+
+    // The levels are just for looking at, so they need not be lossless (unless
+    // there is transparency to keep)
+    const int jpegQuality = 90;
+
+    struct Header {
+        qint64 sourceSize = 0;
+        qint64 sourceLastModified = 0;
+        bool hasAlphaChannel = false;
+        quint32 levelCount = 0;
+        qint64 levelTableOffset = 0;
+    };
+
+    struct TileEntry {
+        qint64 offset;
+        quint32 length;
+    };
+
+    void writeHeader(BinaryWriter& writer, const Header& header)
+    {
+        for (char c : magic) {
+            writer.write<qint8>(c);
+        }
+        writer.write<quint32>(currentVersion);
+        writer.write<qint64>(header.sourceSize);
+        writer.write<qint64>(header.sourceLastModified);
+        writer.write<quint8>(header.hasAlphaChannel ? 1 : 0);
+        writer.write<quint32>(header.levelCount);
+        writer.write<qint64>(header.levelTableOffset);
+    }
+
+    // Returns false if the data is not a valid pyramid of the current version of the source
+    bool readHeader(const uchar* data, qint64 size, const QFileInfo& source, Header& header)
+    {
+        if (data == nullptr || size < headerSize || memcmp(data, magic, sizeof(magic)) != 0) {
+            return false;
+        }
+
+        BinaryReader reader(data, size, sizeof(magic));
+        quint32 version = 0;
+        quint8 hasAlphaChannel = 0;
+
+        if (!reader.read(version) || version != currentVersion
+                || !reader.read(header.sourceSize)
+                || !reader.read(header.sourceLastModified)
+                || !reader.read(hasAlphaChannel)
+                || !reader.read(header.levelCount)
+                || !reader.read(header.levelTableOffset)) {
+            return false;
+        }
+
+        header.hasAlphaChannel = hasAlphaChannel != 0;
+
+        return header.sourceSize == source.size()
+                && header.sourceLastModified == source.lastModified().toMSecsSinceEpoch();
+    }
+
+    int getTileCount(int length)
+    {
+        return (length + ImagePyramid::tileSize - 1) / ImagePyramid::tileSize;
+    }
+
+    QRect getTileRect(const QImage& image, int column, int row)
+    {
+        return QRect(column * ImagePyramid::tileSize, row * ImagePyramid::tileSize, ImagePyramid::tileSize, ImagePyramid::tileSize) & image.rect();
+    }
+
+    QImage halve(const QImage& image)
+    {
+        // The bands start at even rows, so each one can be scaled on its own
+        const int bandHeight = 2 * ImagePyramid::tileSize;
+
+        std::vector<QFuture<QImage>> bands;
+        for (int y = 0; y < image.height(); y += bandHeight) {
+            bands.push_back(QtConcurrent::run([&image, y, bandHeight]() {
+                const QImage band = image.copy(0, y, image.width(), std::min(bandHeight, image.height() - y));
+                return band.scaled((band.width() + 1) / 2, (band.height() + 1) / 2, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+            }));
+        }
+
+        QImage result;
+
+        int y = 0;
+        for (QFuture<QImage>& future : bands) {
+            const QImage band = future.result();
+            if (result.isNull()) {
+                result = QImage((image.width() + 1) / 2, (image.height() + 1) / 2, band.format());
+            }
+            const int bytesPerLine = std::min(band.bytesPerLine(), result.bytesPerLine());
+            for (int row = 0; row < band.height() && y < result.height(); ++row, ++y) {
+                memcpy(result.scanLine(y), band.constScanLine(row), bytesPerLine);
+            }
+        }
+
+        return result;
+    }
+
+    QByteArray encodeTile(const QImage& image, const QRect& rect, bool hasAlphaChannel)
+    {
+        QByteArray bytes;
+        QBuffer buffer(&bytes);
+        buffer.open(QIODevice::WriteOnly);
+        if (hasAlphaChannel) {
+            image.copy(rect).save(&buffer, "PNG");
+        }
+        else {
+            image.copy(rect).save(&buffer, "JPG", jpegQuality);
+        }
+        return bytes;
+    }
+}
+
+std::shared_ptr<const ImagePyramid> ImagePyramid::build(const QImage& image)
+{
+    std::shared_ptr<ImagePyramid> pyramid(new ImagePyramid);
+
+    if (image.isNull()) {
+        return pyramid;
+    }
+
+    pyramid->levels.push_back(image);
+
+    while (pyramid->levels.back().width() > tileSize || pyramid->levels.back().height() > tileSize) {
+        const QImage next = halve(pyramid->levels.back());
+        if (next.isNull()) {
+            break;
+        }
+        pyramid->levels.push_back(next);
+    }
+
+    return pyramid;
+}
+
+QString ImagePyramid::getCacheFilename(const QString& imageFilename)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty() || imageFilename.isEmpty()) {
+        return QString();
+    }
+
+    const QString canonicalFilename = QDir::cleanPath(QFileInfo(imageFilename).absoluteFilePath());
+    const QByteArray key = QCryptographicHash::hash(canonicalFilename.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    return cacheDirectory + "/image-pyramid/" + QString::fromLatin1(key) + ".pyr";
+}
+
+bool ImagePyramid::isCached(const QString& cacheFilename, const QFileInfo& source)
+{
+    QFile file(cacheFilename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    const QByteArray bytes = file.read(headerSize);
+
+    Header header;
+    return readHeader(reinterpret_cast<const uchar*>(bytes.constData()), bytes.size(), source, header);
+}
+
+bool ImagePyramid::save(const QString& cacheFilename, const QFileInfo& source) const
+{
+    if (cacheFilename.isEmpty() || levels.size() < 2 || !QDir().mkpath(QFileInfo(cacheFilename).absolutePath())) {
+        return false;
+    }
+
+    QSaveFile file(cacheFilename);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    Header header;
+    header.sourceSize = source.size();
+    header.sourceLastModified = source.lastModified().toMSecsSinceEpoch();
+    header.hasAlphaChannel = levels.front().hasAlphaChannel();
+
+    BinaryWriter writer(file);
+
+    writeHeader(writer, Header()); // a placeholder, until we know the offsets
+
+    // Level 0 is the image itself, so it is not stored
+    std::vector<std::vector<TileEntry>> tileEntries(levels.size());
+
+    for (size_t level = 1; level < levels.size(); ++level) {
+        const QImage& image = levels[level];
+
+        std::vector<QFuture<QByteArray>> tiles;
+        for (int row = 0, rows = getTileCount(image.height()); row < rows; ++row) {
+            for (int column = 0, columns = getTileCount(image.width()); column < columns; ++column) {
+                tiles.push_back(QtConcurrent::run(encodeTile, image, getTileRect(image, column, row), header.hasAlphaChannel));
+            }
+        }
+
+        for (QFuture<QByteArray>& tile : tiles) {
+            const QByteArray bytes = tile.result();
+            tileEntries[level].push_back(TileEntry { writer.position(), static_cast<quint32>(bytes.size()) });
+            if (bytes.isEmpty() || !writer.writeBytes(bytes)) {
+                file.cancelWriting();
+                return false;
+            }
+        }
+    }
+
+    header.levelCount = static_cast<quint32>(levels.size() - 1);
+    header.levelTableOffset = writer.position();
+
+    for (size_t level = 1; level < levels.size(); ++level) {
+        writer.write<quint32>(static_cast<quint32>(levels[level].width()));
+        writer.write<quint32>(static_cast<quint32>(levels[level].height()));
+        for (const TileEntry& entry : tileEntries[level]) {
+            writer.write<qint64>(entry.offset);
+            writer.write<quint32>(entry.length);
+        }
+    }
+
+    if (!writer.flush() || !file.seek(0)) {
+        file.cancelWriting();
+        return false;
+    }
+
+    writeHeader(writer, header);
+
+    if (!writer.flush()) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+QImage ImagePyramid::readLevel(const QString& cacheFilename, const QFileInfo& source, const QSize& minimumSize)
+{
+    QFile file(cacheFilename);
+    if (cacheFilename.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        return QImage();
+    }
+
+    const qint64 size = file.size();
+    const uchar* data = file.map(0, size);
+
+    Header header;
+    if (!readHeader(data, size, source, header)) {
+        return QImage();
+    }
+
+    struct Level {
+        QSize size;
+        std::vector<TileEntry> tiles;
+    };
+
+    std::vector<Level> levels(header.levelCount);
+
+    BinaryReader levelTable(data, size, header.levelTableOffset);
+
+    for (Level& level : levels) {
+        quint32 width = 0;
+        quint32 height = 0;
+        if (!levelTable.read(width) || !levelTable.read(height) || width == 0 || height == 0 || width > 0xffffff || height > 0xffffff) {
+            return QImage();
+        }
+
+        level.size = QSize(width, height);
+        level.tiles.resize(static_cast<size_t>(getTileCount(width)) * getTileCount(height));
+
+        for (TileEntry& tile : level.tiles) {
+            if (!levelTable.read(tile.offset) || !levelTable.read(tile.length) || tile.offset < 0 || tile.offset + tile.length > size) {
+                return QImage();
+            }
+        }
+    }
+
+    // The levels get smaller, so the last one that is large enough is the one we want
+    const auto isLargeEnough = [&minimumSize](const Level& level) {
+        return level.size.width() >= minimumSize.width() && level.size.height() >= minimumSize.height();
+    };
+
+    const auto i = std::find_if(levels.rbegin(), levels.rend(), isLargeEnough);
+    if (i == levels.rend()) {
+        return QImage();
+    }
+
+    const Level& level = *i;
+
+    QImage result(level.size, header.hasAlphaChannel ? QImage::Format_ARGB32 : QImage::Format_RGB32);
+    if (result.isNull()) {
+        return QImage();
+    }
+
+    const int columns = getTileCount(level.size.width());
+
+    // The tiles do not overlap, so they can be decoded straight into the result
+    // in parallel. The pixels are taken here once, as scanLine() would detach
+    // the image, which is not safe to do from several threads.
+    uchar* const bits = result.bits();
+    const int bytesPerLine = result.bytesPerLine();
+    const QImage::Format format = result.format();
+
+    std::vector<QFuture<bool>> tiles;
+    tiles.reserve(level.tiles.size());
+
+    for (size_t tile = 0; tile < level.tiles.size(); ++tile) {
+        const TileEntry entry = level.tiles[tile];
+        const QRect tileRect = getTileRect(result, static_cast<int>(tile % columns), static_cast<int>(tile / columns));
+
+        tiles.push_back(QtConcurrent::run([bits, bytesPerLine, format, data, entry, tileRect]() {
+            const QImage decoded = QImage::fromData(data + entry.offset, static_cast<int>(entry.length)).convertToFormat(format);
+            if (decoded.size() != tileRect.size()) {
+                return false;
+            }
+            const int bytesPerPixel = 4;
+            for (int row = 0; row < tileRect.height(); ++row) {
+                memcpy(bits + static_cast<qint64>(tileRect.y() + row) * bytesPerLine + tileRect.x() * bytesPerPixel, decoded.constScanLine(row), tileRect.width() * bytesPerPixel);
+            }
+            return true;
+        }));
+    }
+
+    bool ok = true;
+    for (QFuture<bool>& tile : tiles) {
+        ok = tile.result() && ok;
+    }
+
+    return ok ? result : QImage();
+}
@@ -0,0 +1,46 @@
+#ifndef IMAGEPYRAMID_H
+#define IMAGEPYRAMID_H
+
+#include <QFileInfo>
+#include <QImage>
+#include <QSize>
+#include <QString>
+#include <memory>
+#include <vector>
+
+// A multi-resolution pyramid of an image, for getting a reduced-resolution
+// preview of a very large image without decoding the full-resolution pixels.
+// Level 0 is the image itself, and each next level halves the size, until the
+// whole image fits in a single tile (of 256 x 256 pixels).
+//
+// On disk, the levels after the first one are stored as independently encoded
+// tiles, so that a single level can be read (and decoded in parallel) without
+// touching the rest.
+class ImagePyramid
+{
+public:
+    static const int tileSize = 256;
+
+    // The work is split across the global thread pool
+    static std::shared_ptr<const ImagePyramid> build(const QImage& image);
+
+    // Where the pyramid of the image would be cached on disk
+    static QString getCacheFilename(const QString& imageFilename);
+
+    // Returns true if there is a cached pyramid made of the current version of the image
+    static bool isCached(const QString& cacheFilename, const QFileInfo& source);
+
+    bool save(const QString& cacheFilename, const QFileInfo& source) const;
+
+    // Reads the smallest cached level that is still at least the given size in
+    // both dimensions. Returns a null image if there is no such level, or if the
+    // cache does not match the current version of the image.
+    static QImage readLevel(const QString& cacheFilename, const QFileInfo& source, const QSize& minimumSize);
+
+private:
+    ImagePyramid() = default;
+
+    std::vector<QImage> levels;
+};
+
+#endif // IMAGEPYRAMID_H
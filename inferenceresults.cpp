@@ -0,0 +1,735 @@
+#include "inferenceresults.h"
+
+#include <QCoreApplication>
+#include <QFile>
+#include <QLocale>
+#include <algorithm>
+#include <cmath>
+#include <ctype.h>
+#include <limits>
+#include <string.h>
+
+namespace {
+    const int compactVersion = 2;
+
+    // Exactly representable as doubles
+    const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    int toInt(double value) // like QJsonValue::toInt
+    {
+        const bool isInt = value >= std::numeric_limits<int>::min()
+                && value <= std::numeric_limits<int>::max()
+                && static_cast<int>(value) == value;
+        return isInt ? static_cast<int>(value) : 0;
+    }
+
+    // Parses the results straight from the UTF-8 bytes, without building a
+    // document first: the points go directly into the contours. Both the
+    // original format (an array of colors and their paths) and the compact one
+    // (an object with a version) are understood. The keys may be in any order,
+    // and unknown ones are skipped. A value of an unexpected type counts as
+    // zero or empty, as it would with QJsonValue. Keys are compared as they are
+    // in the file, so escapes in them are not decoded.
+    class ResultsParser
+    {
+    public:
+        ResultsParser(const char* begin, const char* end)
+            : position(begin)
+            , begin(begin)
+            , end(end)
+        {}
+
+        bool parse(std::vector<QResultImageView::Result>& results)
+        {
+            if (end - position >= 3 && memcmp(position, "\xEF\xBB\xBF", 3) == 0) {
+                position += 3; // byte order mark
+            }
+
+            bool ok = false;
+            if (isAt('[')) {
+                ok = parseArray([&]() { return parseColorAndPaths(results); });
+            }
+            else if (isAt('{')) {
+                ok = parseCompact(results);
+            }
+            else {
+                ok = skipValue(); // valid, but not results
+            }
+
+            skipWhitespace();
+            return ok && position == end;
+        }
+
+        qint64 offset() const
+        {
+            return position - begin;
+        }
+
+        bool isNewerVersion() const
+        {
+            return version > compactVersion;
+        }
+
+    private:
+        bool parseCompact(std::vector<QResultImageView::Result>& results)
+        {
+            const size_t first = results.size();
+            std::vector<QColor> classColors;
+            std::vector<int> classIndices; // of each path
+
+            const bool ok = parseObject([&](const QLatin1String& key) {
+                if (key == QLatin1String("version")) {
+                    return parseNumberOrZero(version);
+                }
+                if (key == QLatin1String("classes")) {
+                    return parseClasses(classColors);
+                }
+                if (key == QLatin1String("paths")) {
+                    return parseCompactPaths(results, classIndices);
+                }
+                return skipValue();
+            });
+
+            if (!ok || isNewerVersion()) {
+                return false;
+            }
+
+            // The classes may come after the paths
+            for (size_t i = 0; i < classIndices.size(); ++i) {
+                const int classIndex = classIndices[i];
+                const bool isValid = classIndex >= 0 && classIndex < static_cast<int>(classColors.size());
+                results[first + i].pen = QPen(isValid ? classColors[classIndex] : QColor(0, 0, 0, 0));
+            }
+
+            return true;
+        }
+
+        bool parseClasses(std::vector<QColor>& classColors)
+        {
+            if (!isAt('[')) {
+                return skipValue();
+            }
+
+            return parseArray([&]() {
+                int rgba[4] = { 0, 0, 0, 0 };
+                const bool ok = !isAt('{') ? skipValue() : parseObject([&](const QLatin1String& key) {
+                    if (key == QLatin1String("color")) {
+                        return parseNumbers([&](int index, double value) {
+                            if (index < 4) {
+                                rgba[index] = toInt(value);
+                            }
+                        });
+                    }
+                    return skipValue(); // the name is for people reading the file
+                });
+                classColors.push_back(QColor(rgba[0], rgba[1], rgba[2], rgba[3]));
+                return ok;
+            });
+        }
+
+        bool parseCompactPaths(std::vector<QResultImageView::Result>& results, std::vector<int>& classIndices)
+        {
+            if (!isAt('[')) {
+                return skipValue();
+            }
+
+            return parseArray([&]() {
+                QResultImageView::Result result;
+                double classIndex = -1;
+                const bool ok = !isAt('{') ? skipValue() : parseObject([&](const QLatin1String& key) {
+                    if (key == QLatin1String("class")) {
+                        return parseNumberOrZero(classIndex);
+                    }
+                    if (key == QLatin1String("points")) {
+                        return parseFlatPath(result.contour);
+                    }
+                    return skipValue();
+                });
+                results.push_back(std::move(result));
+                classIndices.push_back(toInt(classIndex));
+                return ok;
+            });
+        }
+
+        // The coordinates as x0, y0, x1, y1, ...; a dangling x is dropped
+        bool parseFlatPath(std::vector<QPointF>& contour)
+        {
+            points.clear();
+            double x = 0;
+
+            const bool ok = parseNumbers([&](int index, double value) {
+                if (index % 2 == 0) {
+                    x = value;
+                }
+                else {
+                    points.push_back(QPointF(x, value));
+                }
+            });
+
+            contour.assign(points.begin(), points.end());
+            return ok;
+        }
+
+        // Calls back with each number of an array (and its index)
+        template <typename OnNumber>
+        bool parseNumbers(OnNumber onNumber)
+        {
+            if (!isAt('[')) {
+                return skipValue();
+            }
+
+            int index = 0;
+            return parseArray([&]() {
+                double value = 0;
+                if (!parseNumberOrZero(value)) {
+                    return false;
+                }
+                onNumber(index++, value);
+                return true;
+            });
+        }
+
+        bool parseColorAndPaths(std::vector<QResultImageView::Result>& results)
+        {
+            if (!isAt('{')) {
+                return skipValue();
+            }
+
+            const size_t first = results.size();
+            int rgba[4] = { 0, 0, 0, 0 };
+
+            const bool ok = parseObject([&](const QLatin1String& key) {
+                if (key == QLatin1String("color")) {
+                    return parseColor(rgba);
+                }
+                if (key == QLatin1String("color_paths")) {
+                    return parsePaths(results);
+                }
+                return skipValue();
+            });
+
+            // The color may come after the paths
+            const QPen pen(QColor(rgba[0], rgba[1], rgba[2], rgba[3]));
+            for (size_t i = first, count = results.size(); i < count; ++i) {
+                results[i].pen = pen;
+            }
+
+            return ok;
+        }
+
+        bool parseColor(int (&rgba)[4])
+        {
+            if (!isAt('{')) {
+                return skipValue();
+            }
+
+            return parseObject([&](const QLatin1String& key) {
+                const int channel = key == QLatin1String("r") ? 0
+                        : key == QLatin1String("g") ? 1
+                        : key == QLatin1String("b") ? 2
+                        : key == QLatin1String("a") ? 3
+                        : -1;
+                if (channel < 0) {
+                    return skipValue();
+                }
+                double value = 0;
+                if (!parseNumberOrZero(value)) {
+                    return false;
+                }
+                rgba[channel] = toInt(value);
+                return true;
+            });
+        }
+
+        bool parsePaths(std::vector<QResultImageView::Result>& results)
+        {
+            if (!isAt('[')) {
+                return skipValue();
+            }
+
+            return parseArray([&]() {
+                QResultImageView::Result result;
+                if (!parsePath(result.contour)) {
+                    return false;
+                }
+                results.push_back(std::move(result));
+                return true;
+            });
+        }
+
+        bool parsePath(std::vector<QPointF>& contour)
+        {
+            if (!isAt('[')) {
+                return skipValue();
+            }
+
+            // The points are collected into a buffer that is reused from path
+            // to path, so that each contour can be allocated at its exact size
+            points.clear();
+
+            const bool ok = parseArray([&]() {
+                QPointF point;
+                if (!parsePoint(point)) {
+                    return false;
+                }
+                points.push_back(point);
+                return true;
+            });
+
+            contour.assign(points.begin(), points.end());
+            return ok;
+        }
+
+        bool parsePoint(QPointF& point)
+        {
+            if (!isAt('{')) {
+                return skipValue();
+            }
+
+            return parseObject([&](const QLatin1String& key) {
+                if (key == QLatin1String("x")) {
+                    return parseNumberOrZero(point.rx());
+                }
+                if (key == QLatin1String("y")) {
+                    return parseNumberOrZero(point.ry());
+                }
+                return skipValue();
+            });
+        }
+
+        template <typename ParseMember>
+        bool parseObject(ParseMember parseMember)
+        {
+            if (!consume('{')) {
+                return false;
+            }
+            if (consume('}')) {
+                return true;
+            }
+            do {
+                QLatin1String key;
+                if (!parseKey(key) || !parseMember(key)) {
+                    return false;
+                }
+            } while (consume(','));
+            return consume('}');
+        }
+
+        template <typename ParseElement>
+        bool parseArray(ParseElement parseElement)
+        {
+            if (!consume('[')) {
+                return false;
+            }
+            if (consume(']')) {
+                return true;
+            }
+            do {
+                if (!parseElement()) {
+                    return false;
+                }
+            } while (consume(','));
+            return consume(']');
+        }
+
+        bool parseKey(QLatin1String& key)
+        {
+            if (!isAt('"')) {
+                return false;
+            }
+            const char* const start = position + 1;
+            if (!skipString()) {
+                return false;
+            }
+            key = QLatin1String(start, static_cast<int>(position - 1 - start));
+            return consume(':');
+        }
+
+        bool parseNumberOrZero(double& value)
+        {
+            skipWhitespace();
+            if (position < end && (*position == '-' || isDigit(*position))) {
+                return parseNumber(value);
+            }
+            value = 0;
+            return skipValue();
+        }
+
+        bool parseNumber(double& value)
+        {
+            const char* const start = position;
+
+            const bool isNegative = position < end && *position == '-';
+            if (isNegative) {
+                ++position;
+            }
+            if (position == end || !isDigit(*position)) {
+                return false;
+            }
+
+            // Up to 19 significant digits fit in the mantissa; any more only
+            // matter for the slow path anyway
+            quint64 mantissa = 0;
+            int significantDigits = 0;
+            int exponent = 0;
+
+            const auto addDigit = [&](char c) {
+                if (significantDigits >= 19) {
+                    return false;
+                }
+                mantissa = mantissa * 10 + (c - '0');
+                if (mantissa > 0) {
+                    ++significantDigits;
+                }
+                return true;
+            };
+
+            for (; position < end && isDigit(*position); ++position) {
+                if (!addDigit(*position)) {
+                    ++exponent;
+                }
+            }
+
+            if (position < end && *position == '.') {
+                ++position;
+                if (position == end || !isDigit(*position)) {
+                    return false;
+                }
+                for (; position < end && isDigit(*position); ++position) {
+                    if (addDigit(*position)) {
+                        --exponent;
+                    }
+                }
+            }
+
+            if (position < end && (*position == 'e' || *position == 'E')) {
+                ++position;
+                const bool isNegativeExponent = position < end && *position == '-';
+                if (position < end && (*position == '-' || *position == '+')) {
+                    ++position;
+                }
+                if (position == end || !isDigit(*position)) {
+                    return false;
+                }
+                int explicitExponent = 0;
+                for (; position < end && isDigit(*position); ++position) {
+                    explicitExponent = std::min(explicitExponent * 10 + (*position - '0'), 100000);
+                }
+                exponent += isNegativeExponent ? -explicitExponent : explicitExponent;
+            }
+
+            if (significantDigits <= 15 && exponent >= -22 && exponent <= 22) {
+                // Both the mantissa and the power of ten are exact, so a single
+                // multiplication or division gives the correctly rounded result
+                value = static_cast<double>(mantissa);
+                value = exponent < 0 ? value / powersOfTen[-exponent] : value * powersOfTen[exponent];
+                if (isNegative) {
+                    value = -value;
+                }
+            }
+            else {
+                value = QByteArray::fromRawData(start, static_cast<int>(position - start)).toDouble();
+            }
+
+            return true;
+        }
+
+        // Expects to be at the opening quote; stops after the closing one
+        bool skipString()
+        {
+            for (++position; position < end; ++position) {
+                if (*position == '\\') {
+                    ++position;
+                }
+                else if (*position == '"') {
+                    ++position;
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Skips any value, including whole objects and arrays, without
+        // recursion, so that deep nesting is no problem
+        bool skipValue()
+        {
+            int depth = 0;
+            do {
+                skipWhitespace();
+                if (position == end) {
+                    return false;
+                }
+                const char c = *position;
+                if (c == '"') {
+                    if (!skipString()) {
+                        return false;
+                    }
+                }
+                else if (c == '{' || c == '[') {
+                    ++depth;
+                    ++position;
+                }
+                else if (c == '}' || c == ']') {
+                    if (depth == 0) {
+                        return false;
+                    }
+                    --depth;
+                    ++position;
+                }
+                else if (c == ',' || c == ':') {
+                    if (depth == 0) {
+                        return false;
+                    }
+                    ++position;
+                }
+                else {
+                    // A number, or true, false or null
+                    const char* const start = position;
+                    while (position < end && (isalnum(static_cast<unsigned char>(*position)) || *position == '-' || *position == '+' || *position == '.')) {
+                        ++position;
+                    }
+                    if (position == start) {
+                        return false;
+                    }
+                }
+            } while (depth > 0);
+            return true;
+        }
+
+        void skipWhitespace()
+        {
+            while (position < end && (*position == ' ' || *position == '\n' || *position == '\r' || *position == '\t')) {
+                ++position;
+            }
+        }
+
+        bool isAt(char c)
+        {
+            skipWhitespace();
+            return position < end && *position == c;
+        }
+
+        bool consume(char c)
+        {
+            if (isAt(c)) {
+                ++position;
+                return true;
+            }
+            return false;
+        }
+
+        const char* position;
+        const char* const begin;
+        const char* const end;
+        std::vector<QPointF> points;
+        double version = 0;
+    };
+
+    // Not to be called with non-finite values, as JSON has no way to write them
+    void appendNumber(QByteArray& json, double value)
+    {
+        // Most coordinates are whole numbers, and those are quick to format
+        if (value == std::floor(value) && std::abs(value) < 1e15) {
+            json.append(QByteArray::number(static_cast<qint64>(value)));
+        }
+        else {
+            json.append(QByteArray::number(value, 'g', QLocale::FloatingPointShortest));
+        }
+    }
+
+    void appendString(QByteArray& json, const QString& value)
+    {
+        json.append('"');
+        for (const char c : value.toUtf8()) {
+            if (c == '"' || c == '\\') {
+                json.append('\\');
+                json.append(c);
+            }
+            else if (static_cast<unsigned char>(c) < 0x20) {
+                json.append("\\u00");
+                json.append("0123456789abcdef"[c >> 4]);
+                json.append("0123456789abcdef"[c & 0xf]);
+            }
+            else {
+                json.append(c);
+            }
+        }
+        json.append('"');
+    }
+
+    bool isFinite(const QPointF& point)
+    {
+        return std::isfinite(point.x()) && std::isfinite(point.y());
+    }
+
+    size_t getPointCount(const std::vector<QResultImageView::Result>& results)
+    {
+        size_t pointCount = 0;
+        for (const QResultImageView::Result& result : results) {
+            pointCount += result.contour.size();
+        }
+        return pointCount;
+    }
+
+    int getReserveSize(size_t size)
+    {
+        return static_cast<int>(std::min<size_t>(size, std::numeric_limits<int>::max() / 2));
+    }
+
+    // As written by earlier versions, with a color object and a path array per
+    // path, though without the indentation
+    QByteArray toOriginalResultsJSON(const std::vector<QResultImageView::Result>& results)
+    {
+        QByteArray json;
+        json.reserve(getReserveSize(16 + results.size() * 96 + getPointCount(results) * 24));
+
+        json.append('[');
+
+        for (size_t i = 0; i < results.size(); ++i) {
+            const QResultImageView::Result& result = results[i];
+            const QColor color = result.pen.color();
+            json.append(i == 0 ? "\n{\"color\":{\"r\":" : ",\n{\"color\":{\"r\":");
+            json.append(QByteArray::number(color.red()));
+            json.append(",\"g\":").append(QByteArray::number(color.green()));
+            json.append(",\"b\":").append(QByteArray::number(color.blue()));
+            json.append(",\"a\":").append(QByteArray::number(color.alpha()));
+            json.append("},\"color_paths\":[[");
+            bool isFirst = true;
+            for (const QPointF& point : result.contour) {
+                if (!isFinite(point)) {
+                    continue;
+                }
+                json.append(isFirst ? "{\"x\":" : ",{\"x\":");
+                isFirst = false;
+                appendNumber(json, point.x());
+                json.append(",\"y\":");
+                appendNumber(json, point.y());
+                json.append('}');
+            }
+            json.append("]]}");
+        }
+
+        json.append("\n]\n");
+
+        return json;
+    }
+}
+
+ResultsFormat getResultsFormat(const QString& filename)
+{
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return ResultsFormat::Compact;
+    }
+
+    // The original format is an array, and the compact one an object
+    const QByteArray start = file.peek(1024).trimmed();
+    const int offset = start.startsWith("\xEF\xBB\xBF") ? 3 : 0;
+    const QByteArray afterByteOrderMark = start.mid(offset).trimmed();
+    return afterByteOrderMark.startsWith('[') ? ResultsFormat::Original : ResultsFormat::Compact;
+}
+
+InferenceResults readResultsJSON(const QString& filename)
+{
+    InferenceResults results;
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return results;
+    }
+
+    const qint64 size = file.size();
+    if (size == 0) {
+        return results;
+    }
+
+    QByteArray contents;
+    const char* data = reinterpret_cast<const char*>(file.map(0, size));
+    if (!data) {
+        contents = file.readAll(); // not a regular file, perhaps
+        data = contents.constData();
+    }
+
+    ResultsParser parser(data, data + (contents.isNull() ? size : contents.size()));
+    if (!parser.parse(results.results)) {
+        results.results.clear();
+        results.error = parser.isNewerVersion()
+                ? QCoreApplication::translate("MainWindow", "The JSON file %1 is of a newer version than this version of anno can read").arg(filename)
+                : QCoreApplication::translate("MainWindow", "Unable to parse the JSON file %1 (at byte %2)").arg(filename).arg(parser.offset());
+    }
+
+    return results;
+}
+
+QByteArray toResultsJSON(const std::vector<QResultImageView::Result>& results, const QHash<QRgb, QString>& classNames, ResultsFormat format)
+{
+    if (format == ResultsFormat::Original) {
+        return toOriginalResultsJSON(results);
+    }
+
+    std::vector<QRgb> classColors;
+    QHash<QRgb, int> classIndices;
+
+    for (const QResultImageView::Result& result : results) {
+        const QRgb rgba = result.pen.color().rgba();
+        if (!classIndices.contains(rgba)) {
+            classIndices.insert(rgba, static_cast<int>(classColors.size()));
+            classColors.push_back(rgba);
+        }
+    }
+
+    QByteArray json;
+    json.reserve(getReserveSize(64 + classColors.size() * 64 + results.size() * 24 + getPointCount(results) * 16));
+
+    json.append("{\"version\":");
+    json.append(QByteArray::number(compactVersion));
+    json.append(",\"classes\":[");
+
+    for (size_t i = 0; i < classColors.size(); ++i) {
+        const QRgb rgba = classColors[i];
+        json.append(i == 0 ? "\n{\"name\":" : ",\n{\"name\":");
+        appendString(json, classNames.value(rgba));
+        json.append(",\"color\":[");
+        json.append(QByteArray::number(qRed(rgba))).append(',');
+        json.append(QByteArray::number(qGreen(rgba))).append(',');
+        json.append(QByteArray::number(qBlue(rgba))).append(',');
+        json.append(QByteArray::number(qAlpha(rgba)));
+        json.append("]}");
+    }
+
+    json.append("],\"paths\":[");
+
+    // One path per line, so that the files still diff reasonably
+    for (size_t i = 0; i < results.size(); ++i) {
+        const QResultImageView::Result& result = results[i];
+        json.append(i == 0 ? "\n{\"class\":" : ",\n{\"class\":");
+        json.append(QByteArray::number(classIndices.value(result.pen.color().rgba())));
+        json.append(",\"points\":[");
+        bool isFirst = true;
+        for (const QPointF& point : result.contour) {
+            if (!isFinite(point)) {
+                continue;
+            }
+            if (!isFirst) {
+                json.append(',');
+            }
+            isFirst = false;
+            appendNumber(json, point.x());
+            json.append(',');
+            appendNumber(json, point.y());
+        }
+        json.append("]}");
+    }
+
+    json.append("]}\n");
+
+    return json;
+}
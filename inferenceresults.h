@@ -0,0 +1,39 @@
+#ifndef INFERENCERESULTS_H
+#define INFERENCERESULTS_H
+
+#include "QResultImageView/QResultImageView.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <vector>
+
+// The thing annotations of an image, or the inference results for it: both are
+// stored as colored paths in the same JSON format. The original format is an
+// array of objects, each with a color (as an object of r, g, b and a) and its
+// paths (each an array of objects of x and y). The compact format (version 2)
+// is an object: a table of classes (the name, and the color as an array), and
+// the paths, each with the index of its class and a flat array of coordinates.
+struct InferenceResults
+{
+    std::vector<QResultImageView::Result> results;
+    QString error;
+};
+
+// Returns empty results if the file does not exist. Safe to call from any thread.
+// The file is parsed directly from memory-mapped bytes, without a DOM, so even
+// very large files take little memory on top of the results themselves.
+InferenceResults readResultsJSON(const QString& filename);
+
+enum class ResultsFormat { Original, Compact };
+
+// Returns the format of the file, or the compact one if there is no such file.
+// Reads only the start of it.
+ResultsFormat getResultsFormat(const QString& filename);
+
+// Formats the results. In the compact format, the class names are looked up by
+// color; colors not found are written without a name. Points with a non-finite
+// coordinate are left out, as JSON has no way to write them.
+QByteArray toResultsJSON(const std::vector<QResultImageView::Result>& results, const QHash<QRgb, QString>& classNames, ResultsFormat format = ResultsFormat::Compact);
+
+#endif // INFERENCERESULTS_H
@@ -0,0 +1,90 @@
+#ifndef LRUCACHE_H
+#define LRUCACHE_H
+
+#include <QHash>
+#include <list>
+#include <memory>
+
+// A least-recently-used cache bounded by the (estimated) number of bytes held.
+// The values are shared, so that a value evicted while still in use stays valid
+// for as long as someone holds it. Not thread-safe as such.
+template <typename Key, typename Value>
+class LruCache
+{
+public:
+    explicit LruCache(size_t maxBytes = 0)
+        : maxBytes(maxBytes)
+    {}
+
+    // Returns nullptr if not found
+    std::shared_ptr<const Value> get(const Key& key) {
+        const auto i = index.find(key);
+        if (i == index.end()) {
+            return nullptr;
+        }
+        entries.splice(entries.begin(), entries, i.value()); // now the most recently used
+        return i.value()->value;
+    }
+
+    bool contains(const Key& key) const {
+        return index.contains(key);
+    }
+
+    void insert(const Key& key, const std::shared_ptr<const Value>& value, size_t bytes) {
+        remove(key);
+        if (bytes > maxBytes) {
+            return; // would just evict everything else
+        }
+        entries.push_front(Entry { key, value, bytes });
+        index.insert(key, entries.begin());
+        totalBytes += bytes;
+        evict();
+    }
+
+    void remove(const Key& key) {
+        const auto i = index.find(key);
+        if (i != index.end()) {
+            totalBytes -= i.value()->bytes;
+            entries.erase(i.value());
+            index.erase(i);
+        }
+    }
+
+    void clear() {
+        entries.clear();
+        index.clear();
+        totalBytes = 0;
+    }
+
+    void setMaxBytes(size_t bytes) {
+        maxBytes = bytes;
+        evict();
+    }
+
+    size_t bytes() const {
+        return totalBytes;
+    }
+
+private:
+    struct Entry {
+        Key key;
+        std::shared_ptr<const Value> value;
+        size_t bytes;
+    };
+
+    void evict() {
+        while (totalBytes > maxBytes && !entries.empty()) {
+            const Entry& leastRecentlyUsed = entries.back();
+            totalBytes -= leastRecentlyUsed.bytes;
+            index.remove(leastRecentlyUsed.key);
+            entries.pop_back();
+        }
+    }
+
+    std::list<Entry> entries; // the most recently used first
+    QHash<Key, typename std::list<Entry>::iterator> index;
+    size_t maxBytes = 0;
+    size_t totalBytes = 0;
+};
+
+#endif // LRUCACHE_H
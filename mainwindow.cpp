@@ -1,17 +1,28 @@
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
 #include "version.h"
+#include "folderindex.h"
+#include "filelistmodel.h"
+#include "imageloader.h"
+#include "imagepyramid.h"
+#include "resultscache.h"
+#include "maskpalette.h"
+#include "tiledmask.h"
 
 #include "cpp-move-file-to-trash/move-file-to-trash.h"
 
 #include <QSettings>
 #include <QTimer>
 #include <QListWidget>
+#include <QListView>
 #include <QFileDialog>
 #include <QDirIterator>
 #include <QDockWidget>
 #include <QSpinBox>
 #include <QCheckBox>
+#include <QComboBox>
+#include <QLineEdit>
+#include <QActionGroup>
 #include <QGroupBox>
 #include <QPushButton>
 #include <QRadioButton>
@@ -29,32 +40,40 @@
 #include <QJsonArray>
 #include <QJsonObject>
 #include <QBuffer>
+#include <QDataStream>
+#include <QSaveFile>
 #include <QKeyEvent>
 #include <QtUiTools>
 #include <QHash>
+#include <QStatusBar>
 #include <assert.h>
 #include <chrono>
-#include <unordered_set>
-#include <functional>
 #include <memory> // std::unique_ptr
 
 namespace {
     const char* companyName = "Tomaattinen";
     const char* applicationName = "anno";
     const char* classListFilename = "anno_classes.json";
-    const int fullnameRole = Qt::UserRole + 0;
     const QColor cleanColor = QColor(0, 255, 0, 64);
     const QColor ignoreColor = QColor(127, 127, 127, 128);
 
-    const QColor hasAnnotationsColor = QColor(192, 255, 192);
-    const QColor hasInferenceResultsColor = Qt::black;
-    const QColor hasInferenceResultsFileColor = Qt::gray;
-    const QColor hasNoInferenceResultsFileColor = Qt::lightGray;
+    // The deltas are small, so this is enough for thousands of steps
+    const size_t maxMaskUndoBufferBytes = 256 * 1024 * 1024;
+    const size_t maxAnnotationUndoBufferBytes = 64 * 1024 * 1024;
+
+    // For the histories of the images not currently shown
+    const size_t maxUndoHistoryMemoryBytes = 256 * 1024 * 1024;
+    const size_t maxUndoHistoryDiskBytes = 4096ull * 1024 * 1024;
 }
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow)
+    ui(new Ui::MainWindow),
+    maskUndoBuffer(maxMaskUndoBufferBytes),
+    maskRedoBuffer(maxMaskUndoBufferBytes),
+    annotationUndoBuffer(maxAnnotationUndoBufferBytes),
+    annotationRedoBuffer(maxAnnotationUndoBufferBytes),
+    undoHistoryStore(maxUndoHistoryMemoryBytes, maxUndoHistoryDiskBytes)
 {
     ui->setupUi(this);
 
@@ -63,6 +82,8 @@ MainWindow::MainWindow(QWidget *parent) :
     recentFoldersMenu = new QMenu(tr("&Recent folders"), this);
     ui->menuFile->insertMenu(ui->actionExit, recentFoldersMenu);
 
+    createNavigationFilterMenuItems();
+
     setWindowTitle("anno");
 
     const QSettings settings(companyName, applicationName);
@@ -73,9 +94,42 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->actionExit, SIGNAL(triggered()), this, SLOT(close()));
     connect(ui->actionUndo, SIGNAL(triggered()), this, SLOT(onUndo()));
     connect(ui->actionRedo, SIGNAL(triggered()), this, SLOT(onRedo()));
+    connect(ui->actionNextMatching, SIGNAL(triggered()), this, SLOT(onNextMatchingFile()));
+    connect(ui->actionPreviousMatching, SIGNAL(triggered()), this, SLOT(onPreviousMatchingFile()));
     connect(ui->actionRestoreDefaultWindowPositions, SIGNAL(triggered()), this, SLOT(onRestoreDefaultWindowPositions()));
     connect(ui->actionAbout, SIGNAL(triggered()), this, SLOT(onAbout()));
 
+    imageLoader = new ImageLoader(this);
+    imageLoader->setCacheSize(static_cast<size_t>(settings.value("imageCacheMegabytes", 1024).toInt()) * 1024 * 1024);
+    prefetchCount = settings.value("prefetchCount", 2).toInt();
+    cacheInferenceResults = settings.value("cacheInferenceResults", true).toBool();
+    if (cacheInferenceResults) {
+        // In the background, as there may be lots of files to go through
+        QtConcurrent::run(ResultsCache::prune, static_cast<qint64>(settings.value("resultsCacheMegabytes", 1024).toInt()) * 1024 * 1024);
+    }
+    connect(imageLoader, SIGNAL(loaded(ImageLoader::Bundle)), this, SLOT(onImageLoaded(ImageLoader::Bundle)));
+
+    maskSaver = new MaskSaver(imageLoader, &maskJournal, this);
+    ui->actionSaveIndexedMasks->setChecked(settings.value("saveIndexedMasks", false).toBool());
+    ui->actionSaveTiledMasks->setChecked(settings.value("saveTiledMasks", false).toBool());
+    ui->actionCacheImagePyramids->setChecked(settings.value("cacheImagePyramids", false).toBool());
+    connect(ui->actionConvertMasksToTiles, SIGNAL(triggered()), this, SLOT(onConvertMasksToTiles()));
+    connect(ui->actionConvertMasksToPng, SIGNAL(triggered()), this, SLOT(onConvertMasksToPng()));
+    connect(ui->actionConvertThingAnnotations, SIGNAL(triggered()), this, SLOT(onConvertThingAnnotations()));
+    connect(maskSaver, SIGNAL(failed(QString)), this, SLOT(onSaveFailed(QString)));
+
+    thingAnnotationSaver = new ThingAnnotationSaver(imageLoader, this);
+    connect(thingAnnotationSaver, SIGNAL(failed(QString)), this, SLOT(onSaveFailed(QString)));
+
+    folderScanner = new FolderScanner(this);
+    connect(folderScanner, SIGNAL(batchReady(FolderScanner::Batch)), this, SLOT(onFolderScanBatchReady(FolderScanner::Batch)));
+    connect(folderScanner, SIGNAL(finished(bool)), this, SLOT(onFolderScanFinished(bool)));
+
+    stopFolderScanButton = new QPushButton(tr("Stop scanning"), this);
+    stopFolderScanButton->setVisible(false);
+    statusBar()->addPermanentWidget(stopFolderScanButton);
+    connect(stopFolderScanButton, SIGNAL(clicked()), this, SLOT(onStopFolderScan()));
+
     QStringList recentFolders = settings.value("recentFolders").toStringList();
     for (int i = recentFolders.size() - 1; i >= 0; --i) { // load in reverse order
         addRecentFolderMenuItem(recentFolders[i]);
@@ -86,6 +140,8 @@ MainWindow::MainWindow(QWidget *parent) :
 
 MainWindow::~MainWindow()
 {
+    delete maskSaver; // lets any pending saves finish while the image loader still exists
+    delete thingAnnotationSaver;
     delete ui;
 }
 
@@ -93,11 +149,26 @@ void MainWindow::closeEvent(QCloseEvent *event)
 {
     saveMaskIfDirty();
 
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    maskSaver->flush();
+    thingAnnotationSaver->flush();
+    QApplication::restoreOverrideCursor();
+
+    folderScanner->cancel();
+    imageLoader->cancel();
+
     QSettings settings(companyName, applicationName);
     settings.setValue("mainWindowGeometry", saveGeometry());
     settings.setValue("mainWindowState", saveState());
     settings.setValue("reverseFileOrder", reverseFileOrder);
+    settings.setValue("naturalFileOrder", naturalFileOrder->isChecked());
+    settings.setValue("fileSortKey", fileSortKey->currentData());
+    settings.setValue("fileFilter", fileFilter->currentData());
+    settings.setValue("navigationFilter", static_cast<int>(getNavigationFilter()));
     settings.setValue("annotateThings", annotateThings->isChecked());
+    settings.setValue("saveIndexedMasks", ui->actionSaveIndexedMasks->isChecked());
+    settings.setValue("saveTiledMasks", ui->actionSaveTiledMasks->isChecked());
+    settings.setValue("cacheImagePyramids", ui->actionCacheImagePyramids->isChecked());
 
     if (markingRadius) {
         settings.setValue("markingRadius", markingRadius->value());
@@ -122,22 +193,7 @@ void MainWindow::closeEvent(QCloseEvent *event)
         settings.setValue("channelSelection", "rgb");
     }
 
-    if (files->count() > 0) {
-        QProgressDialog progress("", tr("Stop"), 0, 0, this);
-        progress.setWindowModality(Qt::WindowModal);
-        progress.setMinimumDuration(200);
-
-        files->setUpdatesEnabled(false);
-
-        if (cleanFileList(&progress)) {
-            QMainWindow::closeEvent(event);
-        }
-        else {
-            event->ignore();
-        }
-
-        files->setUpdatesEnabled(true);
-    }
+    QMainWindow::closeEvent(event);
 }
 
 void MainWindow::init()
@@ -150,6 +206,11 @@ void MainWindow::init()
     image->setMarkingRadius(markingRadius->value());
 
     const QSettings settings(companyName, applicationName);
+
+    // The folder is scanned in the background, so the default file gets selected once found
+    fileToSelectWhenFound = settings.value("defaultFile").toString();
+    selectFileWhenFound = true;
+
     const QString defaultDirectory = settings.value("defaultDirectory").toString();
     if (!defaultDirectory.isEmpty()) {
         openFolder(defaultDirectory);
@@ -163,37 +224,10 @@ void MainWindow::init()
     defaultGeometry = saveGeometry();
     defaultState = saveState();
 
-    /*const bool geometryRestored =*/ restoreGeometry(settings.value("mainWindowGeometry").toByteArray());
-    /*const bool stateRestored =*/ restoreState(settings.value("mainWindowState").toByteArray());
-
-    if (files->count() > 0) {
-        const QString defaultFile = settings.value("defaultFile").toString();
-        bool defaultFileFound = false;
-
-        if (!defaultFile.isEmpty()) {
-            for (int i = 0, end = files->count(); i < end; ++i) {
-                QListWidgetItem* file = files->item(i);
-                if (file->text() == defaultFile) {
-                    defaultFileFound = true;
-                    files->scrollToItem(file, QListWidget::EnsureVisible);
-                    file->setSelected(true);
-                    onFileClicked(file);
-                    break;
-                }
-            }
-        }
-
-        if (!defaultFileFound) {
-            QListWidgetItem* firstFile = files->item(0);
-            firstFile->setSelected(true);
-            onFileClicked(firstFile);
-        }
-    }
-
     restoreGeometry(settings.value("mainWindowGeometry").toByteArray());
     restoreState(settings.value("mainWindowState").toByteArray());
 
-    connect(files, SIGNAL(currentItemChanged(QListWidgetItem*, QListWidgetItem*)), this, SLOT(onFileItemChanged(QListWidgetItem*, QListWidgetItem*)));
+    connect(files->selectionModel(), SIGNAL(currentChanged(QModelIndex, QModelIndex)), this, SLOT(onCurrentFileChanged(QModelIndex, QModelIndex)));
 
     setFocusPolicy(Qt::StrongFocus);
 }
@@ -220,11 +254,25 @@ void MainWindow::createImageView()
     setCentralWidget(image);
 
     connect(image, SIGNAL(annotationUpdating()), this, SLOT(onPostponeMaskUpdate()));
-    connect(image, SIGNAL(annotationUpdated()), this, SLOT(onAnnotationUpdated()));
+    if (image->metaObject()->indexOfSignal("annotationUpdated(QRect)") >= 0) {
+        // The view tells which part of the mask a stroke changed, so only that is read back
+        connect(image, SIGNAL(annotationUpdated(QRect)), this, SLOT(onAnnotationUpdated(QRect)));
+    }
+    else {
+        connect(image, SIGNAL(annotationUpdated()), this, SLOT(onAnnotationUpdated()));
+    }
     connect(image, SIGNAL(panned()), this, SLOT(onPostponeMaskUpdate()));
     connect(image, SIGNAL(zoomed()), this, SLOT(onPostponeMaskUpdate()));
     connect(image, SIGNAL(newMarkingRadius(int)), this, SLOT(onNewMarkingRadius(int)));
     connect(image, SIGNAL(makeAnnotationsVisible(bool)), this, SLOT(onAnnotationsVisible(bool)));
+
+    // Versions of the view that can take a part of the mask at a time let undo
+    // and redo hand over just the rectangle that changed
+    viewTakesMaskArea = image->metaObject()->indexOfMethod("setMaskArea(QImage,QPoint)") >= 0;
+
+    // Likewise, the preview of a large image can be drawn at the size of the
+    // full image, without first scaling it up
+    viewStretchesImage = image->metaObject()->indexOfMethod("setImage(QImage,QSize)") >= 0;
 }
 
 void MainWindow::createFileList()
@@ -241,26 +289,85 @@ void MainWindow::createFileList()
     layout->setSpacing(0);
     layout->setMargin(1);
 
+    searchField = new QLineEdit(this);
+    searchField->setPlaceholderText(tr("Search file names"));
+    searchField->setClearButtonEnabled(true);
+
+    searchSyntax = new QComboBox(this);
+    searchSyntax->addItem(tr("Contains"), static_cast<int>(FileNameIndex::Syntax::Substring));
+    searchSyntax->addItem(tr("Wildcard"), static_cast<int>(FileNameIndex::Syntax::Wildcard));
+    searchSyntax->addItem(tr("Regex"), static_cast<int>(FileNameIndex::Syntax::RegularExpression));
+    searchSyntax->setToolTip(tr("How the search text is matched against the file names (case-insensitively).\n"
+                                "A wildcard pattern without a slash is matched against the file name only; otherwise, against the whole path."));
+
+    QHBoxLayout* searchLayout = new QHBoxLayout;
+    searchLayout->addWidget(searchField);
+    searchLayout->addWidget(searchSyntax);
+    layout->addLayout(searchLayout);
+
+    // Search only once the user pauses typing
+    searchTimer = new QTimer(this);
+    searchTimer->setSingleShot(true);
+    searchTimer->setInterval(150);
+
     hideUnannotatedFiles = new QCheckBox(tr("Hide unannotated"), this);
     layout->addWidget(hideUnannotatedFiles);
 
-    files = new QListWidget(this);
+    const QSettings settings(companyName, applicationName);
+
+    naturalFileOrder = new QCheckBox(tr("Natural order"), this);
+    naturalFileOrder->setToolTip(tr("Compare numbers within file names by their value, so that for example img2 comes before img10"));
+    naturalFileOrder->setChecked(settings.value("naturalFileOrder", false).toBool());
+    layout->addWidget(naturalFileOrder);
+
+    fileSortKey = new QComboBox(this);
+    fileSortKey->addItem(tr("Sort by name"), static_cast<int>(FileListModel::SortBy::Name));
+    fileSortKey->addItem(tr("Sort by modification time"), static_cast<int>(FileListModel::SortBy::LastModified));
+    fileSortKey->addItem(tr("Sort by file size"), static_cast<int>(FileListModel::SortBy::Size));
+    fileSortKey->addItem(tr("Sort by annotation status"), static_cast<int>(FileListModel::SortBy::AnnotationStatus));
+    fileSortKey->addItem(tr("Sort by inference results"), static_cast<int>(FileListModel::SortBy::InferenceResults));
+    fileSortKey->addItem(tr("Sort by image dimensions"), static_cast<int>(FileListModel::SortBy::ImageDimensions));
+    fileSortKey->setToolTip(tr("Press S to reverse the order"));
+    fileSortKey->setCurrentIndex(std::max(0, fileSortKey->findData(settings.value("fileSortKey", 0).toInt())));
+    currentFileSortKeyIndex = fileSortKey->currentIndex();
+    layout->addWidget(fileSortKey);
+
+    fileFilter = new QComboBox(this);
+    fileFilter->addItem(tr("Show all"), static_cast<int>(FileListModel::Filter::All));
+    fileFilter->addItem(tr("Show annotated"), static_cast<int>(FileListModel::Filter::Annotated));
+    fileFilter->addItem(tr("Show unannotated"), static_cast<int>(FileListModel::Filter::Unannotated));
+    fileFilter->addItem(tr("Show with inference results"), static_cast<int>(FileListModel::Filter::HasResults));
+    fileFilter->addItem(tr("Show stuff annotations only"), static_cast<int>(FileListModel::Filter::StuffOnly));
+    fileFilter->addItem(tr("Show thing annotations only"), static_cast<int>(FileListModel::Filter::ThingsOnly));
+    fileFilter->addItem(tr("Show annotated, without inference results"), static_cast<int>(FileListModel::Filter::AnnotatedWithoutResults));
+    fileFilter->addItem(tr("Show unannotated, with inference results"), static_cast<int>(FileListModel::Filter::UnannotatedWithResults));
+    fileFilter->setCurrentIndex(std::max(0, fileFilter->findData(settings.value("fileFilter", 0).toInt())));
+    layout->addWidget(fileFilter);
+
+    fileList = new FileListModel(this);
+    fileList->setReversed(reverseFileOrder);
+    fileList->setFilter(static_cast<FileListModel::Filter>(fileFilter->currentData().toInt()));
+
+    files = new QListView(this);
     files->setUniformItemSizes(true);
+    files->setEditTriggers(QAbstractItemView::NoEditTriggers);
+    files->setSelectionMode(QAbstractItemView::SingleSelection);
+    files->setModel(fileList);
 
     layout->addWidget(files);
 
     files->setFont(QFont("Arial", 8, 0));
 
-    QStringList columns;
-    columns.append(tr("Name"));
-
-    QListWidgetItem* headerItem = new QListWidgetItem(files);
-    headerItem->setTextAlignment(Qt::AlignLeft);
-
-    connect(files, SIGNAL(itemClicked(QListWidgetItem*)), this, SLOT(onFileClicked(QListWidgetItem*)));
+    connect(files, SIGNAL(clicked(const QModelIndex&)), this, SLOT(onFileClicked(const QModelIndex&)));
     connect(files, SIGNAL(activated(const QModelIndex&)), this, SLOT(onFileActivated(const QModelIndex&)));
 
     connect(hideUnannotatedFiles, SIGNAL(toggled(bool)), this, SLOT(onHideUnannotatedFilesToggled(bool)));
+    connect(naturalFileOrder, SIGNAL(toggled(bool)), this, SLOT(onNaturalFileOrderToggled(bool)));
+    connect(fileSortKey, SIGNAL(currentIndexChanged(int)), this, SLOT(onFileSortKeyChanged(int)));
+    connect(fileFilter, SIGNAL(currentIndexChanged(int)), this, SLOT(onFileFilterChanged(int)));
+    connect(searchField, SIGNAL(textChanged(QString)), searchTimer, SLOT(start()));
+    connect(searchSyntax, SIGNAL(currentIndexChanged(int)), searchTimer, SLOT(start()));
+    connect(searchTimer, SIGNAL(timeout()), this, SLOT(onSearch()));
 }
 
 void MainWindow::createToolList()
@@ -560,235 +667,208 @@ void MainWindow::onOpenRecentFolder()
     }
 }
 
-#if QT_VERSION < QT_VERSION_CHECK(5, 15, 0)
-namespace std {
-  template<> struct hash<QString> {
-    std::size_t operator()(const QString& s) const {
-      return (size_t) qHash(s);
-    }
-  };
-}
-#endif // QT_VERSION
-
 void MainWindow::openFolder(const QString& dir)
 {
     saveMaskIfDirty();
 
+    folderScanner->cancel();
+
     setWindowTitle(tr("anno @ %1").arg(dir));
 
     if (!files) {
         createFileList();
     }
 
-    files->setUpdatesEnabled(false);
+    currentImageFileId = -1;
 
-    QProgressDialog progress(tr("Cleaning up..."), tr("Stop"), 0, 0, this);
-    progress.setMinimumDuration(200);
-    progress.setWindowModality(Qt::WindowModal);
+    imageLoader->cancel();
+    imageLoader->clearCache(); // in case the files have been changed meanwhile
+    image->setEnabled(true);
+    image->setImage(QImage());
+    image->resetZoomAndPan();
 
-    cleanFileList(&progress);
+    fileList->clear(dir);
 
+    stashUndoHistory();
     resetUndoBuffers();
 
-    const QString maskFilenameSuffix = getMaskFilenameSuffix();
-    const QString thingAnnotationsFilenameSuffix = getThingAnnotationsPathFilenameSuffix();
-    const QString inferenceResultFilenameSuffix = getInferenceResultFilenameSuffix();
+    currentWorkingFolder = dir;
+
+    addRecentFolderMenuItem(dir);
+
+    loadClassList();
+
+    if (annotationClassItems.empty()) {
+        // Add sample classes
+        addNewClass(cleanClassLabel, cleanColor);
+        addNewClass(tr("Minor defect"), QColor(255, 255, 0, 128));
+        addNewClass(tr("Major defect"), QColor(255, 0,   0, 128));
+    }
+
+    if (annotateThings->isChecked()) {
+        conditionallyChangeFirstClass(cleanClassLabel, cleanColor, ignoreClassLabel, ignoreColor);
+    }
+    else {
+        conditionallyChangeFirstClass(ignoreClassLabel, ignoreColor, cleanClassLabel, cleanColor);
+    }
 
-    QStringList imageFiles;
+    // The files found are added to the list as they arrive (see onFolderScanBatchReady).
+    // The directories that haven't changed since the previous scan are read from the index.
+    folderScanner->start(dir, FolderIndex::getIndexFilename(dir));
 
-    progress.setMaximum(0);
-    progress.setValue(0);
+    updateFolderScanStatus();
+}
 
-    auto timeWhenLabelTextLastUpdated = std::chrono::steady_clock::now();
+void MainWindow::onFolderScanBatchReady(const FolderScanner::Batch& batch)
+{
+    int fileIdToSelect = -1;
 
-    std::unordered_set<QString> thingAnnotationsFilenames;
-    std::unordered_set<QString> maskFilenames;
-    std::unordered_set<QString> inferenceResultFilenames;
+    if (selectFileWhenFound) {
+        const int separator = fileToSelectWhenFound.lastIndexOf('/');
+        const QString directory = separator >= 0 ? fileToSelectWhenFound.left(separator) : QString();
+        const QString name = fileToSelectWhenFound.mid(separator + 1);
 
-    QDirIterator it(dir, QStringList() << "*.jpg" << "*.jpeg" << "*.png" << ("*" + thingAnnotationsFilenameSuffix), QDir::Files, QDirIterator::Subdirectories);
-    while (it.hasNext() && !progress.wasCanceled()) {
-        const QString filename = it.next();
-        const auto isThingsModeAnnotationFilename = [&]() { return filename.right(thingAnnotationsFilenameSuffix.length()) == thingAnnotationsFilenameSuffix; };
-        const auto isMaskFilename = [&]() { return filename.right(maskFilenameSuffix.length()) == maskFilenameSuffix; };
-        const auto isInferenceResultFilename = [&]() { return filename.right(inferenceResultFilenameSuffix.length()) == inferenceResultFilenameSuffix; };
-        if (isThingsModeAnnotationFilename()) {
-            thingAnnotationsFilenames.insert(filename);
-        }
-        else if (isMaskFilename()) {
-            maskFilenames.insert(filename);
-        }
-        else if (isInferenceResultFilename()) {
-            inferenceResultFilenames.insert(filename);
-        }
-        else {
-            imageFiles.push_back(filename);
-        }
-        const auto now = std::chrono::steady_clock::now();
-        if (now - timeWhenLabelTextLastUpdated >= std::chrono::milliseconds(200)) {
-            progress.setLabelText(tr("Locating image files: %1 found so far").arg(imageFiles.count()) + "\n\n" + filename);
-            if (progress.isHidden()) {
-                progress.show();
+        // The files get consecutive ids, in the order of the batch
+        int fileId = fileList->fileCount();
+        for (const FolderScanner::DirectoryListing& listing : batch) {
+            if (listing.path == directory) {
+                for (const FolderScanner::ImageEntry& entry : listing.images) {
+                    if (entry.name == name) {
+                        fileIdToSelect = fileId;
+                    }
+                    ++fileId;
+                }
+            }
+            else {
+                fileId += static_cast<int>(listing.images.size());
             }
-            QApplication::processEvents(); // update the dialog
-            timeWhenLabelTextLastUpdated = now;
         }
     }
 
-    if (progress.wasCanceled()) {
-        progress.reset();
-    }
+    fileList->addFiles(batch);
 
-    if (progress.isHidden() && imageFiles.count() >= 100000) {
-        progress.show();
+    if (fileIdToSelect >= 0) {
+        selectFileWhenFound = false;
+        if (currentImageFileId < 0) {
+            selectFile(fileIdToSelect);
+        }
     }
 
-    progress.setLabelText(tr("Sorting %1 file names...").arg(imageFiles.count()));
-    progress.setValue(0);
-    progress.setMaximum(imageFiles.count() + 1);
-    QApplication::processEvents(); // update the dialog
+    updateFolderScanStatus();
+}
 
-    auto timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
+void MainWindow::onFolderScanFinished(bool canceled)
+{
+    Q_UNUSED(canceled);
 
-    const double imageFilesCountLog2 = log2(imageFiles.count());
+    finishFolderScan();
+}
 
-    uint64_t comparisonsDone = 0;
+void MainWindow::onStopFolderScan()
+{
+    folderScanner->cancel();
 
-    class SortingCanceled : std::exception {};
+    finishFolderScan();
+}
 
-    const auto updateSortingProgress = [&]() {
-        ++comparisonsDone;
-        const auto now = std::chrono::steady_clock::now();
-        if (now - timeWhenProgressLastUpdated >= std::chrono::milliseconds(500)) {
-            const double progressEstimate = comparisonsDone / imageFilesCountLog2;
-            progress.setValue(std::min(static_cast<int>(std::round(progressEstimate)), imageFiles.count()));
-            QApplication::processEvents();
-            timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
+void MainWindow::finishFolderScan()
+{
+    sortFileList();
 
-            if (progress.wasCanceled()) {
-                throw SortingCanceled();
-            }
-        }
-    };
+    // Searching works without the index too (until it is ready), but much slower
+    fileList->buildSearchIndex();
 
-    struct compare {
-        compare(bool reverseFileOrder, std::function<void()> updateSortingProgress)
-            : reverseFileOrder(reverseFileOrder)
-            , updateSortingProgress(updateSortingProgress)
-        {}
-
-        bool operator()(const QString& lhs, const QString& rhs) const {
-            updateSortingProgress();
-            return reverseFileOrder
-                ? greater(lhs, rhs)
-                : less   (lhs, rhs);
+    if (selectFileWhenFound) {
+        // The default file wasn't found, so just pick the first one
+        selectFileWhenFound = false;
+        if (currentImageFileId < 0 && fileList->rowCount() > 0) {
+            selectFile(fileList->fileIdAt(0));
         }
-
-    private:
-        const bool reverseFileOrder;
-        const std::function<void()> updateSortingProgress;
-        const std::greater<QString> greater;
-        const std::less   <QString> less;
-    };
-
-    try {
-        std::sort(imageFiles.begin(), imageFiles.end(), compare(reverseFileOrder, updateSortingProgress));
     }
-    catch (SortingCanceled) {
-        ; // do nothing
+    else {
+        scrollToCurrentFile();
     }
 
-    progress.setLabelText(tr("Populating the image file list (%1 files)").arg(imageFiles.count()));
-    progress.setValue(0);
-    progress.setMaximum(imageFiles.count() + 1);
-    QApplication::processEvents();
+    updateFolderScanStatus();
+}
 
-    const bool hideUnannotated = hideUnannotatedFiles->isChecked();
+bool MainWindow::sortFileList()
+{
+    QProgressDialog progress(tr("Sorting %1 file names...").arg(fileList->fileCount()), tr("Stop"), 0, 0, this);
+    progress.setMinimumDuration(200);
+    progress.setWindowModality(Qt::WindowModal);
 
-    timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
+    // Showing the progress means processing events, and that is not ok while the
+    // scanner may still deliver new files to be added to the list being sorted
+    const bool showProgress = !folderScanner->isRunning();
 
-    const auto getDirLength = [&dir]() {
-        if (dir.isEmpty()) {
-            return 0;
-        }
-        const auto lastChar = dir[dir.length() - 1];
-        if (lastChar == '/' || lastChar == '\\') {
-            return dir.length();
-        }
-        return dir.length() + 1;
-    };
+    QApplication::setOverrideCursor(Qt::WaitCursor);
 
-    const auto dirLength = getDirLength();
+    const auto sortBy = static_cast<FileListModel::SortBy>(fileSortKey->currentData().toInt());
 
-    const int imageFilesCount = imageFiles.count();
-    for (int i = 0; i < imageFilesCount && !progress.wasCanceled(); ++i) {
-        const auto now = std::chrono::steady_clock::now();
-        if (now - timeWhenProgressLastUpdated >= std::chrono::milliseconds(500)) {
-            progress.setValue(i);
-            timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
-        }
-        const QString filename = imageFiles.takeFirst();
-        const QString displayName = filename.mid(dirLength);
-        QListWidgetItem* item = new QListWidgetItem(displayName, files);
-        const auto maskFileExists = [&]() { return maskFilenames.find(getMaskFilename(filename)) != maskFilenames.end(); };
-        const auto thingAnnotationsFileExists = [&]() { return thingAnnotationsFilenames.find(getThingAnnotationsPathFilename(filename)) != thingAnnotationsFilenames.end(); };
-        if (maskFileExists() || thingAnnotationsFileExists()) {
-            item->setBackgroundColor(hasAnnotationsColor);
-        }
-        else {
-            if (hideUnannotated) {
-                item->setHidden(true);
-            }
-        }
-        updateTextColor(item, filename);
-        item->setData(fullnameRole, filename);
-    }
-
-    if (!imageFiles.isEmpty()) {
-        progress.setLabelText(tr("Cleaning up..."));
-        int removedCount = 0;
-        const int initialCount = imageFiles.count();
-        progress.setValue(0);
-        progress.show();
-        progress.setMaximum(initialCount);
-        progress.setCancelButton(nullptr);
-        progress.setWindowFlags(progress.windowFlags() & ~Qt::WindowCloseButtonHint);
-        while (removedCount < initialCount) {
-            imageFiles.takeLast();
-            const auto now = std::chrono::steady_clock::now();
-            if (now - timeWhenProgressLastUpdated >= std::chrono::milliseconds(500)) {
-                progress.setValue(removedCount);
-                timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
-            }
-            ++removedCount;
+    const auto reportProgress = [&](int done, int total) {
+        if (!showProgress) {
+            return true;
         }
-    }
+        progress.setMaximum(total);
+        progress.setValue(done);
+        return !progress.wasCanceled();
+    };
 
-    assert(imageFiles.isEmpty());
+    // Say, the image dimensions are read only when they are first needed
+    progress.setLabelText(tr("Reading the details of %1 files...").arg(fileList->fileCount()));
+    bool sorted = fileList->updateSortKeys(sortBy, reportProgress);
 
-    if (!progress.wasCanceled() && !progress.isHidden()) {
-        progress.setValue(imageFilesCount);
+    if (sorted) {
+        progress.setLabelText(tr("Sorting %1 file names...").arg(fileList->fileCount()));
+        sorted = fileList->sort(sortBy, naturalFileOrder->isChecked(), reportProgress);
     }
 
-    files->setUpdatesEnabled(true);
+    QApplication::restoreOverrideCursor();
 
-    currentWorkingFolder = dir;
+    scrollToCurrentFile();
 
-    addRecentFolderMenuItem(dir);
+    return sorted;
+}
 
-    loadClassList();
+void MainWindow::selectFile(int fileId)
+{
+    const int row = fileList->rowOf(fileId);
+    if (row >= 0) {
+        const QModelIndex index = fileList->index(row);
+        files->scrollTo(index, QAbstractItemView::EnsureVisible);
+        files->setCurrentIndex(index);
+    }
+    loadFile(fileId);
+}
 
-    if (annotationClassItems.empty()) {
-        // Add sample classes
-        addNewClass(cleanClassLabel, cleanColor);
-        addNewClass(tr("Minor defect"), QColor(255, 255, 0, 128));
-        addNewClass(tr("Major defect"), QColor(255, 0,   0, 128));
+void MainWindow::scrollToCurrentFile()
+{
+    const QModelIndex currentIndex = files->currentIndex();
+    if (currentIndex.isValid()) {
+        files->scrollTo(currentIndex, QAbstractItemView::EnsureVisible);
     }
+}
 
-    if (annotateThings->isChecked()) {
-        conditionallyChangeFirstClass(cleanClassLabel, cleanColor, ignoreClassLabel, ignoreColor);
+void MainWindow::updateFolderScanStatus()
+{
+    const bool scanning = folderScanner->isRunning();
+
+    stopFolderScanButton->setVisible(scanning);
+
+    if (scanning) {
+        statusBar()->showMessage(tr("Locating image files: %1 found so far (%2 folders scanned, %3 of them unchanged)")
+                                 .arg(fileList->fileCount())
+                                 .arg(folderScanner->directoriesScanned())
+                                 .arg(folderScanner->directoriesReused()));
     }
     else {
-        conditionallyChangeFirstClass(ignoreClassLabel, ignoreColor, cleanClassLabel, cleanColor);
+        if (fileList->rowCount() == fileList->fileCount()) {
+            statusBar()->showMessage(tr("%1 image files").arg(fileList->fileCount()));
+        }
+        else {
+            statusBar()->showMessage(tr("%1 image files (%2 shown)").arg(fileList->fileCount()).arg(fileList->rowCount()));
+        }
     }
 }
 
@@ -869,6 +949,8 @@ void MainWindow::onExport()
         settings.setValue("defaultExportDirectory", dir);
 
         saveMaskIfDirty();
+        maskSaver->flush(); // the masks are read from the files
+        thingAnnotationSaver->flush(); // and so are the thing annotations
 
         QDir directory(dir);
 
@@ -905,16 +987,14 @@ void MainWindow::onExport()
         std::deque<std::pair<QString, QString>> imagesWithAnnotations;
         std::deque<std::pair<QString, QString>> imagesWithoutAnnotations;
 
-        const int total = files->count();
-        for (int row = 0; row < total; ++row) {
-            const auto* item = files->item(row);
-            auto& destination = hasAnnotations(item)
+        for (quint32 fileId : fileList->sortedFileIds()) {
+            auto& destination = fileList->hasAnnotations(fileId)
                 ? imagesWithAnnotations
                 : imagesWithoutAnnotations;
 
             destination.push_back(std::make_pair(
-                item->text(),
-                item->data(fullnameRole).toString())
+                fileList->displayName(fileId),
+                fileList->fullName(fileId))
             );
         }
 
@@ -1059,11 +1139,11 @@ void MainWindow::onExport()
             allSourceFilesForThisImage.push_back(fileItem);
 
             if (isAnnotatedImage) {
-                const auto maskFilename = getMaskFilename(imagesWithAnnotations[i].second);
+                const auto maskFilename = getNewestMaskFilename(imagesWithAnnotations[i].second);
                 if (QFile().exists(maskFilename)) {
                     allSourceFilesForThisImage.push_back(std::make_pair(
-                        getMaskFilename(imagesWithAnnotations[i].first),
-                        getMaskFilename(imagesWithAnnotations[i].second)
+                        imagesWithAnnotations[i].first + maskFilename.mid(imagesWithAnnotations[i].second.length()),
+                        maskFilename
                     ));
                 }
             }
@@ -1138,165 +1218,181 @@ void MainWindow::onExport()
     }
 }
 
-void MainWindow::onFileClicked(QListWidgetItem* item)
+void MainWindow::onFileClicked(const QModelIndex& index)
 {
-    loadFile(item);
+    loadFile(fileList->fileIdAt(index.row()));
 }
 
 void MainWindow::onFileActivated(const QModelIndex& index)
 {
-    loadFile(files->item(index.row()));
+    loadFile(fileList->fileIdAt(index.row()));
 }
 
-void MainWindow::onFileItemChanged(QListWidgetItem* current, QListWidgetItem* previous)
+void MainWindow::onCurrentFileChanged(const QModelIndex& current, const QModelIndex& previous)
 {
     Q_UNUSED(previous);
 
-    if (current) {
-        loadFile(current);
+    if (current.isValid()) {
+        loadFile(fileList->fileIdAt(current.row()));
     }
 }
 
-bool MainWindow::hasAnnotations(const QListWidgetItem* item) const
+void MainWindow::loadFile(int fileId)
 {
-    return item->backgroundColor() == hasAnnotationsColor;
-}
-
-void MainWindow::updateTextColor(QListWidgetItem* item, const QString& baseImageFilename)
-{
-    QFile file;
-    file.setFileName(getInferenceResultPathFilename(baseImageFilename));
-    if (!file.exists()) {
-        item->setTextColor(hasNoInferenceResultsFileColor);
+    if (fileId < 0 || fileId == currentImageFileId) {
         return;
     }
-    item->setTextColor(file.size() > 2 ? hasInferenceResultsColor : hasInferenceResultsFileColor);
-}
 
-MainWindow::InferenceResults MainWindow::readResultsJSON(const QString& filename)
-{
-    InferenceResults results;
+    saveMaskIfDirty();
 
-    QFile file;
-    file.setFileName(filename);
-    if (!file.open(QIODevice::ReadOnly | QIODevice::Text)) {
-        return results;
+    if (!currentImageFile.isEmpty()) {
+        // Any edits still only in the journal go to the file now
+        thingAnnotationSaver->compact(getThingAnnotationsPathFilename(currentImageFile));
     }
 
-    if (file.size() > 1e9) {
-        results.error = tr("The inference results JSON file is insanely large (%1 GB), so we're really not even trying to parse it.\n\nFor your reference, the file is:\n%2").arg(file.size() * 1e-9, 0, 'f', 1).arg(filename);
-        return results;
-    }
+    stashUndoHistory();
 
-    QString json = file.readAll();
-    QJsonDocument document = QJsonDocument::fromJson(json.toUtf8());
+    currentImageFileId = fileId;
+    currentImageFile = fileList->fullName(fileId);
 
-    const QJsonArray colors = document.array();
+    QSettings settings(companyName, applicationName);
+    settings.setValue("defaultFile", fileList->displayName(fileId));
 
-    for (int i = 0, end = colors.size(); i < end; ++i) {
-        const QJsonObject colorAndPaths = colors[i].toObject();
-        QResultImageView::Result result;
-        const QJsonObject color = colorAndPaths.value("color").toObject();
+    resetUndoBuffers();
 
-        result.pen = QPen(QColor(
-            color.value("r").toInt(),
-            color.value("g").toInt(),
-            color.value("b").toInt(),
-            color.value("a").toInt()
-        ));
+    // In case we are getting back to an image whose mask is still being saved
+    maskSaver->waitFor(getMaskFilename(currentImageFile));
+    thingAnnotationSaver->waitFor(getThingAnnotationsPathFilename(currentImageFile));
 
-        const QJsonArray paths = colorAndPaths.value("color_paths").toArray();
-        results.results.reserve(paths.size());
+    // The previous image stays visible until the new one has been loaded (see
+    // onImageLoaded), but it must not be annotated any more
+    image->setEnabled(false);
 
-        for (int j = 0, end = paths.size(); j < end; ++j) {
-            const QJsonArray path = paths[j].toArray();
-            result.contour.reserve(path.size());
-            for (int k = 0, end = path.size(); k < end; ++k) {
-                const QJsonObject point = path[k].toObject();
-                result.contour.push_back(QPointF(point.value("x").toDouble(), point.value("y").toDouble()));
+    imageLoader->load(getImageLoaderRequest(fileId));
+}
 
-            }
-            results.results.push_back(result);
-            result.contour.clear();
-        }
-    }
+ImageLoader::Request MainWindow::getImageLoaderRequest(int fileId) const
+{
+    const QString filename = fileList->fullName(fileId);
 
-    return results;
+    ImageLoader::Request request;
+    request.imageFilename = filename;
+    request.maskFilename = getMaskFilename(filename);
+    request.tiledMaskFilename = getTiledMaskFilename(filename);
+    request.thingAnnotationsFilename = getThingAnnotationsPathFilename(filename);
+    request.inferenceResultsFilename = getInferenceResultPathFilename(filename);
+    if (cacheInferenceResults) {
+        request.inferenceResultsCacheFilename = ResultsCache::getCacheFilename(request.inferenceResultsFilename);
+    }
+    request.previewSize = image->size() * image->devicePixelRatioF();
+    if (ui->actionCacheImagePyramids->isChecked()) {
+        request.pyramidCacheFilename = ImagePyramid::getCacheFilename(filename);
+    }
+    return request;
 }
 
-void MainWindow::loadFile(QListWidgetItem* item)
+void MainWindow::prefetchNeighbors()
 {
-    if (item == currentImageFileItem) {
+    const int row = fileList->rowOf(currentImageFileId);
+    if (row < 0) {
         return;
     }
 
-    saveMaskIfDirty();
+    // The next ones first, as the list is usually walked downwards
+    std::vector<ImageLoader::Request> requests;
+    for (int distance = 1; distance <= prefetchCount; ++distance) {
+        for (int neighbor : { row + distance, row - distance }) {
+            const int fileId = fileList->fileIdAt(neighbor);
+            if (fileId >= 0) {
+                requests.push_back(getImageLoaderRequest(fileId));
+            }
+        }
+    }
 
-    QApplication::setOverrideCursor(Qt::WaitCursor);
-    QApplication::processEvents(); // actually update the cursor
+    imageLoader->prefetch(requests);
+}
 
-    currentImageFileItem = item;
-    currentImageFile = item->data(fullnameRole).toString();
+void MainWindow::onImageLoaded(const ImageLoader::Bundle& bundle)
+{
+    if (bundle.request.imageFilename != currentImageFile) {
+        return;
+    }
 
-    QSettings settings(companyName, applicationName);
-    settings.setValue("defaultFile", item->text());
+    if (bundle.isPreview) {
+        // Just something to look at; the view stays disabled until the full
+        // image has replaced the preview, so nothing gets drawn on top of it
+        QResultImageView::DelayedRedrawToken delayedRedrawToken;
 
-    resetUndoBuffers();
+        originalImage = bundle.image;
+        originalImageIsGrayscale = bundle.isGrayscale;
+        originalImageFullSize = bundle.fullSize;
+        initCurrentImage(&delayedRedrawToken);
+        image->setMask(QImage(), &delayedRedrawToken);
+        image->setThingAnnotations(QResultImageView::Results(), &delayedRedrawToken);
+        image->setResults(QResultImageView::Results(), &delayedRedrawToken);
+        return;
+    }
 
-    const auto readImage = [](const QString& filename) { return QImage(filename); };
+    currentMask = bundle.mask;
+    unsavedMaskRegion = QRegion();
 
-    QFuture<QImage> imageFuture = QtConcurrent::run(readImage, currentImageFile);
-    QFuture<QImage> maskFuture = QtConcurrent::run(readImage, getMaskFilename(currentImageFile));
+    if (maskJournal.recover(getMaskFilename(currentImageFile), bundle.image.size(), currentMask)) {
+        // Changes that did not get saved before the application exited last time
+        unsavedMaskRegion = currentMask.rect();
+        maskDirty = true;
+        ++saveMaskPendingCounter;
+        QTimer::singleShot(10000, this, SLOT(onSaveMask()));
+        fileList->setStatus(currentImageFileId, fileList->status(currentImageFileId) | FolderScanner::HasMask);
+        statusBar()->showMessage(tr("Recovered mask changes that had not been saved"), 5000);
+    }
 
-    const auto readResults = [this](const QString& filename) {
-        return readResultsJSON(filename);
-    };
+    QResultImageView::DelayedRedrawToken delayedRedrawToken;
 
-    auto thingAnnotationsFuture = QtConcurrent::run(readResults, getThingAnnotationsPathFilename(currentImageFile));
-    auto resultsFuture = QtConcurrent::run(readResults, getInferenceResultPathFilename(currentImageFile));
+    originalImage = bundle.image;
+    originalImageIsGrayscale = bundle.isGrayscale;
+    originalImageFullSize = QSize();
+    initCurrentImage(&delayedRedrawToken);
+    image->setMask(currentMask.toImage(), &delayedRedrawToken);
 
-    {
-        QImage mask = maskFuture.result();
-        currentMask = QPixmap::fromImage(mask);
+    currentThingAnnotations = bundle.thingAnnotations;
+    currentResults = bundle.inferenceResults;
 
-        QResultImageView::DelayedRedrawToken delayedRedrawToken;
+    if (currentThingAnnotations.error.isEmpty()
+            && thingAnnotationSaver->recover(currentImageFile, getThingAnnotationsPathFilename(currentImageFile), currentThingAnnotations.results, getClassNamesByColor())) {
+        fileList->setStatus(currentImageFileId, fileList->status(currentImageFileId) | FolderScanner::HasThingAnnotations);
+        statusBar()->showMessage(tr("Recovered thing annotations that had not been saved"), 5000);
+    }
 
-        originalImage = imageFuture.result();
-        initCurrentImage(&delayedRedrawToken);
-        image->setMask(mask, &delayedRedrawToken);
+    // A file that cannot be parsed shows as empty, as it always has; a dialog
+    // would only get in the way when browsing through many images
+    const QString error = !currentThingAnnotations.error.isEmpty() ? currentThingAnnotations.error : currentResults.error;
+    if (!error.isEmpty()) {
+        statusBar()->showMessage(error, 10000);
+    }
 
-        currentThingAnnotations = thingAnnotationsFuture.result();
-        currentResults = resultsFuture.result();
+    for (auto& result : currentThingAnnotations.results) {
+        result.pen.setWidth(2);
+    }
 
-        if (!currentResults.error.isEmpty()) {
-            QMessageBox::warning(nullptr, tr("Error"), currentResults.error);
-        }
+    image->setThingAnnotations(currentThingAnnotations.results, &delayedRedrawToken);
 
-        if (currentThingAnnotations.error.isEmpty()) {
-            for (auto& result : currentThingAnnotations.results) {
-                result.pen.setWidth(2);
-            }
+    if (resultsVisible->isChecked()) {
+        image->setResults(currentResults.results, &delayedRedrawToken);
+    }
+    resultsVisible->setEnabled(!currentResults.results.empty());
 
-            image->setThingAnnotations(currentThingAnnotations.results, &delayedRedrawToken);
-        }
-        else {
-            QMessageBox::warning(nullptr, tr("Error"), currentThingAnnotations.error);
-        }
+    restoreUndoHistory();
 
-        if (resultsVisible->isChecked()) {
-            image->setResults(currentResults.results, &delayedRedrawToken);
-        }
-        resultsVisible->setEnabled(!currentResults.results.empty());
-    }
+    image->setEnabled(true);
 
-    QApplication::restoreOverrideCursor();
+    prefetchNeighbors();
 }
 
 void MainWindow::initCurrentImage(QResultImageView::DelayedRedrawToken* delayedRedrawToken)
 {
     const bool channelSelectionsAvailable
             = allImageChannelsButton != nullptr
-            && !originalImage.isGrayscale()
+            && !originalImageIsGrayscale
             && originalImage.depth() == 32;
 
     if (allImageChannelsButton) {
@@ -1309,11 +1405,11 @@ void MainWindow::initCurrentImage(QResultImageView::DelayedRedrawToken* delayedR
     }
 
     if (!channelSelectionsAvailable || allImageChannelsButton->isChecked()) {
-        image->setImage(originalImage, delayedRedrawToken);
+        setViewImage(originalImage, delayedRedrawToken);
     }
     else if (rgbChannelsButton->isChecked()) {
         currentlyShownImage = originalImage.convertToFormat(QImage::Format_RGB32);
-        image->setImage(currentlyShownImage, delayedRedrawToken);
+        setViewImage(currentlyShownImage, delayedRedrawToken);
     }
     else {
         const bool isRed = redChannelButton->isChecked();
@@ -1348,7 +1444,18 @@ void MainWindow::initCurrentImage(QResultImageView::DelayedRedrawToken* delayedR
             }
         }
 
-        image->setImage(currentlyShownImage, delayedRedrawToken);
+        setViewImage(currentlyShownImage, delayedRedrawToken);
+    }
+}
+
+void MainWindow::setViewImage(const QImage& shownImage, QResultImageView::DelayedRedrawToken* delayedRedrawToken)
+{
+    if (originalImageFullSize.isValid() && viewStretchesImage) {
+        QMetaObject::invokeMethod(image, "setImage", Q_ARG(QImage, shownImage), Q_ARG(QSize, originalImageFullSize));
+    }
+    else {
+        // A preview is then shown at its own size, until the full image replaces it
+        image->setImage(shownImage, delayedRedrawToken);
     }
 }
 
@@ -1541,9 +1648,15 @@ void MainWindow::onChannelSelectionToggled(bool /*toggled*/)
 
 void MainWindow::onAnnotationUpdated()
 {
-    if (currentImageFileItem != nullptr) {
-        // Make the image read-only
-        const QString filename = currentImageFileItem->data(fullnameRole).toString();
+    onAnnotationUpdated(QRect());
+}
+
+void MainWindow::onAnnotationUpdated(const QRect& changedRect)
+{
+    if (currentImageFileId >= 0 && readOnlyImageFile != currentImageFile) {
+        // Make the image read-only (once per image, rather than on every stroke)
+        const QString filename = currentImageFile;
+        readOnlyImageFile = filename;
 
         QFile file(filename);
 
@@ -1560,17 +1673,20 @@ void MainWindow::onAnnotationUpdated()
     }
 
     if (annotateThings->isChecked()) {
-        annotationUndoBuffer.push_back(currentThingAnnotations.results);
-        limitUndoOrRedoBufferSize(annotationUndoBuffer);
+        QResultImageView::Results results = image->getThingAnnotations();
+
+        ThingAnnotationEdit edit = ThingAnnotationEdit::compute(currentThingAnnotations.results, results);
 
-        currentThingAnnotations.results = image->getThingAnnotations();
+        currentThingAnnotations.results = std::move(results);
         currentThingAnnotations.error.clear();
 
-        annotationRedoBuffer.clear();
+        if (!edit.isEmpty()) {
+            recordThingAnnotationEdit(edit, false);
+            annotationUndoBuffer.push(std::move(edit));
+            annotationRedoBuffer.clear();
+        }
 
         updateUndoRedoMenuItemStatus();
-
-        saveCurrentThingAnnotations();
     }
 
     if (annotateStuff->isChecked()) {
@@ -1580,71 +1696,53 @@ void MainWindow::onAnnotationUpdated()
 
         QTimer::singleShot(10000, this, SLOT(onSaveMask()));
 
-        if (currentImageFileItem != nullptr) {
-            currentImageFileItem->setBackgroundColor(hasAnnotationsColor); // now we will have a mask file
+        if (currentImageFileId >= 0) {
+            // now we will have a mask file
+            fileList->setStatus(currentImageFileId, fileList->status(currentImageFileId) | FolderScanner::HasMask);
         }
 
-        maskUndoBuffer.push_back(currentMask);
-        limitUndoOrRedoBufferSize(maskUndoBuffer);
+        // For a pixmap in memory, this is a shallow copy, and the pixels are
+        // compared as they are, so nothing of the size of the mask gets copied
+        const QImage mask = image->getMask().toImage();
+
+        // Without the changed rectangle, the whole mask is compared
+        QRect area = changedRect.isNull() ? mask.rect() : changedRect & mask.rect();
 
-        currentMask = image->getMask();
+        if (currentMask.isNull()) {
+            currentMask = SparseMask(mask.size());
+        }
+        else if (currentMask.size() != mask.size()) {
+            currentMask = currentMask.resized(mask.size()); // without a full-size copy
+            unsavedMaskRegion += mask.rect();
+            area = mask.rect();
+        }
 
-        maskRedoBuffer.clear();
+        // Only the delta is applied, so the mask kept here stays sparse
+        MaskDelta delta = MaskDelta::compute(currentMask, mask, area);
+        if (!delta.isEmpty()) {
+            delta.apply(currentMask);
+            unsavedMaskRegion += delta.rect();
+            maskJournal.append(getMaskFilename(currentImageFile), delta);
+            maskUndoBuffer.push(std::move(delta));
+            maskRedoBuffer.clear();
+        }
 
         updateUndoRedoMenuItemStatus();
     }
 }
 
-void MainWindow::saveCurrentThingAnnotations()
+void MainWindow::recordThingAnnotationEdit(const ThingAnnotationEdit& edit, bool isUndo)
 {
-    QApplication::setOverrideCursor(Qt::WaitCursor);
-    QApplication::processEvents(); // actually update the cursor
-
-    {
-        QJsonArray json;
-
-        {
-            for (const auto& annotationItem : currentThingAnnotations.results) {
-                QJsonObject colorObject;
-                colorObject["r"] = annotationItem.pen.color().red();
-                colorObject["g"] = annotationItem.pen.color().green();
-                colorObject["b"] = annotationItem.pen.color().blue();
-                colorObject["a"] = annotationItem.pen.color().alpha();
-                QJsonArray colorPathsArray;
-                QJsonArray colorPathArray;
-                for (const QPointF& point : annotationItem.contour) {
-                    QJsonObject pointObject;
-                    pointObject["x"] = point.x();
-                    pointObject["y"] = point.y();
-                    colorPathArray.append(pointObject);
-                }
-                colorPathsArray.append(colorPathArray);
-                QJsonObject annotationObject;
-                annotationObject["color"] = colorObject;
-                annotationObject["color_paths"] = colorPathsArray;
-                json.append(annotationObject);
-            }
-        }
-
-        if (!currentImageFile.isEmpty()) {
-            const QString filename = getThingAnnotationsPathFilename(currentImageFile);
-            QFile file(filename);
+    if (currentImageFile.isEmpty()) {
+        return;
+    }
 
-            if (file.open(QIODevice::WriteOnly)) {
-                file.write(QJsonDocument(json).toJson());
-            }
-            else {
-                const QString text = tr("Couldn't open file \"%1\" for writing").arg(filename);
-                QMessageBox::warning(nullptr, tr("Error"), text);
-            }
-        }
+    thingAnnotationSaver->record(currentImageFile, getThingAnnotationsPathFilename(currentImageFile), edit, isUndo, currentThingAnnotations.results, getClassNamesByColor());
 
-        if (currentImageFileItem != nullptr) {
-            currentImageFileItem->setBackgroundColor(hasAnnotationsColor); // now we will have an annotation file
-        }
+    if (currentImageFileId >= 0) {
+        // now we will have an annotation file
+        fileList->setStatus(currentImageFileId, fileList->status(currentImageFileId) | FolderScanner::HasThingAnnotations);
     }
-
-    QApplication::restoreOverrideCursor();
 }
 
 
@@ -1680,17 +1778,165 @@ void MainWindow::saveMask()
 {
     assert(maskDirty);
 
-    QApplication::setOverrideCursor(Qt::WaitCursor);
-    QApplication::processEvents(); // actually update the cursor
+    // currentMask is kept in sync with the view, so there is no need to ask the
+    // view for a copy; the encoding and the writing happen in the background
+    if (ui->actionSaveTiledMasks->isChecked()) {
+        maskSaver->saveTiled(currentImageFile, getMaskFilename(currentImageFile), getTiledMaskFilename(currentImageFile), currentMask, unsavedMaskRegion);
+    }
+    else {
+        QVector<QRgb> palette;
+        if (ui->actionSaveIndexedMasks->isChecked()) {
+            std::vector<QColor> classColors;
+            for (const ClassItem& classItem : annotationClassItems) {
+                classColors.push_back(classItem.color);
+            }
+            palette = getMaskPalette(classColors);
+        }
 
-    QFile file(getMaskFilename(currentImageFile));
-    file.open(QIODevice::WriteOnly);
-    image->getMask().save(&file, "PNG");
+        maskSaver->save(currentImageFile, getMaskFilename(currentImageFile), currentMask, palette);
+    }
 
-    QApplication::restoreOverrideCursor();
+    imageLoader->invalidate(currentImageFile);
 
     maskDirty = false;
     saveMaskPendingCounter = 0;
+    unsavedMaskRegion = QRegion();
+}
+
+QHash<QRgb, QString> MainWindow::getClassNamesByColor() const
+{
+    QHash<QRgb, QString> classNames;
+    for (const ClassItem& classItem : annotationClassItems) {
+        classNames.insert(classItem.color.rgba(), classItem.className);
+    }
+    return classNames;
+}
+
+void MainWindow::onConvertThingAnnotations()
+{
+    thingAnnotationSaver->flush(); // the annotations are read from the files
+
+    std::vector<int> fileIds;
+    for (quint32 fileId : fileList->sortedFileIds()) {
+        if (fileList->status(fileId) & FolderScanner::HasThingAnnotations) {
+            fileIds.push_back(fileId);
+        }
+    }
+
+    const int count = static_cast<int>(fileIds.size());
+
+    QProgressDialog progress(tr("Converting %1 thing annotation files to the compact format ...").arg(count), tr("Stop"), 0, count, this);
+    progress.setMinimumDuration(200);
+    progress.setWindowModality(Qt::WindowModal);
+
+    const QHash<QRgb, QString> classNames = getClassNamesByColor();
+
+    int convertedCount = 0;
+
+    for (int i = 0; i < count && !progress.wasCanceled(); ++i) {
+        progress.setValue(i);
+
+        const QString filename = fileList->fullName(fileIds[i]);
+        const QString thingAnnotationsPathFilename = getThingAnnotationsPathFilename(filename);
+
+        if (getResultsFormat(thingAnnotationsPathFilename) != ResultsFormat::Original) {
+            continue; // already converted, or not there
+        }
+
+        const InferenceResults thingAnnotations = readResultsJSON(thingAnnotationsPathFilename);
+        if (!thingAnnotations.error.isEmpty()) {
+            progress.setValue(count);
+            QMessageBox::warning(this, tr("Error"), thingAnnotations.error);
+            break;
+        }
+
+        QSaveFile file(thingAnnotationsPathFilename);
+        const bool ok = file.open(QIODevice::WriteOnly)
+                && file.write(toResultsJSON(thingAnnotations.results, classNames)) >= 0
+                && file.commit();
+
+        if (!ok) {
+            progress.setValue(count);
+            QMessageBox::warning(this, tr("Error"), tr("Unable to write file %1").arg(thingAnnotationsPathFilename));
+            break;
+        }
+
+        imageLoader->invalidate(filename);
+        ++convertedCount;
+    }
+
+    progress.setValue(count);
+
+    statusBar()->showMessage(tr("Converted %1 thing annotation files").arg(convertedCount), 5000);
+}
+
+void MainWindow::onConvertMasksToTiles()
+{
+    convertMasks(true);
+}
+
+void MainWindow::onConvertMasksToPng()
+{
+    convertMasks(false);
+}
+
+void MainWindow::convertMasks(bool toTiles)
+{
+    saveMaskIfDirty();
+    maskSaver->flush(); // the masks are read from the files
+
+    std::vector<int> fileIds;
+    for (quint32 fileId : fileList->sortedFileIds()) {
+        if (fileList->status(fileId) & FolderScanner::HasMask) {
+            fileIds.push_back(fileId);
+        }
+    }
+
+    const int count = static_cast<int>(fileIds.size());
+
+    QProgressDialog progress(toTiles ? tr("Converting %1 masks to tiles ...").arg(count)
+                                     : tr("Converting %1 masks to PNG ...").arg(count),
+                             tr("Stop"), 0, count, this);
+    progress.setMinimumDuration(200);
+    progress.setWindowModality(Qt::WindowModal);
+
+    int convertedCount = 0;
+
+    for (int i = 0; i < count && !progress.wasCanceled(); ++i) {
+        progress.setValue(i);
+
+        const QString filename = fileList->fullName(fileIds[i]);
+        const QString pngFilename = getMaskFilename(filename);
+        const QString tiledFilename = getTiledMaskFilename(filename);
+
+        // The other file is left in place; being older, it is simply ignored
+        const QString sourceFilename = toTiles ? pngFilename : tiledFilename;
+        if (getNewestMaskFilename(filename) != sourceFilename || !QFile::exists(sourceFilename)) {
+            continue; // nothing to convert, or already converted
+        }
+
+        const bool ok = toTiles
+                ? TiledMask::convertFromPng(pngFilename, tiledFilename)
+                : TiledMask::convertToPng(tiledFilename, pngFilename);
+
+        if (!ok) {
+            progress.setValue(count);
+            QMessageBox::warning(this, tr("Error"), tr("Unable to convert mask %1").arg(sourceFilename));
+            break;
+        }
+
+        imageLoader->invalidate(filename);
+        ++convertedCount;
+    }
+
+    progress.setValue(count);
+
+    statusBar()->showMessage(tr("Converted %1 masks").arg(convertedCount), 5000);
+}
+
+void MainWindow::onSaveFailed(const QString& error)
+{
+    QMessageBox::warning(nullptr, tr("Error"), error);
 }
 
 QString MainWindow::getMaskFilenameSuffix()
@@ -1703,6 +1949,22 @@ QString MainWindow::getMaskFilename(const QString& baseImageFilename)
     return baseImageFilename + getMaskFilenameSuffix();
 }
 
+QString MainWindow::getTiledMaskFilename(const QString& baseImageFilename)
+{
+    return baseImageFilename + TiledMask::getFilenameSuffix();
+}
+
+QString MainWindow::getNewestMaskFilename(const QString& baseImageFilename)
+{
+    const QFileInfo png(getMaskFilename(baseImageFilename));
+    const QFileInfo tiled(getTiledMaskFilename(baseImageFilename));
+
+    if (tiled.exists() && (!png.exists() || tiled.lastModified() >= png.lastModified())) {
+        return tiled.filePath();
+    }
+    return png.filePath();
+}
+
 QString MainWindow::getInferenceResultFilenameSuffix()
 {
     return "_result.png";
@@ -2004,14 +2266,9 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
     }
     else if (key == Qt::Key_S) {
         reverseFileOrder = !reverseFileOrder;
-        if (files) {
-            QApplication::setOverrideCursor(Qt::WaitCursor);
-            files->sortItems(reverseFileOrder ? Qt::DescendingOrder : Qt::AscendingOrder);
-            auto* currentItem = files->currentItem();
-            if (currentItem) {
-                files->scrollToItem(currentItem, QListWidget::EnsureVisible);
-            }
-            QApplication::restoreOverrideCursor();
+        if (fileList) {
+            fileList->setReversed(reverseFileOrder);
+            scrollToCurrentFile();
         }
     }
     else if (key == Qt::Key_F5) {
@@ -2028,67 +2285,46 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
         }
     }
     else if (key == Qt::Key_Delete) {
-        if (files->hasFocus()) {
-            const int row = files->currentRow();
-            const QString filename = files->item(row)->data(fullnameRole).toString();
+        if (files->hasFocus() && files->currentIndex().isValid()) {
+            const int row = files->currentIndex().row();
+            const int fileId = fileList->fileIdAt(row);
+            const QString filename = fileList->fullName(fileId);
             if (filename.length() > 0) {
 
                 saveMaskIfDirty();
 
                 const auto maskFilename = getMaskFilename(filename);
+                const auto tiledMaskFilename = getTiledMaskFilename(filename);
                 const auto thingAnnotationsPathFilename = getThingAnnotationsPathFilename(filename);
 
-                const auto* item = files->item(row);
+                maskSaver->waitFor(maskFilename); // so that it does not reappear
+                thingAnnotationSaver->waitFor(thingAnnotationsPathFilename);
 
-                const auto hasAnnotationFiles = [&]() {
-                    if (!hasAnnotations(item)) {
-                        return false;
-                    }
+                const quint8 status = fileList->status(fileId);
+                const bool hasMaskFile = (status & FolderScanner::HasMask) != 0;
+                const bool hasThingAnnotationsFile = (status & FolderScanner::HasThingAnnotations) != 0;
 
-                    return QFile().exists(thingAnnotationsPathFilename)
-                        || QFile().exists(maskFilename);
-                };
-
-                if (hasAnnotationFiles()) {
+                if (hasMaskFile || hasThingAnnotationsFile) {
                     bool hasActualStuffAnnotations = false;
                     bool hasActualThingsAnnotations = false;
 
-                    if (hasAnnotations(item)) {
-                        QFuture<QImage> maskFuture;
+                    QFuture<SparseMask> maskFuture;
 
-                        if (QFile().exists(maskFilename)) {
-                            const auto readImage = [](const QString& filename) { return QImage(filename); };
-                            maskFuture = QtConcurrent::run(readImage, getMaskFilename(filename));
-                        }
+                    if (hasMaskFile) {
+                        maskFuture = QtConcurrent::run(TiledMask::readNewest, maskFilename, tiledMaskFilename);
+                    }
 
-                        if (QFile().exists(thingAnnotationsPathFilename)) {
-                            if (!readResultsJSON(thingAnnotationsPathFilename).results.empty()) {
-                                hasActualThingsAnnotations = true;
-                            }
+                    if (hasThingAnnotationsFile) {
+                        // Parsed without caching, as the file is about to be deleted
+                        if (!readResultsJSON(thingAnnotationsPathFilename).results.empty()) {
+                            hasActualThingsAnnotations = true;
                         }
+                    }
 
-                        if (QFile().exists(maskFilename)) {
-                            QImage mask = maskFuture.result();
-                            if (mask.height() > 0 && mask.width() > 0) {
-                                if (mask.format() == QImage::Format_ARGB32) {
-                                    QApplication::setOverrideCursor(Qt::WaitCursor);
-                                    std::vector<uchar> emptyRow(mask.width() * 4);
-                                    for (int row = 0, rows = mask.height(); row < rows; ++row) {
-                                        const uchar* rowPtr = mask.scanLine(row);
-                                        if (memcmp(rowPtr, emptyRow.data(), emptyRow.size()) != 0) {
-                                            hasActualStuffAnnotations = true;
-                                            break;
-                                        }
-                                    }
-                                    QApplication::restoreOverrideCursor();
-                                }
-                                else {
-                                    QMessageBox::warning(this,
-                                                         tr("Unexpected mask image format"),
-                                                         tr("Unexpected mask image format %1 in image %2").arg(QString::number(mask.format()), maskFilename));
-                                }
-                            }
-                        }
+                    if (hasMaskFile) {
+                        QApplication::setOverrideCursor(Qt::WaitCursor);
+                        hasActualStuffAnnotations = !maskFuture.result().isTransparent();
+                        QApplication::restoreOverrideCursor();
                     }
 
                     const bool hasActualAnnotations = hasActualStuffAnnotations || hasActualThingsAnnotations;
@@ -2111,22 +2347,51 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
                             return true;
                         };
 
+                        // The state kept for the current image has to go too, or the
+                        // next stroke (or undo) would bring the deleted annotations back
+                        const bool isCurrentImage = filename == currentImageFile;
+
                         const auto deleteAnnotations = [&]() {
                             if (!deleteAnnotationFile(thingAnnotationsPathFilename)) {
                                 return false;
                             }
-                            image->setThingAnnotations(QResultImageView::Results());
+                            thingAnnotationSaver->discard(thingAnnotationsPathFilename);
+                            if (isCurrentImage) {
+                                image->setThingAnnotations(QResultImageView::Results());
+                                currentThingAnnotations = InferenceResults();
+                                annotationUndoBuffer.clear();
+                                annotationRedoBuffer.clear();
+                            }
 
-                            if (!deleteAnnotationFile(maskFilename)) {
+                            if (!deleteAnnotationFile(maskFilename) || !deleteAnnotationFile(tiledMaskFilename)) {
                                 return false;
                             }
-                            image->setMask(QImage());
+                            maskJournal.discard(maskFilename);
+                            if (isCurrentImage) {
+                                image->setMask(QImage());
+                                currentMask = SparseMask();
+                                unsavedMaskRegion = QRegion();
+                                maskDirty = false;
+                                maskUndoBuffer.clear();
+                                maskRedoBuffer.clear();
+                            }
 
                             return true;
                         };
 
-                        if (deleteAnnotations()) {
-                            files->item(row)->setBackgroundColor(Qt::white);
+                        const bool deleted = deleteAnnotations();
+
+                        if (isCurrentImage) {
+                            updateUndoRedoMenuItemStatus();
+                        }
+                        else {
+                            undoHistoryStore.take(filename); // stashed when leaving the image
+                        }
+
+                        imageLoader->invalidate(filename); // even if only some of the files were deleted
+
+                        if (deleted) {
+                            fileList->setStatus(fileId, fileList->status(fileId) & ~(FolderScanner::HasMask | FolderScanner::HasThingAnnotations));
 
                             // Make file writable again
                             QFile file(filename);
@@ -2136,6 +2401,10 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
                             const auto newPermissions = currentPermissions | QFileDevice::WriteOwner;
 
                             file.setPermissions(newPermissions);
+
+                            if (filename == readOnlyImageFile) {
+                                readOnlyImageFile.clear(); // to be made read-only again, if annotated again
+                            }
                         }
                     }
                 }
@@ -2178,10 +2447,12 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
 #endif // WIN32
                     };
 
-                    const auto removeImageFromList = [row, this]() {
-                        QListWidgetItem* item = files->takeItem(row);
-                        delete item;
-                        loadFile(files->item(files->currentRow()));
+                    const auto removeImageFromList = [row, fileId, this]() {
+                        fileList->removeFile(fileId);
+                        const int rowCount = fileList->rowCount();
+                        if (rowCount > 0) {
+                            selectFile(fileList->fileIdAt(std::min(row, rowCount - 1)));
+                        }
                     };
 
                     if (removeFile(filename)) {
@@ -2196,32 +2467,28 @@ void MainWindow::keyPressEvent(QKeyEvent* event)
 void MainWindow::onUndo()
 {
     if (annotateThings->isChecked() && !annotationUndoBuffer.empty()) {
-        annotationRedoBuffer.push_back(currentThingAnnotations.results);
-        limitUndoOrRedoBufferSize(annotationRedoBuffer);
-
-        currentThingAnnotations.results = annotationUndoBuffer.back();
-
-        annotationUndoBuffer.pop_back();
+        ThingAnnotationEdit edit = annotationUndoBuffer.pop();
+        edit.undo(currentThingAnnotations.results);
+        recordThingAnnotationEdit(edit, true);
+        annotationRedoBuffer.push(std::move(edit));
 
         image->setThingAnnotations(currentThingAnnotations.results);
 
         updateUndoRedoMenuItemStatus();
-
-        saveCurrentThingAnnotations();
     }
 
-    if (annotateStuff->isChecked() && !maskUndoBuffer.empty()) {
-        const bool requireWaitCursor = currentMask.size().width() * currentMask.size().height() > 1024 * 1024;
+    if (annotateStuff->isChecked() && !maskUndoBuffer.empty() && !currentMask.isNull()) {
+        const bool requireWaitCursor = !viewTakesMaskArea && currentMask.size().width() * currentMask.size().height() > 1024 * 1024;
         if (requireWaitCursor) {
             QApplication::setOverrideCursor(Qt::WaitCursor);
         }
 
-        maskRedoBuffer.push_back(currentMask);
-        limitUndoOrRedoBufferSize(maskRedoBuffer);
-
-        currentMask = maskUndoBuffer.back();
-        image->setMask(currentMask.toImage());
-        maskUndoBuffer.pop_back();
+        MaskDelta delta = maskUndoBuffer.pop();
+        delta.apply(currentMask);
+        unsavedMaskRegion += delta.rect();
+        maskJournal.append(getMaskFilename(currentImageFile), delta); // the same delta takes it back
+        updateViewMask(delta.rect());
+        maskRedoBuffer.push(std::move(delta));
 
         updateUndoRedoMenuItemStatus();
 
@@ -2238,32 +2505,28 @@ void MainWindow::onUndo()
 void MainWindow::onRedo()
 {
     if (annotateThings->isChecked() && !annotationRedoBuffer.empty()) {
-        annotationUndoBuffer.push_back(currentThingAnnotations.results);
-        limitUndoOrRedoBufferSize(annotationUndoBuffer);
-
-        currentThingAnnotations.results = annotationRedoBuffer.back();
-
-        annotationRedoBuffer.pop_back();
+        ThingAnnotationEdit edit = annotationRedoBuffer.pop();
+        edit.redo(currentThingAnnotations.results);
+        recordThingAnnotationEdit(edit, false);
+        annotationUndoBuffer.push(std::move(edit));
 
         image->setThingAnnotations(currentThingAnnotations.results);
 
         updateUndoRedoMenuItemStatus();
-
-        saveCurrentThingAnnotations();
     }
 
-    if (annotateStuff->isChecked() && !maskRedoBuffer.empty()) {
-        const bool requireWaitCursor = currentMask.size().width() * currentMask.size().height() > 1024 * 1024;
+    if (annotateStuff->isChecked() && !maskRedoBuffer.empty() && !currentMask.isNull()) {
+        const bool requireWaitCursor = !viewTakesMaskArea && currentMask.size().width() * currentMask.size().height() > 1024 * 1024;
         if (requireWaitCursor) {
             QApplication::setOverrideCursor(Qt::WaitCursor);
         }
 
-        maskUndoBuffer.push_back(currentMask);
-        limitUndoOrRedoBufferSize(maskUndoBuffer);
-
-        currentMask = maskRedoBuffer.back();
-        image->setMask(currentMask.toImage());
-        maskRedoBuffer.pop_back();
+        MaskDelta delta = maskRedoBuffer.pop();
+        delta.apply(currentMask);
+        unsavedMaskRegion += delta.rect();
+        maskJournal.append(getMaskFilename(currentImageFile), delta);
+        updateViewMask(delta.rect());
+        maskUndoBuffer.push(std::move(delta));
 
         updateUndoRedoMenuItemStatus();
 
@@ -2279,48 +2542,81 @@ void MainWindow::onRedo()
 
 void MainWindow::resetUndoBuffers()
 {
-    if (annotateThings->isChecked()) {
-        annotationUndoBuffer.clear();
-        annotationRedoBuffer.clear();
-    }
-    if (annotateStuff->isChecked()) {
-        maskUndoBuffer.clear();
-        maskRedoBuffer.clear();
-    }
+    annotationUndoBuffer.clear();
+    annotationRedoBuffer.clear();
+    maskUndoBuffer.clear();
+    maskRedoBuffer.clear();
     updateUndoRedoMenuItemStatus();
 }
 
-void MainWindow::updateUndoRedoMenuItemStatus()
+void MainWindow::updateViewMask(const QRect& rect)
 {
-    if (annotateThings->isChecked()) {
-        ui->actionUndo->setEnabled(!annotationUndoBuffer.empty());
-        ui->actionRedo->setEnabled(!annotationRedoBuffer.empty());
+    if (viewTakesMaskArea) {
+        const QRect area = rect & currentMask.rect();
+        if (!area.isEmpty()) {
+            QMetaObject::invokeMethod(image, "setMaskArea", Q_ARG(QImage, currentMask.toImage(area)), Q_ARG(QPoint, area.topLeft()));
+        }
     }
-    if (annotateStuff->isChecked()) {
-        ui->actionUndo->setEnabled(!maskUndoBuffer.empty());
-        ui->actionRedo->setEnabled(!maskRedoBuffer.empty());
+    else {
+        image->setMask(currentMask.toImage());
     }
 }
 
-void MainWindow::limitUndoOrRedoBufferSize(std::deque<QPixmap>& buffer)
+void MainWindow::stashUndoHistory()
 {
-    const size_t maxBufferSizeInPixels = 256 * 1024 * 1024; // 256 Mpixels ought to lead to a buffer size of around 1 GB
-    size_t bufferSizeInPixels = 0;
-    for (const QPixmap& item : buffer) {
-        bufferSizeInPixels += item.size().width() * item.size().height();
+    if (currentImageFile.isEmpty()
+            || (maskUndoBuffer.empty() && maskRedoBuffer.empty() && annotationUndoBuffer.empty() && annotationRedoBuffer.empty())) {
+        return;
     }
-    while (buffer.size() > 1 && bufferSizeInPixels > maxBufferSizeInPixels) {
-        const QPixmap& itemToRemove = buffer.front();
-        bufferSizeInPixels -= itemToRemove.size().width() * itemToRemove.size().height();
-        buffer.pop_front();
+
+    QByteArray history;
+    QDataStream stream(&history, QIODevice::WriteOnly);
+
+    stream << getMaskFingerprint(currentMask)
+           << getThingAnnotationsFingerprint(currentThingAnnotations.results)
+           << maskUndoBuffer << maskRedoBuffer
+           << annotationUndoBuffer << annotationRedoBuffer;
+
+    undoHistoryStore.put(currentImageFile, history);
+}
+
+void MainWindow::restoreUndoHistory()
+{
+    const QByteArray history = undoHistoryStore.take(currentImageFile);
+    if (history.isEmpty()) {
+        return;
     }
+
+    QDataStream stream(history);
+
+    uint maskFingerprint = 0;
+    uint thingAnnotationsFingerprint = 0;
+    stream >> maskFingerprint >> thingAnnotationsFingerprint;
+
+    if (maskFingerprint != getMaskFingerprint(currentMask)
+            || thingAnnotationsFingerprint != getThingAnnotationsFingerprint(currentThingAnnotations.results)) {
+        return; // the history no longer applies
+    }
+
+    stream >> maskUndoBuffer >> maskRedoBuffer
+           >> annotationUndoBuffer >> annotationRedoBuffer;
+
+    if (stream.status() != QDataStream::Ok) {
+        resetUndoBuffers();
+    }
+
+    updateUndoRedoMenuItemStatus();
 }
 
-void MainWindow::limitUndoOrRedoBufferSize(std::deque<std::vector<QResultImageView::Result>>& buffer)
+void MainWindow::updateUndoRedoMenuItemStatus()
 {
-    const size_t maxBufferSize = 1024;
-    while (buffer.size() > maxBufferSize) {
-        buffer.pop_front();
+    if (annotateThings->isChecked()) {
+        ui->actionUndo->setEnabled(!annotationUndoBuffer.empty());
+        ui->actionRedo->setEnabled(!annotationRedoBuffer.empty());
+    }
+    if (annotateStuff->isChecked()) {
+        ui->actionUndo->setEnabled(!maskUndoBuffer.empty());
+        ui->actionRedo->setEnabled(!maskRedoBuffer.empty());
     }
 }
 
@@ -2340,58 +2636,130 @@ void MainWindow::onHideUnannotatedFilesToggled(bool toggled)
 {
     QApplication::setOverrideCursor(Qt::WaitCursor);
 
-    files->setUpdatesEnabled(false);
+    fileList->setHideUnannotated(toggled);
 
-    for (int i = 0, end = files->count(); i < end; ++i) {
-        QListWidgetItem* file = files->item(i);
-        file->setHidden(toggled && !hasAnnotations(file));
-    }
+    scrollToCurrentFile();
+
+    QApplication::restoreOverrideCursor();
+}
 
-    auto* currentItem = files->currentItem();
-    if (currentItem) {
-        files->scrollToItem(currentItem, QListWidget::EnsureVisible);
+void MainWindow::onNaturalFileOrderToggled(bool toggled)
+{
+    if (!sortFileList()) {
+        // canceled, so the order did not change
+        const QSignalBlocker blocker(naturalFileOrder);
+        naturalFileOrder->setChecked(!toggled);
     }
+}
+
+void MainWindow::onFileFilterChanged(int index)
+{
+    QApplication::setOverrideCursor(Qt::WaitCursor);
 
-    files->setUpdatesEnabled(true);
+    fileList->setFilter(static_cast<FileListModel::Filter>(fileFilter->itemData(index).toInt()));
+
+    scrollToCurrentFile();
 
     QApplication::restoreOverrideCursor();
 }
 
-void MainWindow::onRestoreDefaultWindowPositions()
+void MainWindow::onSearch()
 {
-    restoreGeometry(defaultGeometry);
-    restoreState(defaultState);
+    const auto syntax = static_cast<FileNameIndex::Syntax>(searchSyntax->currentData().toInt());
+
+    QApplication::setOverrideCursor(Qt::WaitCursor);
+    const bool isValid = fileList->setSearch(searchField->text(), syntax);
+    QApplication::restoreOverrideCursor();
+
+    if (isValid) {
+        searchField->setStyleSheet(QString());
+        scrollToCurrentFile();
+        updateFolderScanStatus();
+    }
+    else {
+        searchField->setStyleSheet("color: red");
+        statusBar()->showMessage(tr("Invalid search pattern"));
+    }
 }
 
-bool MainWindow::cleanFileList(QProgressDialog* progress)
+void MainWindow::onNextMatchingFile()
 {
-    files->setCurrentItem(nullptr);
-    currentImageFileItem = nullptr;
+    selectMatchingFile(true);
+}
 
-    image->setImage(QImage());
-    image->resetZoomAndPan();
+void MainWindow::onPreviousMatchingFile()
+{
+    selectMatchingFile(false);
+}
 
-    int removedCount = 0;
-    const int initialCount = files->count();
-    progress->setLabelText(tr("Cleaning up the file list..."));
-    progress->setMinimum(0);
-    progress->setMaximum(initialCount);
-    progress->setValue(0);
-
-    auto timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
-
-    while (removedCount < initialCount && !progress->wasCanceled()) {
-        QListWidgetItem* item = files->takeItem(initialCount - removedCount - 1);
-        delete item;
-        const auto now = std::chrono::steady_clock::now();
-        if (now - timeWhenProgressLastUpdated >= std::chrono::milliseconds(200)) {
-            progress->setValue(removedCount);
-            timeWhenProgressLastUpdated = std::chrono::steady_clock::now();
-        }
-        ++removedCount;
+void MainWindow::selectMatchingFile(bool forward)
+{
+    if (!fileList) {
+        return;
+    }
+
+    const QModelIndex currentIndex = files->currentIndex();
+    const int currentRow = currentIndex.isValid() ? currentIndex.row() : (forward ? -1 : fileList->rowCount());
+
+    const int row = fileList->findMatchingRow(currentRow, getNavigationFilter(), forward);
+    if (row >= 0) {
+        selectFile(fileList->fileIdAt(row));
     }
+    else {
+        statusBar()->showMessage(forward ? tr("No more matching files below") : tr("No more matching files above"), 5000);
+    }
+}
+
+void MainWindow::createNavigationFilterMenuItems()
+{
+    const QSettings settings(companyName, applicationName);
+    const int defaultFilter = settings.value("navigationFilter", static_cast<int>(FileListModel::Filter::Unannotated)).toInt();
+
+    navigationFilterGroup = new QActionGroup(this);
+
+    const auto addItem = [&](const QString& text, FileListModel::Filter filter) {
+        QAction* action = navigationFilterGroup->addAction(text);
+        action->setCheckable(true);
+        action->setData(static_cast<int>(filter));
+        action->setChecked(static_cast<int>(filter) == defaultFilter);
+        ui->menuGo->addAction(action);
+    };
+
+    addItem(tr("Match unannotated"), FileListModel::Filter::Unannotated);
+    addItem(tr("Match annotated"), FileListModel::Filter::Annotated);
+    addItem(tr("Match with inference results"), FileListModel::Filter::HasResults);
+    addItem(tr("Match stuff annotations only"), FileListModel::Filter::StuffOnly);
+    addItem(tr("Match thing annotations only"), FileListModel::Filter::ThingsOnly);
+    addItem(tr("Match annotated, without inference results"), FileListModel::Filter::AnnotatedWithoutResults);
+    addItem(tr("Match unannotated, with inference results"), FileListModel::Filter::UnannotatedWithResults);
+
+    if (!navigationFilterGroup->checkedAction()) {
+        navigationFilterGroup->actions().front()->setChecked(true);
+    }
+}
 
-    return !progress->wasCanceled();
+FileListModel::Filter MainWindow::getNavigationFilter() const
+{
+    const QAction* action = navigationFilterGroup->checkedAction();
+    return action ? static_cast<FileListModel::Filter>(action->data().toInt()) : FileListModel::Filter::Unannotated;
+}
+
+void MainWindow::onFileSortKeyChanged(int index)
+{
+    if (sortFileList()) {
+        currentFileSortKeyIndex = index;
+    }
+    else {
+        // canceled, so the order did not change
+        const QSignalBlocker blocker(fileSortKey);
+        fileSortKey->setCurrentIndex(currentFileSortKeyIndex);
+    }
+}
+
+void MainWindow::onRestoreDefaultWindowPositions()
+{
+    restoreGeometry(defaultGeometry);
+    restoreState(defaultState);
 }
 
 void MainWindow::onAbout()
@@ -9,13 +9,26 @@ class MainWindow;
 
 class QListWidget;
 class QListWidgetItem;
+class QListView;
 class QSpinBox;
 class QCheckBox;
+class QComboBox;
 class QRadioButton;
 class QPushButton;
-class QProgressDialog;
+class QActionGroup;
+class QLineEdit;
+class QTimer;
 
 #include "QResultImageView/QResultImageView.h"
+#include "folderscanner.h"
+#include "filelistmodel.h"
+#include "imageloader.h"
+#include "maskdelta.h"
+#include "maskjournal.h"
+#include "masksaver.h"
+#include "thingannotationedit.h"
+#include "thingannotationsaver.h"
+#include "undohistorystore.h"
 #include <deque>
 
 class MainWindow : public QMainWindow
@@ -36,9 +49,9 @@ private slots:
     void onOpenFolder();
     void onOpenRecentFolder();
     void onExport();
-    void onFileClicked(QListWidgetItem* item);
+    void onFileClicked(const QModelIndex& index);
     void onFileActivated(const QModelIndex& index);
-    void onFileItemChanged(QListWidgetItem* current, QListWidgetItem* previous);
+    void onCurrentFileChanged(const QModelIndex& current, const QModelIndex& previous);
     void onAnnotateStuff(bool toggled);
     void onAnnotateThings(bool toggled);
     void onPanButtonToggled(bool toggled);
@@ -55,7 +68,7 @@ private slots:
     void onYardstickVisible(bool toggled);
     void onChannelSelectionToggled(bool toggled);
     void onAnnotationUpdated();
-    void saveCurrentThingAnnotations();
+    void onAnnotationUpdated(const QRect& changedRect); // in the coordinates of the mask
     void onPostponeMaskUpdate();
     void onSaveMask();
     void onAddClass();
@@ -66,6 +79,20 @@ private slots:
     void onNewMarkingRadius(int newMarkingRadius);
     void onAnnotationsVisible(bool visible);
     void onHideUnannotatedFilesToggled(bool toggled);
+    void onNaturalFileOrderToggled(bool toggled);
+    void onFileSortKeyChanged(int index);
+    void onFileFilterChanged(int index);
+    void onSearch();
+    void onNextMatchingFile();
+    void onPreviousMatchingFile();
+    void onFolderScanBatchReady(const FolderScanner::Batch& batch);
+    void onFolderScanFinished(bool canceled);
+    void onStopFolderScan();
+    void onImageLoaded(const ImageLoader::Bundle& bundle);
+    void onSaveFailed(const QString& error);
+    void onConvertMasksToTiles();
+    void onConvertMasksToPng();
+    void onConvertThingAnnotations();
     void onRestoreDefaultWindowPositions();
     void onAbout();
 
@@ -75,16 +102,32 @@ private:
     void createImageView();
 
     void openFolder(const QString& dir);
+    void finishFolderScan();
+    bool sortFileList(); // returns false, if canceled
+    void updateFolderScanStatus();
+    void selectFile(int fileId);
+    void scrollToCurrentFile();
+    void selectMatchingFile(bool forward);
+    void createNavigationFilterMenuItems();
+    FileListModel::Filter getNavigationFilter() const;
     void addRecentFolderMenuItem(const QString& dir);
     void saveRecentFolders();
     void saveMaskIfDirty();
+    void recordThingAnnotationEdit(const ThingAnnotationEdit& edit, bool isUndo);
     void saveMask();
+    void convertMasks(bool toTiles);
+    QHash<QRgb, QString> getClassNamesByColor() const;
 
-    void loadFile(QListWidgetItem* item);
+    void loadFile(int fileId);
+    ImageLoader::Request getImageLoaderRequest(int fileId) const;
+    void prefetchNeighbors();
     void initCurrentImage(QResultImageView::DelayedRedrawToken* delayedRedrawToken = nullptr);
+    void setViewImage(const QImage& shownImage, QResultImageView::DelayedRedrawToken* delayedRedrawToken);
 
     static QString getMaskFilenameSuffix();
     static QString getMaskFilename(const QString& baseImageFilename);
+    static QString getTiledMaskFilename(const QString& baseImageFilename);
+    static QString getNewestMaskFilename(const QString& baseImageFilename); // the PNG or the tiled mask, whichever counts
 
     static QString getThingAnnotationsPathFilenameSuffix();
     static QString getThingAnnotationsPathFilename(const QString& baseImageFilename);
@@ -98,32 +141,39 @@ private:
     void saveClassList() const;
 
     void resetUndoBuffers();
+    void updateViewMask(const QRect& rect); // from currentMask
+    void stashUndoHistory();
+    void restoreUndoHistory();
     void updateUndoRedoMenuItemStatus();
-    void limitUndoOrRedoBufferSize(std::deque<QPixmap>& buffer);
-    void limitUndoOrRedoBufferSize(std::deque<std::vector<QResultImageView::Result>>& buffer);
 
     void updateBucketFillCheckboxState();
 
     bool conditionallyChangeFirstClass(const QString& oldName, QColor oldColor, const QString& newName, QColor newColor);
     static void setClassItemColor(QListWidgetItem* listWidgetItem, QColor color);
 
-    bool hasAnnotations(const QListWidgetItem* item) const;
-    void updateTextColor(QListWidgetItem* item, const QString& baseImageFilename);
-
-    bool cleanFileList(QProgressDialog* progress);
-
-    struct InferenceResults
-    {
-        std::vector<QResultImageView::Result> results;
-        QString error;
-    };
-
-    InferenceResults readResultsJSON(const QString& filename);
-
     Ui::MainWindow* ui;
     QCheckBox* hideUnannotatedFiles = nullptr;
-    QListWidget* files = nullptr;
+    QCheckBox* naturalFileOrder = nullptr;
+    QComboBox* fileSortKey = nullptr;
+    QComboBox* fileFilter = nullptr;
+    QLineEdit* searchField = nullptr;
+    QComboBox* searchSyntax = nullptr;
+    QTimer* searchTimer = nullptr;
+    QActionGroup* navigationFilterGroup = nullptr;
+    int currentFileSortKeyIndex = 0;
+    QListView* files = nullptr;
+    FileListModel* fileList = nullptr;
+    QPushButton* stopFolderScanButton = nullptr;
+    FolderScanner* folderScanner = nullptr;
+    ImageLoader* imageLoader = nullptr;
+    MaskJournal maskJournal; // outlives maskSaver, which uses it
+    MaskSaver* maskSaver = nullptr;
+    ThingAnnotationSaver* thingAnnotationSaver = nullptr;
+    int prefetchCount = 2; // in each direction
+    bool cacheInferenceResults = true;
     QResultImageView* image = nullptr;
+    bool viewTakesMaskArea = false; // whether the view can update just a part of its mask
+    bool viewStretchesImage = false; // whether the view can show an image stretched to a larger size
 
     struct ClassItem {
         QString className;
@@ -167,8 +217,11 @@ private:
     QRadioButton* rgbChannelsButton = nullptr;
 
     QString currentWorkingFolder;
-    QListWidgetItem* currentImageFileItem = nullptr;
+    QString fileToSelectWhenFound;
+    bool selectFileWhenFound = false;
+    int currentImageFileId = -1;
     QString currentImageFile;
+    QString readOnlyImageFile; // made read-only when first annotated
 
     InferenceResults currentResults;
     InferenceResults currentThingAnnotations;
@@ -176,15 +229,18 @@ private:
 
     bool maskDirty = false;
     int saveMaskPendingCounter = 0;
+    QRegion unsavedMaskRegion; // where the mask has changed since it was last saved
 
     QMenu* recentFoldersMenu;
 
-    QPixmap currentMask;
-    std::deque<QPixmap> maskUndoBuffer;
-    std::deque<QPixmap> maskRedoBuffer;
+    SparseMask currentMask; // null, if there has never been a mask
+    MaskDeltaStack maskUndoBuffer;
+    MaskDeltaStack maskRedoBuffer;
+
+    ThingAnnotationEditStack annotationUndoBuffer;
+    ThingAnnotationEditStack annotationRedoBuffer;
 
-    std::deque<std::vector<QResultImageView::Result>> annotationUndoBuffer;
-    std::deque<std::vector<QResultImageView::Result>> annotationRedoBuffer;
+    UndoHistoryStore undoHistoryStore;
 
     QWidget* aboutDialog = nullptr;
 
@@ -197,6 +253,8 @@ private:
     const QString ignoreClassLabel = tr("Ignore");
 
     QImage originalImage;
+    bool originalImageIsGrayscale = false;
+    QSize originalImageFullSize; // if the image is just a preview, the size of the full image
     QImage currentlyShownImage;
 };
 
@@ -0,0 +1,229 @@
+#include "maskdelta.h"
+
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace {
+    const int tileSize = SparseMask::tileSize;
+
+    bool isZero(const quint32* pixels, int count)
+    {
+        return std::all_of(pixels, pixels + count, [](quint32 value) { return value == 0; });
+    }
+
+    // Row by row, collects the pixels into pairs of run length and value
+    class RunEncoder
+    {
+    public:
+        void add(quint32 value)
+        {
+            if (runLength > 0 && value == runValue) {
+                ++runLength;
+            }
+            else {
+                finishRun();
+                runLength = 1;
+                runValue = value;
+            }
+        }
+
+        QByteArray finish()
+        {
+            finishRun();
+            return QByteArray(reinterpret_cast<const char*>(runs.data()), static_cast<int>(runs.size() * sizeof(quint32)));
+        }
+
+    private:
+        void finishRun()
+        {
+            if (runLength > 0) {
+                runs.push_back(runLength);
+                runs.push_back(runValue);
+            }
+        }
+
+        std::vector<quint32> runs;
+        quint32 runLength = 0;
+        quint32 runValue = 0;
+    };
+}
+
+MaskDelta MaskDelta::compute(const SparseMask& before, const QImage& after, const QRect& area)
+{
+    Q_ASSERT(before.size() == after.size());
+
+    MaskDelta delta;
+
+    const QRect rect = area.isNull() ? after.rect() : area & after.rect();
+    if (rect.isEmpty()) {
+        return delta;
+    }
+
+    // Any other format is converted, but only within the area
+    QImage converted;
+    QPoint origin(0, 0); // of the image read, in the coordinates of the mask
+    if (after.format() != QImage::Format_ARGB32 && after.format() != QImage::Format_ARGB32_Premultiplied) {
+        converted = after.copy(rect).convertToFormat(QImage::Format_ARGB32);
+        origin = rect.topLeft();
+    }
+    const QImage& source = converted.isNull() ? after : converted;
+    const bool isPremultiplied = source.format() == QImage::Format_ARGB32_Premultiplied;
+
+    std::vector<quint32> buffer(tileSize);
+
+    // The pixels of "after" from (x, y) on, in Format_ARGB32
+    const auto getAfter = [&source, &origin, isPremultiplied, &buffer](int x, int y, int count) {
+        const quint32* pixels = reinterpret_cast<const quint32*>(source.constScanLine(y - origin.y())) + (x - origin.x());
+        if (!isPremultiplied) {
+            return pixels;
+        }
+        std::transform(pixels, pixels + count, buffer.begin(), [](quint32 pixel) { return qUnpremultiply(pixel); });
+        return static_cast<const quint32*>(buffer.data());
+    };
+
+    int top = -1;
+    int bottom = -1;
+    int left = rect.right() + 1;
+    int right = -1;
+
+    const int firstColumn = rect.left() / tileSize;
+    const int lastColumn = rect.right() / tileSize;
+
+    for (int y = rect.top(); y <= rect.bottom(); ++y) {
+        // A tile at a time, as that is how "before" is laid out
+        for (int column = firstColumn; column <= lastColumn; ++column) {
+            const int x0 = std::max(column * tileSize, rect.left());
+            const int count = std::min((column + 1) * tileSize, rect.right() + 1) - x0;
+            const quint32* beforeRow = before.constScanLine(column, y); // null if transparent
+            const quint32* beforeSegment = beforeRow ? beforeRow + (x0 - column * tileSize) : nullptr;
+            const quint32* afterSegment = getAfter(x0, y, count);
+
+            const bool isSame = beforeSegment
+                    ? memcmp(beforeSegment, afterSegment, count * sizeof(quint32)) == 0
+                    : isZero(afterSegment, count);
+
+            if (isSame) {
+                continue;
+            }
+
+            const auto getBefore = [beforeSegment](int x) { return beforeSegment ? beforeSegment[x] : 0; };
+
+            int first = 0;
+            while (getBefore(first) == afterSegment[first]) {
+                ++first;
+            }
+            int last = count - 1;
+            while (getBefore(last) == afterSegment[last]) {
+                --last;
+            }
+
+            if (top < 0) {
+                top = y;
+            }
+            bottom = y;
+            left = std::min(left, x0 + first);
+            right = std::max(right, x0 + last);
+        }
+    }
+
+    if (top < 0) {
+        return delta; // nothing changed
+    }
+
+    delta.changedRect = QRect(QPoint(left, top), QPoint(right, bottom));
+
+    RunEncoder encoder;
+
+    for (int y = top; y <= bottom; ++y) {
+        for (int x = left; x <= right; ) {
+            const int column = x / tileSize;
+            const int x0 = column * tileSize;
+            const int segmentEnd = std::min(x0 + tileSize - 1, right);
+            const quint32* beforeSegment = before.constScanLine(column, y);
+            const quint32* afterSegment = getAfter(x, y, segmentEnd + 1 - x);
+            for (int i = 0; x <= segmentEnd; ++x, ++i) {
+                encoder.add((beforeSegment ? beforeSegment[x - x0] : 0) ^ afterSegment[i]);
+            }
+        }
+    }
+
+    delta.runs = encoder.finish();
+
+    return delta;
+}
+
+bool MaskDelta::isEmpty() const
+{
+    return changedRect.isEmpty();
+}
+
+QRect MaskDelta::rect() const
+{
+    return changedRect;
+}
+
+size_t MaskDelta::bytes() const
+{
+    return sizeof(MaskDelta) + runs.size();
+}
+
+void MaskDelta::apply(SparseMask& mask) const
+{
+    if (isEmpty() || !mask.rect().contains(changedRect)) {
+        return;
+    }
+
+    const quint32* run = reinterpret_cast<const quint32*>(runs.constData());
+    const quint32* const end = run + runs.size() / sizeof(quint32) / 2 * 2;
+
+    quint32 length = 0;
+    quint32 value = 0;
+
+    for (int y = changedRect.top(); y <= changedRect.bottom(); ++y) {
+        for (int x = changedRect.left(); x <= changedRect.right(); ) {
+            const int column = x / tileSize;
+            const int x0 = column * tileSize;
+            const int segmentEnd = std::min(x0 + tileSize - 1, changedRect.right());
+
+            quint32* segment = nullptr; // only touched (and so made) if something changes
+
+            while (x <= segmentEnd) {
+                if (length == 0) {
+                    if (run == end) {
+                        mask.squeeze(changedRect);
+                        return;
+                    }
+                    length = run[0];
+                    value = run[1];
+                    run += 2;
+                    continue;
+                }
+
+                const int count = static_cast<int>(std::min<quint32>(length, segmentEnd + 1 - x));
+                if (value != 0) {
+                    if (!segment) {
+                        segment = mask.scanLine(column, y);
+                    }
+                    for (int i = x - x0, iEnd = i + count; i < iEnd; ++i) {
+                        segment[i] ^= value;
+                    }
+                }
+                x += count;
+                length -= count;
+            }
+        }
+    }
+
+    mask.squeeze(changedRect);
+}
+
+QDataStream& operator<<(QDataStream& stream, const MaskDelta& delta)
+{
+    return stream << delta.changedRect << delta.runs;
+}
+
+QDataStream& operator>>(QDataStream& stream, MaskDelta& delta)
+{
+    return stream >> delta.changedRect >> delta.runs;
+}
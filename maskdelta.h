@@ -0,0 +1,46 @@
+#ifndef MASKDELTA_H
+#define MASKDELTA_H
+
+#include "sparsemask.h"
+#include "undostack.h"
+
+#include <QByteArray>
+#include <QImage>
+#include <QRect>
+
+// The difference between two versions of a mask, for undo and redo. Only the
+// rectangle that changed is kept, as the run-length encoded XOR of the pixels.
+// A label mask has long runs of a single color, and outside of the strokes the
+// XOR is just zero, so a delta is usually tiny even for a huge mask. Because
+// of the XOR, the same delta takes the mask in either direction.
+class MaskDelta
+{
+public:
+    MaskDelta() = default;
+
+    // The two must be of the same size. Only the pixels within the area (by
+    // default, all of them) are compared; outside of it, nothing has changed.
+    // "After" is read as is in Format_ARGB32 or Format_ARGB32_Premultiplied
+    // (which is what a pixmap usually holds), and otherwise, just the area
+    // is converted first.
+    static MaskDelta compute(const SparseMask& before, const QImage& after, const QRect& area = QRect());
+
+    bool isEmpty() const;
+    QRect rect() const;
+    size_t bytes() const;
+
+    // Takes the mask from "before" to "after", or the other way round; tiles
+    // are added where needed, and dropped once they become transparent again
+    void apply(SparseMask& mask) const;
+
+    friend QDataStream& operator<<(QDataStream& stream, const MaskDelta& delta);
+    friend QDataStream& operator>>(QDataStream& stream, MaskDelta& delta);
+
+private:
+    QRect changedRect;
+    QByteArray runs; // pairs of 32-bit run length and XOR value, row by row
+};
+
+typedef UndoStack<MaskDelta> MaskDeltaStack;
+
+#endif // MASKDELTA_H
@@ -0,0 +1,460 @@
+#include "maskjournal.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <vector>
+
+namespace {
+    const quint32 journalMagic = 0x414e4d4a; // "ANMJ"
+    const quint32 journalVersion = 2;
+    const QDataStream::Version streamVersion = QDataStream::Qt_5_12;
+
+    enum class EntryType : quint8 {
+        Checkpoint = 0,
+        Delta = 1,
+        Fingerprint = 2, // of the mask saved at a checkpoint that was recorded without one
+    };
+
+    struct Entry {
+        EntryType type = EntryType::Delta;
+        quint64 id = 0; // of a checkpoint
+        bool hasFingerprint = false; // of a checkpoint
+        uint fingerprint = 0; // of a checkpoint
+        QSize size; // of a checkpoint
+        QByteArray delta; // compressed
+    };
+
+    Entry makeCheckpoint(quint64 id, bool hasFingerprint, uint fingerprint, const QSize& size)
+    {
+        Entry entry;
+        entry.type = EntryType::Checkpoint;
+        entry.id = id;
+        entry.hasFingerprint = hasFingerprint;
+        entry.fingerprint = fingerprint;
+        entry.size = size;
+        return entry;
+    }
+
+    QByteArray encode(const Entry& entry)
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << static_cast<quint8>(entry.type);
+        if (entry.type == EntryType::Checkpoint) {
+            stream << entry.id << entry.hasFingerprint << entry.fingerprint << entry.size;
+        }
+        else if (entry.type == EntryType::Fingerprint) {
+            stream << entry.id << entry.fingerprint;
+        }
+        else {
+            stream << entry.delta;
+        }
+        return data;
+    }
+
+    bool decode(const QByteArray& data, Entry& entry)
+    {
+        QDataStream stream(data);
+        stream.setVersion(streamVersion);
+        quint8 type = 0;
+        stream >> type;
+        if (type == static_cast<quint8>(EntryType::Checkpoint)) {
+            entry.type = EntryType::Checkpoint;
+            stream >> entry.id >> entry.hasFingerprint >> entry.fingerprint >> entry.size;
+        }
+        else if (type == static_cast<quint8>(EntryType::Fingerprint)) {
+            entry.type = EntryType::Fingerprint;
+            stream >> entry.id >> entry.fingerprint;
+        }
+        else if (type == static_cast<quint8>(EntryType::Delta)) {
+            entry.type = EntryType::Delta;
+            stream >> entry.delta;
+        }
+        else {
+            return false;
+        }
+        return stream.status() == QDataStream::Ok;
+    }
+
+    bool decodeDelta(const Entry& entry, MaskDelta& delta)
+    {
+        const QByteArray data = qUncompress(entry.delta);
+        QDataStream stream(data);
+        stream.setVersion(streamVersion);
+        stream >> delta;
+        return !data.isEmpty() && stream.status() == QDataStream::Ok;
+    }
+
+    // Stops at the first entry that was not written completely
+    bool readJournal(const QString& journalFilename, std::vector<Entry>& entries)
+    {
+        QFile file(journalFilename);
+        if (journalFilename.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+
+        QDataStream stream(&file);
+        stream.setVersion(streamVersion);
+
+        quint32 magic = 0;
+        quint32 version = 0;
+        stream >> magic >> version;
+        if (stream.status() != QDataStream::Ok || magic != journalMagic || version != journalVersion) {
+            return false;
+        }
+
+        while (!stream.atEnd()) {
+            QByteArray data;
+            stream >> data;
+            Entry entry;
+            if (stream.status() != QDataStream::Ok || !decode(data, entry)) {
+                break;
+            }
+            entries.push_back(entry);
+        }
+
+        return !entries.empty();
+    }
+
+    template <typename Records>
+    bool writeJournal(const QString& journalFilename, const Records& records)
+    {
+        if (journalFilename.isEmpty() || !QDir().mkpath(QFileInfo(journalFilename).absolutePath())) {
+            return false;
+        }
+
+        QSaveFile file(journalFilename);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+
+        QDataStream stream(&file);
+        stream.setVersion(streamVersion);
+        stream << journalMagic << journalVersion;
+        for (const auto& record : records) {
+            stream << record.data;
+        }
+
+        if (stream.status() != QDataStream::Ok) {
+            file.cancelWriting();
+            return false;
+        }
+
+        return file.commit();
+    }
+
+    bool appendToJournal(const QString& journalFilename, const QByteArray& data)
+    {
+        QFile file(journalFilename);
+        if (journalFilename.isEmpty() || !file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+            return false;
+        }
+
+        QDataStream stream(&file);
+        stream.setVersion(streamVersion);
+        stream << data;
+
+        return stream.status() == QDataStream::Ok && file.flush();
+    }
+}
+
+bool MaskJournal::recover(const QString& maskFilename, const QSize& imageSize, SparseMask& mask)
+{
+    const SparseMask saved = mask.isNull() ? SparseMask(imageSize) : mask;
+
+    Checkpoint checkpoint;
+    checkpoint.fingerprint = getMaskFingerprint(saved);
+    checkpoint.size = saved.size();
+
+    QMutexLocker locker(&mutex);
+
+    newest[maskFilename] = checkpoint;
+    journals.remove(maskFilename);
+
+    const QString journalFilename = getJournalFilename(maskFilename);
+
+    std::vector<Entry> entries;
+    if (!readJournal(journalFilename, entries)) {
+        return false;
+    }
+
+    // The fingerprints of the masks saved at the checkpoints that did not have one
+    QHash<quint64, uint> fingerprints;
+    for (const Entry& entry : entries) {
+        if (entry.type == EntryType::Fingerprint) {
+            fingerprints[entry.id] = entry.fingerprint;
+        }
+    }
+
+    const auto matches = [&checkpoint, &fingerprints](const Entry& entry) {
+        if (entry.type != EntryType::Checkpoint || entry.size != checkpoint.size) {
+            return false;
+        }
+        if (entry.hasFingerprint) {
+            return entry.fingerprint == checkpoint.fingerprint;
+        }
+        const auto i = fingerprints.constFind(entry.id);
+        return i != fingerprints.constEnd() && i.value() == checkpoint.fingerprint;
+    };
+
+    // Start from the latest checkpoint that matches the mask in the file
+    size_t start = entries.size();
+    for (size_t i = entries.size(); i > 0; --i) {
+        if (matches(entries[i - 1])) {
+            start = i;
+            break;
+        }
+    }
+
+    SparseMask recovered = saved;
+
+    std::vector<Record> replayed;
+    {
+        Record record;
+        record.sequence = nextSequence++;
+        record.data = encode(makeCheckpoint(record.sequence, true, checkpoint.fingerprint, checkpoint.size));
+        replayed.push_back(record);
+    }
+
+    for (size_t i = start, end = entries.size(); i < end; ++i) {
+        const Entry& entry = entries[i];
+        if (entry.type == EntryType::Checkpoint) {
+            if (entry.size != recovered.size()) {
+                break; // the mask was resized, which is not in the journal
+            }
+            continue;
+        }
+        if (entry.type == EntryType::Fingerprint) {
+            continue;
+        }
+
+        MaskDelta delta;
+        if (!decodeDelta(entry, delta) || !recovered.rect().contains(delta.rect())) {
+            break;
+        }
+
+        delta.apply(recovered);
+
+        Record record;
+        record.sequence = nextSequence++;
+        record.data = encode(entry);
+        replayed.push_back(record);
+    }
+
+    if (replayed.size() == 1) {
+        // Either nothing to replay, or the mask has been changed elsewhere meanwhile
+        QFile::remove(journalFilename);
+        return false;
+    }
+
+    // Kept until the recovered mask has been saved, and without whatever did
+    // not apply, so that the changes of this session can be appended
+    writeJournal(journalFilename, replayed);
+    journals[maskFilename] = replayed;
+
+    mask = recovered;
+    return true;
+}
+
+void MaskJournal::append(const QString& maskFilename, const MaskDelta& delta)
+{
+    Entry entry;
+    {
+        QByteArray data;
+        QDataStream stream(&data, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << delta;
+        entry.delta = qCompress(data, 1);
+    }
+
+    Record record;
+    record.data = encode(entry);
+
+    QMutexLocker locker(&mutex);
+
+    const auto i = newest.constFind(maskFilename);
+    if (i == newest.constEnd()) {
+        return; // not loaded through recover, so there is nothing to start the journal from
+    }
+
+    std::vector<Record>& records = journals[maskFilename];
+    if (records.empty()) {
+        // The journal starts from the version last loaded or written
+        Record base;
+        base.sequence = nextSequence++;
+        base.data = encode(makeCheckpoint(base.sequence, true, i.value().fingerprint, i.value().size));
+        records.push_back(base);
+    }
+
+    record.sequence = nextSequence++;
+    records.push_back(record);
+
+    store(maskFilename, records);
+}
+
+quint64 MaskJournal::checkpoint(const QString& maskFilename, const QSize& size)
+{
+    QMutexLocker locker(&mutex);
+
+    // Without a journal, there have been no changes since the previous checkpoint
+    const auto i = journals.find(maskFilename);
+    if (i == journals.end() || i.value().empty()) {
+        return 0;
+    }
+
+    Record record;
+    record.sequence = nextSequence++;
+    record.data = encode(makeCheckpoint(record.sequence, false, 0, size));
+    i.value().push_back(record);
+
+    store(maskFilename, i.value());
+
+    return record.sequence;
+}
+
+void MaskJournal::setFingerprint(const QString& maskFilename, quint64 checkpoint, uint fingerprint)
+{
+    if (checkpoint == 0) {
+        return;
+    }
+
+    Entry entry;
+    entry.type = EntryType::Fingerprint;
+    entry.id = checkpoint;
+    entry.fingerprint = fingerprint;
+
+    Record record;
+    record.data = encode(entry);
+
+    QMutexLocker locker(&mutex);
+
+    const auto i = journals.find(maskFilename);
+    if (i == journals.end() || i.value().empty() || i.value().front().sequence > checkpoint) {
+        return; // discarded, or already truncated past it
+    }
+
+    record.sequence = nextSequence++;
+    i.value().push_back(record);
+
+    store(maskFilename, i.value());
+}
+
+void MaskJournal::truncate(const QString& maskFilename, quint64 checkpoint, uint fingerprint, const QSize& size)
+{
+    const QString journalFilename = getJournalFilename(maskFilename);
+
+    std::vector<Record> remaining;
+    quint64 lastSequence = 0;
+
+    {
+        QMutexLocker locker(&mutex);
+
+        const auto i = newest.find(maskFilename);
+        if (i == newest.end()) {
+            return; // discarded meanwhile
+        }
+
+        std::vector<Record>& records = journals[maskFilename];
+
+        const auto saved = std::find_if(records.begin(), records.end(), [checkpoint](const Record& record) {
+            return record.sequence == checkpoint;
+        });
+
+        if (checkpoint != 0 && saved == records.end()) {
+            return; // recovered or truncated past it meanwhile
+        }
+
+        if (checkpoint == 0 && !records.empty()) {
+            return; // the changes since are still to be saved
+        }
+
+        i.value().fingerprint = fingerprint;
+        i.value().size = size;
+
+        // Drop the changes that are now in the file, starting from the checkpoint
+        // (with its fingerprint now known)
+        if (checkpoint == 0 || saved + 1 == records.end()) {
+            journals.remove(maskFilename);
+            QFile::remove(journalFilename);
+            return;
+        }
+
+        Record base;
+        base.sequence = checkpoint;
+        base.data = encode(makeCheckpoint(checkpoint, true, fingerprint, size));
+
+        remaining.push_back(base);
+        remaining.insert(remaining.end(), saved + 1, records.end());
+        records = remaining;
+
+        lastSequence = remaining.back().sequence;
+        rewriting.insert(maskFilename);
+    }
+
+    // Rewritten without holding the lock, so that appending the changes does
+    // not wait for it. If this fails, the old journal is still valid, as it
+    // just has the changes that are in the file too.
+    writeJournal(journalFilename, remaining);
+
+    QMutexLocker locker(&mutex);
+
+    rewriting.remove(maskFilename);
+
+    const auto i = journals.constFind(maskFilename);
+    if (i == journals.constEnd()) {
+        QFile::remove(journalFilename); // discarded meanwhile
+        return;
+    }
+
+    // The records appended meanwhile are not in what was just written
+    for (const Record& record : i.value()) {
+        if (record.sequence > lastSequence) {
+            appendToJournal(journalFilename, record.data);
+        }
+    }
+}
+
+void MaskJournal::discard(const QString& maskFilename)
+{
+    QMutexLocker locker(&mutex);
+
+    newest.remove(maskFilename);
+    journals.remove(maskFilename);
+    QFile::remove(getJournalFilename(maskFilename));
+}
+
+void MaskJournal::store(const QString& maskFilename, const std::vector<Record>& records)
+{
+    if (rewriting.contains(maskFilename)) {
+        return; // appended once the journal has been rewritten
+    }
+
+    // If this fails, the change is just not protected; the mask itself is saved as usual
+    const QString journalFilename = getJournalFilename(maskFilename);
+    if (records.size() > 1 && QFileInfo::exists(journalFilename)) {
+        appendToJournal(journalFilename, records.back().data);
+    }
+    else {
+        writeJournal(journalFilename, records);
+    }
+}
+
+QString MaskJournal::getJournalFilename(const QString& maskFilename)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty() || maskFilename.isEmpty()) {
+        return QString();
+    }
+
+    const QString canonicalFilename = QDir::cleanPath(QFileInfo(maskFilename).absoluteFilePath());
+    const QByteArray key = QCryptographicHash::hash(canonicalFilename.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    return cacheDirectory + "/mask-journal/" + QString::fromLatin1(key) + ".journal";
+}
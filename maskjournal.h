@@ -0,0 +1,79 @@
+#ifndef MASKJOURNAL_H
+#define MASKJOURNAL_H
+
+#include "maskdelta.h"
+#include "sparsemask.h"
+
+#include <QHash>
+#include <QByteArray>
+#include <QMutex>
+#include <QSet>
+#include <QSize>
+#include <QString>
+#include <vector>
+
+// A write-ahead log of the changes to the masks, so that the masks can still be
+// saved only every now and then without losing the latest strokes in a crash.
+// Each change is appended as the (compressed) delta that the undo buffer gets
+// anyway, which is cheap however large the mask. Whenever a mask is handed over
+// to be saved, a checkpoint is appended. The saver then records the fingerprint
+// of the mask (computed on its own thread) before writing it, and once it has
+// been written, everything up to the checkpoint is dropped, and a journal with
+// nothing left in it is removed.
+//
+// When the mask is next loaded, the changes after the checkpoint that matches
+// the mask in the file (if any) are replayed on top of it.
+//
+// The journals are kept in the cache directory, and mirrored in memory, so that
+// dropping the saved changes need not read the file back, nor hold the lock
+// while rewriting it. Safe to use from any thread.
+class MaskJournal
+{
+public:
+    // Call with the mask just loaded: replays the changes that an earlier
+    // session did not get to save, if they apply. A null mask is taken to be
+    // a transparent one of the size of the image. Returns false if there was
+    // nothing to replay.
+    bool recover(const QString& maskFilename, const QSize& imageSize, SparseMask& mask);
+
+    // Records a change to the mask (since recover)
+    void append(const QString& maskFilename, const MaskDelta& delta);
+
+    // Records that the mask is about to be saved; returns the checkpoint to
+    // pass on to the calls below (0, if there have been no changes since the
+    // previous checkpoint)
+    quint64 checkpoint(const QString& maskFilename, const QSize& size);
+
+    // Call before writing the mask saved at the checkpoint, with its fingerprint
+    void setFingerprint(const QString& maskFilename, quint64 checkpoint, uint fingerprint);
+
+    // Call once the mask saved at the checkpoint has been written
+    void truncate(const QString& maskFilename, quint64 checkpoint, uint fingerprint, const QSize& size);
+
+    // For when the mask itself is deleted
+    void discard(const QString& maskFilename);
+
+private:
+    struct Checkpoint {
+        uint fingerprint = 0;
+        QSize size;
+    };
+
+    struct Record {
+        quint64 sequence = 0; // of a checkpoint, the same as its id
+        QByteArray data; // encoded
+    };
+
+    static QString getJournalFilename(const QString& maskFilename);
+
+    // Writes the latest record to the file (with the ones before, if it is new)
+    void store(const QString& maskFilename, const std::vector<Record>& records);
+
+    QMutex mutex;
+    QHash<QString, Checkpoint> newest; // by the mask filename; the version last loaded or written
+    QHash<QString, std::vector<Record>> journals; // what is in the files
+    QSet<QString> rewriting; // the records appended meanwhile are written afterwards
+    quint64 nextSequence = 1;
+};
+
+#endif // MASKJOURNAL_H
@@ -0,0 +1,143 @@
+#include "maskpalette.h"
+
+#include <algorithm>
+#include <iterator>
+
+namespace {
+    const int maxPaletteSize = 256;
+
+    // An open-addressing hash table from colors to palette indices; with at
+    // most 256 colors in a table of 1024 slots, the probe sequences stay short
+    class ColorIndexTable
+    {
+    public:
+        explicit ColorIndexTable(const QVector<QRgb>& palette) {
+            std::fill(std::begin(used), std::end(used), false);
+            for (int i = palette.size() - 1; i >= 0; --i) {
+                insert(palette[i], static_cast<uchar>(i)); // so that the first one wins in case of duplicates
+            }
+        }
+
+        bool find(QRgb color, uchar& index) const {
+            for (quint32 slot = getSlot(color); used[slot]; slot = (slot + 1) & mask) {
+                if (colors[slot] == color) {
+                    index = indices[slot];
+                    return true;
+                }
+            }
+            return false;
+        }
+
+    private:
+        static const quint32 slotCount = 1024;
+        static const quint32 mask = slotCount - 1;
+
+        static quint32 getSlot(QRgb color) {
+            return (color * 2654435761u) >> 22; // the top 10 bits
+        }
+
+        void insert(QRgb color, uchar index) {
+            quint32 slot = getSlot(color);
+            while (used[slot] && colors[slot] != color) {
+                slot = (slot + 1) & mask;
+            }
+            used[slot] = true;
+            colors[slot] = color;
+            indices[slot] = index;
+        }
+
+        bool used[slotCount];
+        QRgb colors[slotCount];
+        uchar indices[slotCount];
+    };
+}
+
+QVector<QRgb> getMaskPalette(const std::vector<QColor>& classColors)
+{
+    QVector<QRgb> palette;
+
+    if (static_cast<int>(classColors.size()) >= maxPaletteSize) {
+        return palette;
+    }
+
+    palette.reserve(static_cast<int>(classColors.size()) + 1);
+    palette.push_back(qRgba(0, 0, 0, 0));
+
+    for (const QColor& color : classColors) {
+        palette.push_back(color.rgba());
+    }
+
+    return palette;
+}
+
+QImage toIndexedMask(const QImage& mask, const QVector<QRgb>& palette)
+{
+    if (mask.format() != QImage::Format_ARGB32 || palette.isEmpty() || palette.size() > maxPaletteSize) {
+        return QImage();
+    }
+
+    const ColorIndexTable table(palette);
+
+    QImage result(mask.size(), QImage::Format_Indexed8);
+    result.setColorTable(palette);
+
+    const int width = mask.width();
+
+    for (int y = 0, height = mask.height(); y < height; ++y) {
+        const QRgb* source = reinterpret_cast<const QRgb*>(mask.constScanLine(y));
+        uchar* target = result.scanLine(y);
+
+        // Strokes make long runs of a single color, so remember the previous one
+        QRgb previousColor = 0;
+        uchar previousIndex = 0;
+        bool hasPrevious = false;
+
+        for (int x = 0; x < width; ++x) {
+            QRgb color = source[x];
+            if (qAlpha(color) == 0) {
+                color = 0; // whatever the color channels say, it's just transparent
+            }
+            if (!hasPrevious || color != previousColor) {
+                if (color == 0) {
+                    previousIndex = 0;
+                }
+                else if (!table.find(color, previousIndex)) {
+                    return QImage();
+                }
+                previousColor = color;
+                hasPrevious = true;
+            }
+            target[x] = previousIndex;
+        }
+    }
+
+    return result;
+}
+
+QImage fromIndexedMask(const QImage& indexedMask)
+{
+    if (indexedMask.format() != QImage::Format_Indexed8) {
+        return indexedMask.convertToFormat(QImage::Format_ARGB32);
+    }
+
+    // Any index beyond the color table is taken as transparent
+    QRgb lookupTable[maxPaletteSize];
+    const QVector<QRgb> colorTable = indexedMask.colorTable();
+    for (int i = 0; i < maxPaletteSize; ++i) {
+        lookupTable[i] = i < colorTable.size() ? colorTable[i] : qRgba(0, 0, 0, 0);
+    }
+
+    QImage result(indexedMask.size(), QImage::Format_ARGB32);
+
+    const int width = indexedMask.width();
+
+    for (int y = 0, height = indexedMask.height(); y < height; ++y) {
+        const uchar* source = indexedMask.constScanLine(y);
+        QRgb* target = reinterpret_cast<QRgb*>(result.scanLine(y));
+        for (int x = 0; x < width; ++x) {
+            target[x] = lookupTable[source[x]];
+        }
+    }
+
+    return result;
+}
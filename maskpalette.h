@@ -0,0 +1,27 @@
+#ifndef MASKPALETTE_H
+#define MASKPALETTE_H
+
+#include <QColor>
+#include <QImage>
+#include <QVector>
+#include <vector>
+
+// A mask contains just the exact colors of the annotation classes, plus fully
+// transparent for the pixels not annotated, so it can be stored as an 8-bit
+// palette-indexed image. Index 0 is transparent, and index i + 1 is class i of
+// the class list, so the indices alone can serve as a class-index image.
+//
+// The conversions go through lookup tables, rather than matching colors one
+// pixel at a time.
+
+// Returns an empty palette if there are too many classes
+QVector<QRgb> getMaskPalette(const std::vector<QColor>& classColors);
+
+// The mask should be in Format_ARGB32. Returns a null image if the mask has a
+// color that is not in the palette.
+QImage toIndexedMask(const QImage& mask, const QVector<QRgb>& palette);
+
+// Returns the mask in Format_ARGB32
+QImage fromIndexedMask(const QImage& indexedMask);
+
+#endif // MASKPALETTE_H
@@ -0,0 +1,203 @@
+#include "masksaver.h"
+#include "imageloader.h"
+#include "maskjournal.h"
+#include "maskpalette.h"
+
+#include "tiledmask.h"
+
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSaveFile>
+
+class MaskSaver::Writer : public QRunnable
+{
+public:
+    explicit Writer(MaskSaver* saver)
+        : saver(saver)
+    {}
+
+    void run() override {
+        saver->work();
+    }
+
+private:
+    MaskSaver* const saver;
+};
+
+MaskSaver::MaskSaver(ImageLoader* imageLoader, MaskJournal* journal, QObject* parent)
+    : QObject(parent)
+    , imageLoader(imageLoader)
+    , journal(journal)
+{
+    // One at a time, so as not to compete with the image loader too much
+    threadPool.setMaxThreadCount(1);
+}
+
+MaskSaver::~MaskSaver()
+{
+    flush();
+    threadPool.waitForDone();
+}
+
+void MaskSaver::save(const QString& imageFilename, const QString& maskFilename, const SparseMask& mask, const QVector<QRgb>& palette)
+{
+    Pending item;
+    item.imageFilename = imageFilename;
+    item.mask = mask;
+    item.palette = palette;
+    item.changedRegion = mask.rect();
+    if (journal) {
+        item.checkpoint = journal->checkpoint(maskFilename, mask.size());
+    }
+
+    enqueue(maskFilename, item);
+}
+
+void MaskSaver::saveTiled(const QString& imageFilename, const QString& maskFilename, const QString& tiledMaskFilename, const SparseMask& mask, const QRegion& changedRegion)
+{
+    Pending item;
+    item.imageFilename = imageFilename;
+    item.mask = mask;
+    item.tiledMaskFilename = tiledMaskFilename;
+    item.changedRegion = changedRegion;
+    if (journal) {
+        item.checkpoint = journal->checkpoint(maskFilename, mask.size());
+    }
+
+    enqueue(maskFilename, item);
+}
+
+void MaskSaver::enqueue(const QString& maskFilename, Pending item)
+{
+    QMutexLocker locker(&mutex);
+
+    const auto i = pending.constFind(maskFilename);
+    if (i != pending.constEnd()) {
+        // The earlier version never got written, so its changes are still to be written too
+        item.changedRegion += i.value().changedRegion;
+    }
+
+    const auto j = unwritten.find(maskFilename);
+    if (j != unwritten.end()) {
+        item.changedRegion += j.value();
+        unwritten.erase(j);
+    }
+
+    pending[maskFilename] = item;
+
+    if (!writerRunning) {
+        writerRunning = true;
+        threadPool.start(new Writer(this));
+    }
+}
+
+void MaskSaver::waitFor(const QString& maskFilename)
+{
+    QMutexLocker locker(&mutex);
+    while (pending.contains(maskFilename) || writing.contains(maskFilename)) {
+        written.wait(&mutex);
+    }
+}
+
+void MaskSaver::flush()
+{
+    QMutexLocker locker(&mutex);
+    while (!pending.isEmpty() || !writing.isEmpty()) {
+        written.wait(&mutex);
+    }
+}
+
+void MaskSaver::work()
+{
+    while (true) {
+        QString maskFilename;
+        Pending item;
+
+        {
+            QMutexLocker locker(&mutex);
+            if (pending.isEmpty()) {
+                writerRunning = false;
+                return;
+            }
+            const auto i = pending.begin();
+            maskFilename = i.key();
+            item = i.value();
+            pending.erase(i);
+            writing.insert(maskFilename);
+        }
+
+        uint fingerprint = 0;
+        if (journal) {
+            // Recorded first, so that the journal can be matched to the new mask
+            // even if the application exits before it is truncated
+            fingerprint = getMaskFingerprint(item.mask);
+            journal->setFingerprint(maskFilename, item.checkpoint, fingerprint);
+        }
+
+        QString error;
+        const bool ok = write(maskFilename, item, error);
+        if (!ok) {
+            emit failed(error);
+        }
+        else if (journal) {
+            journal->truncate(maskFilename, item.checkpoint, fingerprint, item.mask.size()); // the changes up to this save are safe now
+        }
+
+        // Anything loaded while the file was being written may be outdated
+        imageLoader->invalidate(item.imageFilename);
+
+        QMutexLocker locker(&mutex);
+
+        if (!ok) {
+            // The tiles may be partly written, so the next save of the mask
+            // rewrites the whole region again (on top of its own changes)
+            const auto i = pending.find(maskFilename);
+            if (i != pending.end()) {
+                i.value().changedRegion += item.changedRegion;
+            }
+            else {
+                unwritten[maskFilename] += item.changedRegion;
+            }
+        }
+
+        writing.remove(maskFilename);
+        written.wakeAll();
+    }
+}
+
+bool MaskSaver::write(const QString& maskFilename, const Pending& item, QString& error)
+{
+    if (!item.tiledMaskFilename.isEmpty()) {
+        const QFileInfo png(maskFilename);
+        const QFileInfo tiled(item.tiledMaskFilename);
+
+        // If the PNG is newer, the tiles are outdated everywhere, not just where changed
+        const bool isUpToDate = tiled.exists() && (!png.exists() || tiled.lastModified() >= png.lastModified());
+
+        const bool ok = (isUpToDate && TiledMask::update(item.tiledMaskFilename, item.mask, item.changedRegion))
+                || TiledMask::write(item.tiledMaskFilename, item.mask);
+
+        if (!ok) {
+            error = tr("Couldn't save mask \"%1\"").arg(item.tiledMaskFilename);
+        }
+        return ok;
+    }
+
+    QImage mask = item.mask.toImage();
+    if (!item.palette.isEmpty()) {
+        const QImage indexedMask = toIndexedMask(mask, item.palette);
+        if (!indexedMask.isNull()) {
+            mask = indexedMask;
+        }
+    }
+
+    QSaveFile file(maskFilename);
+    const bool ok = file.open(QIODevice::WriteOnly)
+            && mask.save(&file, "PNG")
+            && file.commit();
+
+    if (!ok) {
+        error = tr("Couldn't save mask \"%1\": %2").arg(maskFilename, file.errorString());
+    }
+    return ok;
+}
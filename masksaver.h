@@ -0,0 +1,87 @@
+#ifndef MASKSAVER_H
+#define MASKSAVER_H
+
+#include "sparsemask.h"
+
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QRegion>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+#include <QVector>
+#include <QWaitCondition>
+
+class ImageLoader;
+class MaskJournal;
+
+// Encodes and writes masks in the background, so that saving a large mask does
+// not freeze the GUI. The mask is written to a temporary file that replaces the
+// actual one only when complete, so a crash in the middle of a save does not
+// leave a truncated mask behind. If a mask is saved again before the previous
+// save has even started, only the latest version gets written.
+//
+// The cached copy of the image (in the image loader) is invalidated once the
+// new mask is there. If there is a journal, each save is recorded in it as a
+// checkpoint, and the journal is truncated once the mask has been written. The
+// fingerprint that the journal needs is computed here in the background too.
+class MaskSaver : public QObject
+{
+    Q_OBJECT
+
+public:
+    explicit MaskSaver(ImageLoader* imageLoader, MaskJournal* journal = nullptr, QObject* parent = nullptr);
+    ~MaskSaver(); // waits until everything has been written
+
+    // The mask is not copied, but as its tiles are implicitly shared, changing
+    // the caller's copy afterwards does not affect what gets written. If a
+    // palette is given, the mask is written as an 8-bit indexed image (unless
+    // it has colors not in the palette).
+    void save(const QString& imageFilename, const QString& maskFilename, const SparseMask& mask, const QVector<QRgb>& palette = QVector<QRgb>());
+
+    // Writes a tiled mask instead of the PNG. If the tiled mask is up to date
+    // otherwise, only the tiles in the region changed since the previous save
+    // are rewritten (including the region of any earlier save that failed).
+    void saveTiled(const QString& imageFilename, const QString& maskFilename, const QString& tiledMaskFilename, const SparseMask& mask, const QRegion& changedRegion);
+
+    // Returns once the file has been written, if it is pending
+    void waitFor(const QString& maskFilename);
+
+    // Returns once all the pending masks have been written
+    void flush();
+
+signals:
+    void failed(const QString& error);
+
+private:
+    class Writer;
+
+    struct Pending {
+        QString imageFilename;
+        SparseMask mask;
+        QVector<QRgb> palette;
+        QString tiledMaskFilename; // empty, if writing the PNG
+        QRegion changedRegion; // since the previous save that was actually written
+        quint64 checkpoint = 0; // in the journal
+    };
+
+    void enqueue(const QString& maskFilename, Pending item);
+    static bool write(const QString& maskFilename, const Pending& item, QString& error);
+
+    void work();
+
+    ImageLoader* const imageLoader;
+    MaskJournal* const journal;
+
+    QThreadPool threadPool;
+
+    QMutex mutex;
+    QWaitCondition written;
+    QHash<QString, Pending> pending; // by the mask filename; not started yet
+    QSet<QString> writing;
+    QHash<QString, QRegion> unwritten; // by the mask filename; the changes of the saves that failed
+    bool writerRunning = false;
+};
+
+#endif // MASKSAVER_H
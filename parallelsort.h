@@ -0,0 +1,142 @@
+#ifndef PARALLELSORT_H
+#define PARALLELSORT_H
+
+#include <QFuture>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
+
+// Reports the number of steps done, and the total number of steps. Called on the
+// calling thread; returning false cancels the operation.
+typedef std::function<bool(int done, int total)> ParallelProgressCallback;
+
+namespace parallel {
+
+inline int getChunkCount(size_t itemCount, size_t minChunkSize)
+{
+    // A few chunks per thread, for load balancing and for smoother progress reporting
+    const int maxChunkCount = 4 * std::max(1, QThreadPool::globalInstance()->maxThreadCount());
+    int chunkCount = 1;
+    while (chunkCount < maxChunkCount && itemCount / (2 * chunkCount) >= minChunkSize) {
+        chunkCount *= 2;
+    }
+    return chunkCount;
+}
+
+inline size_t getChunkBegin(size_t itemCount, int chunkCount, int chunk)
+{
+    return itemCount * chunk / chunkCount;
+}
+
+// Calls function(begin, end) for consecutive ranges covering [0, itemCount), in parallel
+template <typename Function>
+bool forEachChunk(size_t itemCount, Function function, const ParallelProgressCallback& progress = ParallelProgressCallback())
+{
+    const int chunkCount = getChunkCount(itemCount, 4096);
+
+    std::atomic<bool> canceled(false);
+
+    std::vector<QFuture<void>> futures;
+    futures.reserve(chunkCount);
+
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+        const size_t begin = getChunkBegin(itemCount, chunkCount, chunk);
+        const size_t end = getChunkBegin(itemCount, chunkCount, chunk + 1);
+        futures.push_back(QtConcurrent::run([&canceled, &function, begin, end]() {
+            if (!canceled) {
+                function(begin, end);
+            }
+        }));
+    }
+
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+        futures[chunk].waitForFinished();
+        if (progress && !canceled && !progress(chunk + 1, chunkCount)) {
+            canceled = true;
+        }
+    }
+
+    return !canceled;
+}
+
+// Sorts the items by first sorting chunks of them in parallel, and then merging
+// pairs of chunks (again in parallel) until everything is merged. Progress is
+// reported once per chunk sorted, and once per merge done; the sort can be
+// canceled at those points, in which case the items are left untouched.
+template <typename T, typename Compare>
+bool sort(std::vector<T>& items, Compare compare, const ParallelProgressCallback& progress = ParallelProgressCallback())
+{
+    const size_t itemCount = items.size();
+    const int chunkCount = getChunkCount(itemCount, 16384);
+
+    // Work on a copy, so that canceling leaves the input as it was
+    std::vector<T> sorted(items);
+    std::vector<T> buffer(itemCount);
+
+    // there are chunkCount sorts, plus chunkCount - 1 merges in total
+    const int totalSteps = 2 * chunkCount - 1;
+    int stepsDone = 0;
+
+    std::atomic<bool> canceled(false);
+
+    const auto reportProgress = [&]() {
+        ++stepsDone;
+        if (progress && !canceled && !progress(stepsDone, totalSteps)) {
+            canceled = true;
+        }
+    };
+
+    std::vector<QFuture<void>> futures;
+    futures.reserve(chunkCount);
+
+    for (int chunk = 0; chunk < chunkCount; ++chunk) {
+        const auto begin = sorted.begin() + getChunkBegin(itemCount, chunkCount, chunk);
+        const auto end = sorted.begin() + getChunkBegin(itemCount, chunkCount, chunk + 1);
+        futures.push_back(QtConcurrent::run([&canceled, &compare, begin, end]() {
+            if (!canceled) {
+                std::sort(begin, end, compare);
+            }
+        }));
+    }
+
+    for (QFuture<void>& future : futures) {
+        future.waitForFinished();
+        reportProgress();
+    }
+
+    for (int width = 1; width < chunkCount && !canceled; width *= 2) {
+        futures.clear();
+
+        for (int chunk = 0; chunk < chunkCount; chunk += 2 * width) {
+            const size_t begin = getChunkBegin(itemCount, chunkCount, chunk);
+            const size_t middle = getChunkBegin(itemCount, chunkCount, std::min(chunk + width, chunkCount));
+            const size_t end = getChunkBegin(itemCount, chunkCount, std::min(chunk + 2 * width, chunkCount));
+            futures.push_back(QtConcurrent::run([&sorted, &buffer, &compare, begin, middle, end]() {
+                std::merge(sorted.begin() + begin, sorted.begin() + middle,
+                           sorted.begin() + middle, sorted.begin() + end,
+                           buffer.begin() + begin, compare);
+            }));
+        }
+
+        for (QFuture<void>& future : futures) {
+            future.waitForFinished();
+            reportProgress();
+        }
+
+        sorted.swap(buffer);
+    }
+
+    if (canceled) {
+        return false;
+    }
+
+    items.swap(sorted);
+    return true;
+}
+
+} // namespace parallel
+
+#endif // PARALLELSORT_H
@@ -0,0 +1,275 @@
+#include "resultscache.h"
+#include "binaryio.h"
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QHash>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <algorithm>
+#include <string.h>
+#include <vector>
+
+namespace {
+    const char magic[8] = { 'A', 'N', 'N', 'O', 'R', 'E', 'S', '1' };
+    const quint32 currentVersion = 1;
+
+    // magic, version, source size, source modification time, color count, contour count, point count
+    const qint64 headerSize = 8 + 4 + 8 + 8 + 4 + 4 + 8;
+
+    struct Header {
+        qint64 sourceSize = 0;
+        qint64 sourceLastModified = 0;
+        quint32 colorCount = 0;
+        quint32 contourCount = 0;
+        quint64 pointCount = 0;
+    };
+
+    quint32 toBits(float value)
+    {
+        quint32 bits;
+        memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    float fromBits(quint32 bits)
+    {
+        float value;
+        memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    bool readCache(const QString& cacheFilename, const QFileInfo& source, InferenceResults& results)
+    {
+        QFile file(cacheFilename);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+
+        const qint64 size = file.size();
+        const uchar* data = file.map(0, size);
+        if (data == nullptr || size < headerSize || memcmp(data, magic, sizeof(magic)) != 0) {
+            return false;
+        }
+
+        BinaryReader reader(data, size, sizeof(magic));
+        quint32 version = 0;
+        Header header;
+
+        if (!reader.read(version) || version != currentVersion
+                || !reader.read(header.sourceSize)
+                || !reader.read(header.sourceLastModified)
+                || !reader.read(header.colorCount)
+                || !reader.read(header.contourCount)
+                || !reader.read(header.pointCount)) {
+            return false;
+        }
+
+        if (header.sourceSize != source.size()
+                || header.sourceLastModified != source.lastModified().toMSecsSinceEpoch()) {
+            return false; // the JSON file has changed since
+        }
+
+        if (header.pointCount > static_cast<quint64>(size) || header.contourCount > size) {
+            return false; // also keeps the size computed below from overflowing
+        }
+
+        const quint64 expectedSize = static_cast<quint64>(headerSize)
+                + 4ull * header.colorCount
+                + 4ull * header.contourCount
+                + 8ull * (header.contourCount + 1ull)
+                + 8ull * header.pointCount;
+
+        if (expectedSize != static_cast<quint64>(size)) {
+            return false;
+        }
+
+        std::vector<QPen> pens(header.colorCount);
+        for (QPen& pen : pens) {
+            quint32 rgba = 0;
+            reader.read(rgba);
+            pen = QPen(QColor::fromRgba(rgba));
+        }
+
+        const qint64 colorIndexOffset = headerSize + 4ll * header.colorCount;
+        const qint64 contourOffsetOffset = colorIndexOffset + 4ll * header.contourCount;
+        const qint64 pointOffset = contourOffsetOffset + 8ll * (header.contourCount + 1ll);
+
+        BinaryReader colorIndices(data, size, colorIndexOffset);
+        BinaryReader contourOffsets(data, size, contourOffsetOffset);
+
+        quint64 begin = 0;
+        contourOffsets.read(begin);
+
+        results.results.resize(header.contourCount);
+
+        for (QResultImageView::Result& result : results.results) {
+            quint32 colorIndex = 0;
+            quint64 end = 0;
+            colorIndices.read(colorIndex);
+            contourOffsets.read(end);
+
+            if (colorIndex >= header.colorCount || end < begin || end > header.pointCount) {
+                results.results.clear();
+                return false;
+            }
+
+            result.pen = pens[colorIndex];
+            result.contour.resize(static_cast<size_t>(end - begin));
+
+            BinaryReader points(data, size, pointOffset + 8ll * static_cast<qint64>(begin));
+            for (QPointF& point : result.contour) {
+                quint32 x = 0;
+                quint32 y = 0;
+                points.read(x);
+                points.read(y);
+                point = QPointF(fromBits(x), fromBits(y));
+            }
+
+            begin = end;
+        }
+
+        return true;
+    }
+
+    bool writeCache(const QString& cacheFilename, const QFileInfo& source, const InferenceResults& results)
+    {
+        if (!QDir().mkpath(QFileInfo(cacheFilename).absolutePath())) {
+            return false;
+        }
+
+        QSaveFile file(cacheFilename);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+
+        std::vector<QRgb> colors;
+        QHash<QRgb, quint32> colorIndices;
+        quint64 pointCount = 0;
+
+        for (const QResultImageView::Result& result : results.results) {
+            const QRgb rgba = result.pen.color().rgba();
+            if (!colorIndices.contains(rgba)) {
+                colorIndices.insert(rgba, static_cast<quint32>(colors.size()));
+                colors.push_back(rgba);
+            }
+            pointCount += result.contour.size();
+        }
+
+        BinaryWriter writer(file);
+
+        for (char c : magic) {
+            writer.write<qint8>(c);
+        }
+        writer.write<quint32>(currentVersion);
+        writer.write<qint64>(source.size());
+        writer.write<qint64>(source.lastModified().toMSecsSinceEpoch());
+        writer.write<quint32>(static_cast<quint32>(colors.size()));
+        writer.write<quint32>(static_cast<quint32>(results.results.size()));
+        writer.write<quint64>(pointCount);
+
+        for (QRgb rgba : colors) {
+            writer.write<quint32>(rgba);
+        }
+        for (const QResultImageView::Result& result : results.results) {
+            writer.write<quint32>(colorIndices.value(result.pen.color().rgba()));
+        }
+
+        quint64 offset = 0;
+        writer.write<quint64>(offset);
+        for (const QResultImageView::Result& result : results.results) {
+            offset += result.contour.size();
+            writer.write<quint64>(offset);
+        }
+
+        for (const QResultImageView::Result& result : results.results) {
+            QByteArray points(static_cast<int>(result.contour.size() * 8), Qt::Uninitialized);
+            char* target = points.data();
+            for (const QPointF& point : result.contour) {
+                qToLittleEndian<quint32>(toBits(static_cast<float>(point.x())), target);
+                qToLittleEndian<quint32>(toBits(static_cast<float>(point.y())), target + 4);
+                target += 8;
+            }
+            if (!writer.writeBytes(points)) {
+                file.cancelWriting();
+                return false;
+            }
+        }
+
+        if (!writer.flush()) {
+            file.cancelWriting();
+            return false;
+        }
+
+        return file.commit();
+    }
+}
+
+QString ResultsCache::getCacheFilename(const QString& jsonFilename)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty() || jsonFilename.isEmpty()) {
+        return QString();
+    }
+
+    const QString canonicalFilename = QDir::cleanPath(QFileInfo(jsonFilename).absoluteFilePath());
+    const QByteArray key = QCryptographicHash::hash(canonicalFilename.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    return cacheDirectory + "/results/" + QString::fromLatin1(key) + ".res";
+}
+
+void ResultsCache::prune(qint64 maxBytes)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty()) {
+        return;
+    }
+
+    QFileInfoList files = QDir(cacheDirectory + "/results").entryInfoList(QStringList("*.res"), QDir::Files);
+
+    // A file is read through a mapping, which may not update the access time,
+    // so the time it was written counts too
+    const auto getLastUsed = [](const QFileInfo& file) {
+        return std::max(file.lastRead(), file.lastModified());
+    };
+
+    std::sort(files.begin(), files.end(), [&getLastUsed](const QFileInfo& a, const QFileInfo& b) {
+        return getLastUsed(a) > getLastUsed(b);
+    });
+
+    qint64 bytes = 0;
+    for (const QFileInfo& file : files) {
+        bytes += file.size();
+        if (bytes > maxBytes) {
+            QFile::remove(file.absoluteFilePath());
+        }
+    }
+}
+
+InferenceResults ResultsCache::read(const QString& jsonFilename, const QString& cacheFilename)
+{
+    if (cacheFilename.isEmpty()) {
+        return readResultsJSON(jsonFilename);
+    }
+
+    const QFileInfo source(jsonFilename);
+    if (!source.exists()) {
+        return InferenceResults();
+    }
+
+    InferenceResults results;
+    if (readCache(cacheFilename, source, results)) {
+        return results;
+    }
+
+    results = readResultsJSON(jsonFilename);
+
+    if (results.error.isEmpty()) {
+        writeCache(cacheFilename, source, results); // if this fails, the JSON file just gets parsed again next time
+    }
+
+    return results;
+}
@@ -0,0 +1,37 @@
+#ifndef RESULTSCACHE_H
+#define RESULTSCACHE_H
+
+#include "inferenceresults.h"
+
+#include <QString>
+
+// A binary copy of the results parsed from a JSON file, cached on disk, so that
+// next time the results can be taken from the mapped file without any parsing.
+// The file holds a table of the distinct colors, the color and the offset of
+// each contour, and then all the points as one flat array of float32 pairs.
+// The cache is keyed by the path of the JSON file, and it is valid only for
+// the size and modification time recorded in it; otherwise, the JSON file is
+// parsed again and the cache rewritten.
+//
+// As the points are stored in single precision, this is meant for results that
+// are only shown, not for annotations that get edited and saved back.
+//
+// The cache directory is bounded by size: see prune.
+class ResultsCache
+{
+public:
+    // Where the results of the JSON file would be cached on disk
+    static QString getCacheFilename(const QString& jsonFilename);
+
+    // Returns the cached results, if they match the current version of the JSON
+    // file; otherwise, parses the JSON file and updates the cache. Without a
+    // cache filename, just parses the JSON file. Safe to call from any thread.
+    static InferenceResults read(const QString& jsonFilename, const QString& cacheFilename);
+
+    // Removes the least recently used cache files, until the rest take at most
+    // the given number of bytes. This also gets rid of the files cached for
+    // JSON files that have since been deleted. Safe to call from any thread.
+    static void prune(qint64 maxBytes);
+};
+
+#endif // RESULTSCACHE_H
@@ -0,0 +1,273 @@
+#include "sparsemask.h"
+
+#include <QHash>
+#include <algorithm>
+#include <string.h>
+
+namespace {
+    int getTileCount(int length)
+    {
+        return (length + SparseMask::tileSize - 1) / SparseMask::tileSize;
+    }
+
+    bool isZero(const quint32* pixels, int count)
+    {
+        return std::all_of(pixels, pixels + count, [](quint32 value) { return value == 0; });
+    }
+
+    bool isTransparentArea(const QImage& image, const QRect& rect)
+    {
+        for (int y = rect.top(); y <= rect.bottom(); ++y) {
+            const quint32* row = reinterpret_cast<const quint32*>(image.constScanLine(y));
+            if (!isZero(row + rect.left(), rect.width())) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+SparseMask::SparseMask(const QSize& size)
+    : maskSize(size)
+    , tiles(static_cast<size_t>(getTileCount(size.width())) * getTileCount(size.height()))
+{}
+
+SparseMask SparseMask::fromImage(const QImage& image)
+{
+    if (image.isNull()) {
+        return SparseMask();
+    }
+
+    const QImage argb = image.format() == QImage::Format_ARGB32
+            ? image
+            : image.convertToFormat(QImage::Format_ARGB32);
+
+    SparseMask mask(argb.size());
+
+    for (int row = 0, rows = mask.rows(); row < rows; ++row) {
+        for (int column = 0, columns = mask.columns(); column < columns; ++column) {
+            const QRect rect = mask.tileRect(column, row);
+            if (!isTransparentArea(argb, rect)) {
+                mask.tiles[row * columns + column] = argb.copy(rect);
+            }
+        }
+    }
+
+    return mask;
+}
+
+QImage SparseMask::toImage() const
+{
+    if (isNull()) {
+        return QImage();
+    }
+
+    QImage image(maskSize, QImage::Format_ARGB32);
+    if (image.isNull()) {
+        return QImage(); // out of memory
+    }
+    image.fill(Qt::transparent);
+
+    for (int row = 0, rows = this->rows(); row < rows; ++row) {
+        for (int column = 0, columns = this->columns(); column < columns; ++column) {
+            const QImage& tile = tiles[row * columns + column];
+            if (tile.isNull()) {
+                continue;
+            }
+            const QRect rect = tileRect(column, row);
+            const int rowBytes = rect.width() * 4;
+            for (int y = 0; y < rect.height(); ++y) {
+                memcpy(image.scanLine(rect.y() + y) + rect.x() * 4, tile.constScanLine(y), rowBytes);
+            }
+        }
+    }
+
+    return image;
+}
+
+QImage SparseMask::toImage(const QRect& rect) const
+{
+    Q_ASSERT(this->rect().contains(rect) || rect.isEmpty());
+
+    if (rect.isEmpty()) {
+        return QImage();
+    }
+
+    QImage image(rect.size(), QImage::Format_ARGB32);
+    if (image.isNull()) {
+        return QImage(); // out of memory
+    }
+    image.fill(Qt::transparent);
+
+    const int columns = this->columns();
+
+    for (int row = rect.top() / tileSize, lastRow = rect.bottom() / tileSize; row <= lastRow; ++row) {
+        for (int column = rect.left() / tileSize, lastColumn = rect.right() / tileSize; column <= lastColumn; ++column) {
+            const QImage& tile = tiles[row * columns + column];
+            if (tile.isNull()) {
+                continue;
+            }
+            const QRect tileRect = this->tileRect(column, row);
+            const QRect part = tileRect & rect;
+            const int rowBytes = part.width() * 4;
+            for (int y = part.top(); y <= part.bottom(); ++y) {
+                memcpy(image.scanLine(y - rect.y()) + (part.x() - rect.x()) * 4,
+                       tile.constScanLine(y - tileRect.y()) + (part.x() - tileRect.x()) * 4,
+                       rowBytes);
+            }
+        }
+    }
+
+    return image;
+}
+
+SparseMask SparseMask::resized(const QSize& size) const
+{
+    SparseMask mask(size);
+
+    for (int row = 0, rows = mask.rows(); row < rows; ++row) {
+        for (int column = 0, columns = mask.columns(); column < columns; ++column) {
+            const QRect rect = mask.tileRect(column, row);
+            const QRect part = rect & this->rect();
+            if (part.isEmpty()) {
+                continue;
+            }
+            if (part == rect && rect == tileRect(column, row)) {
+                mask.tiles[row * columns + column] = tile(column, row); // shared, and null if transparent
+                continue;
+            }
+            const QImage source = toImage(part);
+            if (isTransparentArea(source, source.rect())) {
+                continue;
+            }
+            QImage tile(rect.size(), QImage::Format_ARGB32);
+            tile.fill(Qt::transparent);
+            for (int y = 0; y < source.height(); ++y) {
+                memcpy(tile.scanLine(y), source.constScanLine(y), source.width() * 4);
+            }
+            mask.tiles[row * columns + column] = tile;
+        }
+    }
+
+    return mask;
+}
+
+bool SparseMask::isNull() const
+{
+    return maskSize.isEmpty();
+}
+
+QSize SparseMask::size() const
+{
+    return maskSize;
+}
+
+QRect SparseMask::rect() const
+{
+    return QRect(QPoint(0, 0), maskSize);
+}
+
+int SparseMask::width() const
+{
+    return maskSize.width();
+}
+
+int SparseMask::height() const
+{
+    return maskSize.height();
+}
+
+int SparseMask::columns() const
+{
+    return getTileCount(maskSize.width());
+}
+
+int SparseMask::rows() const
+{
+    return getTileCount(maskSize.height());
+}
+
+QRect SparseMask::tileRect(int column, int row) const
+{
+    return QRect(column * tileSize, row * tileSize, tileSize, tileSize) & rect();
+}
+
+bool SparseMask::isTransparent() const
+{
+    return std::all_of(tiles.begin(), tiles.end(), [](const QImage& tile) {
+        return tile.isNull() || isTransparentArea(tile, tile.rect());
+    });
+}
+
+size_t SparseMask::bytes() const
+{
+    size_t bytes = tiles.size() * sizeof(QImage);
+    for (const QImage& tile : tiles) {
+        bytes += static_cast<size_t>(tile.sizeInBytes());
+    }
+    return bytes;
+}
+
+const QImage& SparseMask::tile(int column, int row) const
+{
+    return tiles[row * columns() + column];
+}
+
+void SparseMask::setTile(int column, int row, const QImage& tile)
+{
+    Q_ASSERT(tile.isNull() || (tile.size() == tileRect(column, row).size() && tile.format() == QImage::Format_ARGB32));
+    tiles[row * columns() + column] = tile;
+}
+
+const quint32* SparseMask::constScanLine(int column, int y) const
+{
+    const QImage& tile = tiles[(y / tileSize) * columns() + column];
+    return tile.isNull() ? nullptr : reinterpret_cast<const quint32*>(tile.constScanLine(y % tileSize));
+}
+
+quint32* SparseMask::scanLine(int column, int y)
+{
+    const int row = y / tileSize;
+    QImage& tile = tiles[row * columns() + column];
+    if (tile.isNull()) {
+        tile = QImage(tileRect(column, row).size(), QImage::Format_ARGB32);
+        tile.fill(Qt::transparent);
+    }
+    return reinterpret_cast<quint32*>(tile.scanLine(y % tileSize)); // copies the tile, if shared
+}
+
+void SparseMask::squeeze(const QRect& rect)
+{
+    const QRect area = rect & this->rect();
+    if (area.isEmpty()) {
+        return;
+    }
+
+    const int columns = this->columns();
+
+    for (int row = area.top() / tileSize, lastRow = area.bottom() / tileSize; row <= lastRow; ++row) {
+        for (int column = area.left() / tileSize, lastColumn = area.right() / tileSize; column <= lastColumn; ++column) {
+            QImage& tile = tiles[row * columns + column];
+            if (!tile.isNull() && isTransparentArea(tile, tile.rect())) {
+                tile = QImage();
+            }
+        }
+    }
+}
+
+uint getMaskFingerprint(const SparseMask& mask)
+{
+    if (mask.isNull()) {
+        return 0;
+    }
+    uint hash = qHash(mask.width()) ^ qHash(mask.height());
+    for (int row = 0, rows = mask.rows(); row < rows; ++row) {
+        for (int column = 0, columns = mask.columns(); column < columns; ++column) {
+            const QImage& tile = mask.tile(column, row);
+            if (!tile.isNull()) { // a tile that is there is never fully transparent
+                hash = qHashBits(tile.constBits(), static_cast<size_t>(tile.sizeInBytes()), hash ^ qHash(row * columns + column));
+            }
+        }
+    }
+    return hash;
+}
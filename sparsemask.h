@@ -0,0 +1,71 @@
+#ifndef SPARSEMASK_H
+#define SPARSEMASK_H
+
+#include <QImage>
+#include <QRect>
+#include <QSize>
+#include <vector>
+
+// A mask kept as tiles of 512 x 512 pixels, where a fully transparent tile
+// takes no memory at all. Most of a typical mask is not annotated, so this is
+// a fraction of the size of the full image. The tiles are implicitly shared:
+// copying the mask (say, to save it in the background) is cheap, and a tile
+// is copied only once it is modified.
+//
+// The pixels are in Format_ARGB32, and transparent means all zero bits.
+class SparseMask
+{
+public:
+    static const int tileSize = 512;
+
+    SparseMask() = default;
+    explicit SparseMask(const QSize& size); // fully transparent
+
+    // The image is converted to Format_ARGB32, if needed
+    static SparseMask fromImage(const QImage& image);
+    QImage toImage() const;
+
+    // Just the part of the mask within the rectangle (which must be inside
+    // the mask), touching only the tiles there
+    QImage toImage(const QRect& rect) const;
+
+    // Cropped, or extended with transparent pixels; the tiles that stay the
+    // same are shared
+    SparseMask resized(const QSize& size) const;
+
+    bool isNull() const;
+    QSize size() const;
+    QRect rect() const;
+    int width() const;
+    int height() const;
+
+    int columns() const;
+    int rows() const;
+    QRect tileRect(int column, int row) const; // the edge tiles are smaller
+
+    bool isTransparent() const;
+    size_t bytes() const; // of the tiles actually there
+
+    // A null tile is fully transparent; any other tile is of tileRect size
+    const QImage& tile(int column, int row) const;
+    void setTile(int column, int row, const QImage& tile);
+
+    // The part of row y that is within the given column of tiles; null, if
+    // the tile is transparent
+    const quint32* constScanLine(int column, int y) const;
+
+    // Same, but makes the tile if it is not there yet
+    quint32* scanLine(int column, int y);
+
+    // Drops the tiles within the rectangle that have become fully transparent
+    void squeeze(const QRect& rect);
+
+private:
+    QSize maskSize;
+    std::vector<QImage> tiles; // row by row
+};
+
+// For telling whether two masks are the same, without keeping both
+uint getMaskFingerprint(const SparseMask& mask);
+
+#endif // SPARSEMASK_H
@@ -0,0 +1,136 @@
+#include "thingannotationedit.h"
+
+#include <QHash>
+#include <algorithm>
+
+namespace {
+    bool isSame(const QResultImageView::Result& lhs, const QResultImageView::Result& rhs)
+    {
+        return lhs.contour.size() == rhs.contour.size()
+                && lhs.pen == rhs.pen
+                && lhs.contour == rhs.contour;
+    }
+
+    void writeResults(QDataStream& stream, const ThingAnnotationEdit::Results& results)
+    {
+        stream << static_cast<quint32>(results.size());
+        for (const QResultImageView::Result& result : results) {
+            stream << result.pen << static_cast<quint32>(result.contour.size());
+            for (const QPointF& point : result.contour) {
+                stream << point;
+            }
+        }
+    }
+
+    void readResults(QDataStream& stream, ThingAnnotationEdit::Results& results)
+    {
+        quint32 count = 0;
+        stream >> count;
+        results.clear();
+        for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+            QResultImageView::Result result;
+            quint32 pointCount = 0;
+            stream >> result.pen >> pointCount;
+            for (quint32 j = 0; j < pointCount && stream.status() == QDataStream::Ok; ++j) {
+                QPointF point;
+                stream >> point;
+                result.contour.push_back(point);
+            }
+            results.push_back(result);
+        }
+    }
+
+    size_t getBytes(const ThingAnnotationEdit::Results& results)
+    {
+        size_t bytes = 0;
+        for (const QResultImageView::Result& result : results) {
+            bytes += sizeof(result) + result.contour.size() * sizeof(QPointF);
+        }
+        return bytes;
+    }
+}
+
+ThingAnnotationEdit ThingAnnotationEdit::compute(const Results& before, const Results& after)
+{
+    const size_t maxCommonCount = std::min(before.size(), after.size());
+
+    size_t prefix = 0;
+    while (prefix < maxCommonCount && isSame(before[prefix], after[prefix])) {
+        ++prefix;
+    }
+
+    size_t suffix = 0;
+    while (suffix < maxCommonCount - prefix && isSame(before[before.size() - 1 - suffix], after[after.size() - 1 - suffix])) {
+        ++suffix;
+    }
+
+    ThingAnnotationEdit edit;
+    edit.position = prefix;
+    edit.removed.assign(before.begin() + prefix, before.end() - suffix);
+    edit.inserted.assign(after.begin() + prefix, after.end() - suffix);
+    return edit;
+}
+
+bool ThingAnnotationEdit::isEmpty() const
+{
+    return removed.empty() && inserted.empty();
+}
+
+size_t ThingAnnotationEdit::bytes() const
+{
+    return sizeof(ThingAnnotationEdit) + getBytes(removed) + getBytes(inserted);
+}
+
+void ThingAnnotationEdit::undo(Results& results) const
+{
+    replace(results, position, inserted, removed);
+}
+
+void ThingAnnotationEdit::redo(Results& results) const
+{
+    replace(results, position, removed, inserted);
+}
+
+void ThingAnnotationEdit::replace(Results& results, size_t position, const Results& oldResults, const Results& newResults)
+{
+    Q_ASSERT(position + oldResults.size() <= results.size());
+
+    const auto begin = results.begin() + position;
+    const size_t commonCount = std::min(oldResults.size(), newResults.size());
+
+    std::copy(newResults.begin(), newResults.begin() + commonCount, begin);
+
+    if (oldResults.size() > commonCount) {
+        results.erase(begin + commonCount, begin + oldResults.size());
+    }
+    else {
+        results.insert(begin + commonCount, newResults.begin() + commonCount, newResults.end());
+    }
+}
+
+QDataStream& operator<<(QDataStream& stream, const ThingAnnotationEdit& edit)
+{
+    stream << static_cast<quint64>(edit.position);
+    writeResults(stream, edit.inserted);
+    writeResults(stream, edit.removed);
+    return stream;
+}
+
+QDataStream& operator>>(QDataStream& stream, ThingAnnotationEdit& edit)
+{
+    quint64 position = 0;
+    stream >> position;
+    edit.position = static_cast<size_t>(position);
+    readResults(stream, edit.inserted);
+    readResults(stream, edit.removed);
+    return stream;
+}
+
+uint getThingAnnotationsFingerprint(const ThingAnnotationEdit::Results& results)
+{
+    uint hash = qHash(static_cast<quint64>(results.size()));
+    for (const QResultImageView::Result& result : results) {
+        hash = qHashBits(result.contour.data(), result.contour.size() * sizeof(QPointF), hash ^ result.pen.color().rgba());
+    }
+    return hash;
+}
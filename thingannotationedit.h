@@ -0,0 +1,43 @@
+#ifndef THINGANNOTATIONEDIT_H
+#define THINGANNOTATIONEDIT_H
+
+#include "QResultImageView/QResultImageView.h"
+#include "undostack.h"
+
+#include <vector>
+
+// One edit of the thing annotations, for undo and redo: the annotations at one
+// position replaced with others. Adding, removing and erasing (which may trim
+// or split several annotations) are all such replacements. Only the annotations
+// that changed are kept, and the unchanged ones are never copied, so the cost
+// of an edit does not depend on how many annotations there are in total.
+class ThingAnnotationEdit
+{
+public:
+    typedef std::vector<QResultImageView::Result> Results;
+
+    static ThingAnnotationEdit compute(const Results& before, const Results& after);
+
+    bool isEmpty() const;
+    size_t bytes() const;
+
+    void undo(Results& results) const;
+    void redo(Results& results) const;
+
+    friend QDataStream& operator<<(QDataStream& stream, const ThingAnnotationEdit& edit);
+    friend QDataStream& operator>>(QDataStream& stream, ThingAnnotationEdit& edit);
+
+private:
+    static void replace(Results& results, size_t position, const Results& oldResults, const Results& newResults);
+
+    size_t position = 0;
+    Results removed;
+    Results inserted;
+};
+
+typedef UndoStack<ThingAnnotationEdit> ThingAnnotationEditStack;
+
+// For telling whether two sets of annotations are the same, without keeping both
+uint getThingAnnotationsFingerprint(const ThingAnnotationEdit::Results& results);
+
+#endif // THINGANNOTATIONEDIT_H
@@ -0,0 +1,447 @@
+#include "thingannotationsaver.h"
+#include "imageloader.h"
+#include "inferenceresults.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QRunnable>
+#include <QSaveFile>
+#include <QStandardPaths>
+#include <QTimer>
+#include <algorithm>
+
+namespace {
+    const quint32 journalMagic = 0x414e4a4c; // "ANJL"
+    const quint32 journalVersion = 1;
+    const QDataStream::Version streamVersion = QDataStream::Qt_5_12;
+
+    // How long the edits need to pause before the file is rewritten
+    const int idleMilliseconds = 2000;
+
+    struct JournalEntry {
+        bool isUndo = false;
+        uint fingerprint = 0; // after the edit
+        ThingAnnotationEdit edit;
+    };
+}
+
+class ThingAnnotationSaver::Writer : public QRunnable
+{
+public:
+    explicit Writer(ThingAnnotationSaver* saver)
+        : saver(saver)
+    {}
+
+    void run() override {
+        saver->work();
+    }
+
+private:
+    ThingAnnotationSaver* const saver;
+};
+
+ThingAnnotationSaver::ThingAnnotationSaver(ImageLoader* imageLoader, QObject* parent)
+    : QObject(parent)
+    , imageLoader(imageLoader)
+{
+    threadPool.setMaxThreadCount(1);
+
+    idleTimer = new QTimer(this);
+    idleTimer->setSingleShot(true);
+    idleTimer->setInterval(idleMilliseconds);
+    connect(idleTimer, SIGNAL(timeout()), this, SLOT(onIdle()));
+}
+
+ThingAnnotationSaver::~ThingAnnotationSaver()
+{
+    flush();
+    threadPool.waitForDone();
+}
+
+void ThingAnnotationSaver::record(const QString& imageFilename, const QString& annotationsFilename, const ThingAnnotationEdit& edit, bool isUndo, const Results& results, const QHash<QRgb, QString>& classNames)
+{
+    auto i = idle.find(annotationsFilename);
+    if (i == idle.end()) {
+        Snapshot snapshot;
+        snapshot.imageFilename = imageFilename;
+        snapshot.results = results;
+        i = idle.insert(annotationsFilename, snapshot);
+    }
+    else if (isUndo) {
+        edit.undo(i.value().results); // only what changed, rather than copying everything again
+    }
+    else {
+        edit.redo(i.value().results);
+    }
+
+    Snapshot& snapshot = i.value();
+    snapshot.classNames = classNames;
+
+    Q_ASSERT(snapshot.results.size() == results.size());
+
+    Record record;
+    {
+        QDataStream stream(&record.data, QIODevice::WriteOnly);
+        stream.setVersion(streamVersion);
+        stream << isUndo << getThingAnnotationsFingerprint(snapshot.results) << edit;
+    }
+
+    const QString journalFilename = getJournalFilename(annotationsFilename);
+
+    QMutexLocker locker(&mutex);
+
+    record.sequence = nextSequence++;
+    snapshot.sequence = record.sequence;
+
+    std::vector<Record>& records = journals[annotationsFilename];
+    records.push_back(record);
+
+    bool ok = false;
+    if (compacting.contains(annotationsFilename)) {
+        ok = true; // appended once the journal has been rewritten
+    }
+    else if (records.size() == 1) {
+        // The journal starts from what is in the file now, that is, from before this edit
+        Results before = snapshot.results;
+        if (isUndo) {
+            edit.redo(before);
+        }
+        else {
+            edit.undo(before);
+        }
+        ok = writeJournal(journalFilename, getThingAnnotationsFingerprint(before), records);
+    }
+    else {
+        ok = appendToJournal(journalFilename, record);
+    }
+
+    locker.unlock();
+
+    if (!ok && !journalFailing) {
+        emit failed(tr("Couldn't write the journal \"%1\"; the latest changes are saved only when the annotations are").arg(journalFilename));
+    }
+    journalFailing = !ok;
+
+    idleTimer->start();
+}
+
+bool ThingAnnotationSaver::recover(const QString& imageFilename, const QString& annotationsFilename, Results& results, const QHash<QRgb, QString>& classNames)
+{
+    const QString journalFilename = getJournalFilename(annotationsFilename);
+
+    QFile file(journalFilename);
+    if (journalFilename.isEmpty() || !file.open(QIODevice::ReadOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(streamVersion);
+
+    quint32 magic = 0;
+    quint32 version = 0;
+    uint baseFingerprint = 0;
+    stream >> magic >> version >> baseFingerprint;
+
+    if (stream.status() != QDataStream::Ok || magic != journalMagic || version != journalVersion) {
+        return false;
+    }
+
+    std::vector<JournalEntry> entries;
+
+    while (!stream.atEnd()) {
+        QByteArray data;
+        stream >> data;
+        if (stream.status() != QDataStream::Ok) {
+            break; // the last record was cut short
+        }
+
+        QDataStream recordStream(data);
+        recordStream.setVersion(streamVersion);
+
+        JournalEntry entry;
+        recordStream >> entry.isUndo >> entry.fingerprint >> entry.edit;
+        if (recordStream.status() != QDataStream::Ok) {
+            break;
+        }
+
+        entries.push_back(entry);
+    }
+
+    file.close();
+
+    // Find where the file is at: either before all the edits, or after some of them
+    const uint fingerprint = getThingAnnotationsFingerprint(results);
+
+    size_t start = entries.size();
+    if (fingerprint == baseFingerprint) {
+        start = 0;
+    }
+    else {
+        for (size_t i = entries.size(); i > 0; --i) {
+            if (entries[i - 1].fingerprint == fingerprint) {
+                start = i;
+                break;
+            }
+        }
+    }
+
+    if (start == entries.size()) {
+        // Either nothing to replay, or the file has been changed elsewhere meanwhile
+        QFile::remove(journalFilename);
+        return false;
+    }
+
+    const Results original = results;
+
+    for (size_t i = start, end = entries.size(); i < end; ++i) {
+        if (entries[i].isUndo) {
+            entries[i].edit.undo(results);
+        }
+        else {
+            entries[i].edit.redo(results);
+        }
+    }
+
+    if (getThingAnnotationsFingerprint(results) != entries.back().fingerprint) {
+        results = original;
+        return false;
+    }
+
+    idle.remove(annotationsFilename);
+
+    Snapshot snapshot;
+    snapshot.imageFilename = imageFilename;
+    snapshot.results = results;
+    snapshot.classNames = classNames;
+
+    {
+        // What this session had in the journal is now part of the recovered annotations
+        QMutexLocker locker(&mutex);
+        journals.remove(annotationsFilename);
+    }
+
+    enqueue(annotationsFilename, snapshot);
+    return true;
+}
+
+void ThingAnnotationSaver::compact(const QString& annotationsFilename)
+{
+    const auto i = idle.find(annotationsFilename);
+    if (i == idle.end()) {
+        return;
+    }
+
+    Snapshot snapshot = i.value();
+    idle.erase(i);
+
+    enqueue(annotationsFilename, snapshot);
+}
+
+void ThingAnnotationSaver::waitFor(const QString& annotationsFilename)
+{
+    compact(annotationsFilename);
+
+    QMutexLocker locker(&mutex);
+    while (pending.contains(annotationsFilename) || writing.contains(annotationsFilename)) {
+        written.wait(&mutex);
+    }
+}
+
+void ThingAnnotationSaver::flush()
+{
+    onIdle();
+
+    QMutexLocker locker(&mutex);
+    while (!pending.isEmpty() || !writing.isEmpty()) {
+        written.wait(&mutex);
+    }
+}
+
+void ThingAnnotationSaver::discard(const QString& annotationsFilename)
+{
+    idle.remove(annotationsFilename);
+
+    QMutexLocker locker(&mutex);
+
+    pending.remove(annotationsFilename);
+    while (writing.contains(annotationsFilename)) {
+        written.wait(&mutex); // or it could write the file (and the journal) again
+    }
+
+    journals.remove(annotationsFilename);
+    QFile::remove(getJournalFilename(annotationsFilename));
+}
+
+void ThingAnnotationSaver::onIdle()
+{
+    idleTimer->stop();
+
+    for (auto i = idle.begin(); i != idle.end(); ++i) {
+        enqueue(i.key(), i.value());
+    }
+    idle.clear();
+}
+
+void ThingAnnotationSaver::enqueue(const QString& annotationsFilename, Snapshot snapshot)
+{
+    QMutexLocker locker(&mutex);
+
+    pending[annotationsFilename] = snapshot; // any earlier version not started yet is included
+
+    if (!writerRunning) {
+        writerRunning = true;
+        threadPool.start(new Writer(this));
+    }
+}
+
+void ThingAnnotationSaver::work()
+{
+    while (true) {
+        QString annotationsFilename;
+        Snapshot snapshot;
+
+        {
+            QMutexLocker locker(&mutex);
+            if (pending.isEmpty()) {
+                writerRunning = false;
+                return;
+            }
+            const auto i = pending.begin();
+            annotationsFilename = i.key();
+            snapshot = i.value();
+            pending.erase(i);
+            writing.insert(annotationsFilename);
+        }
+
+        QString error;
+        const bool ok = write(annotationsFilename, snapshot, error);
+        if (!ok) {
+            emit failed(error);
+        }
+
+        // Anything loaded while the file was being written may be outdated
+        imageLoader->invalidate(snapshot.imageFilename);
+
+        if (ok) {
+            compactJournal(annotationsFilename, snapshot);
+        }
+
+        QMutexLocker locker(&mutex);
+        writing.remove(annotationsFilename);
+        written.wakeAll();
+    }
+}
+
+void ThingAnnotationSaver::compactJournal(const QString& annotationsFilename, const Snapshot& snapshot)
+{
+    const uint fingerprint = getThingAnnotationsFingerprint(snapshot.results);
+    const QString journalFilename = getJournalFilename(annotationsFilename);
+
+    std::vector<Record> remaining;
+    quint64 lastSequence = 0;
+
+    {
+        // Drop the edits that are now in the file
+        QMutexLocker locker(&mutex);
+
+        std::vector<Record>& records = journals[annotationsFilename];
+        records.erase(std::remove_if(records.begin(), records.end(), [&snapshot](const Record& record) {
+            return record.sequence <= snapshot.sequence;
+        }), records.end());
+
+        if (records.empty()) {
+            journals.remove(annotationsFilename);
+            QFile::remove(journalFilename);
+            return;
+        }
+
+        remaining = records;
+        lastSequence = remaining.back().sequence;
+        compacting.insert(annotationsFilename);
+    }
+
+    // Rewritten without holding the lock, so that recording the edits does
+    // not wait for it. If this fails, the old journal is still valid, as it
+    // just has the edits that are in the file too.
+    writeJournal(journalFilename, fingerprint, remaining);
+
+    QMutexLocker locker(&mutex);
+
+    compacting.remove(annotationsFilename);
+
+    // The edits recorded meanwhile are not in what was just written
+    for (const Record& record : journals.value(annotationsFilename)) {
+        if (record.sequence > lastSequence) {
+            appendToJournal(journalFilename, record); // if this fails, the next edit reports it
+        }
+    }
+}
+
+bool ThingAnnotationSaver::write(const QString& annotationsFilename, const Snapshot& snapshot, QString& error)
+{
+    QSaveFile file(annotationsFilename);
+    const bool ok = file.open(QIODevice::WriteOnly)
+            && file.write(toResultsJSON(snapshot.results, snapshot.classNames, getResultsFormat(annotationsFilename))) >= 0
+            && file.commit();
+
+    if (!ok) {
+        error = tr("Couldn't save thing annotations \"%1\": %2").arg(annotationsFilename, file.errorString());
+    }
+    return ok;
+}
+
+QString ThingAnnotationSaver::getJournalFilename(const QString& annotationsFilename)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (cacheDirectory.isEmpty() || annotationsFilename.isEmpty()) {
+        return QString();
+    }
+
+    const QString canonicalFilename = QDir::cleanPath(QFileInfo(annotationsFilename).absoluteFilePath());
+    const QByteArray key = QCryptographicHash::hash(canonicalFilename.toUtf8(), QCryptographicHash::Sha1).toHex();
+
+    return cacheDirectory + "/annotation-journal/" + QString::fromLatin1(key) + ".journal";
+}
+
+bool ThingAnnotationSaver::writeJournal(const QString& journalFilename, uint baseFingerprint, const std::vector<Record>& records)
+{
+    if (journalFilename.isEmpty() || !QDir().mkpath(QFileInfo(journalFilename).absolutePath())) {
+        return false;
+    }
+
+    QSaveFile file(journalFilename);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(streamVersion);
+    stream << journalMagic << journalVersion << baseFingerprint;
+    for (const Record& record : records) {
+        stream << record.data;
+    }
+
+    if (stream.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool ThingAnnotationSaver::appendToJournal(const QString& journalFilename, const Record& record)
+{
+    QFile file(journalFilename);
+    if (journalFilename.isEmpty() || !file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        return false;
+    }
+
+    QDataStream stream(&file);
+    stream.setVersion(streamVersion);
+    stream << record.data;
+
+    return stream.status() == QDataStream::Ok && file.flush();
+}
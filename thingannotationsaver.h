@@ -0,0 +1,112 @@
+#ifndef THINGANNOTATIONSAVER_H
+#define THINGANNOTATIONSAVER_H
+
+#include "thingannotationedit.h"
+
+#include <QByteArray>
+#include <QHash>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThreadPool>
+#include <QWaitCondition>
+#include <vector>
+
+class ImageLoader;
+class QTimer;
+
+// Saves the thing annotations without rewriting the whole file on every edit.
+// Each edit is appended to a journal right away (which takes time in proportion
+// to the edit only), and the file itself is rewritten in the background once
+// the edits pause for a while, or when asked to. The journal is then compacted,
+// that is, the edits that made it to the file are dropped from it.
+//
+// If the application exits before that, the next session replays the journal
+// on top of what is in the file (see recover). The journal records the state
+// each edit expects to start from, so edits that do not apply to the file (say,
+// because it was changed elsewhere meanwhile) are never replayed.
+//
+// The cached copy of the image (in the image loader) is invalidated once the
+// file has been rewritten.
+class ThingAnnotationSaver : public QObject
+{
+    Q_OBJECT
+
+public:
+    typedef ThingAnnotationEdit::Results Results;
+
+    explicit ThingAnnotationSaver(ImageLoader* imageLoader, QObject* parent = nullptr);
+    ~ThingAnnotationSaver(); // writes everything first
+
+    // Records the edit (or the undoing of it), given the annotations as they
+    // are after it. Call from the GUI thread only.
+    void record(const QString& imageFilename, const QString& annotationsFilename, const ThingAnnotationEdit& edit, bool isUndo, const Results& results, const QHash<QRgb, QString>& classNames);
+
+    // Replays the edits left in the journal by an earlier session, and has the
+    // file rewritten with them. Returns false if there were none to replay.
+    bool recover(const QString& imageFilename, const QString& annotationsFilename, Results& results, const QHash<QRgb, QString>& classNames);
+
+    // Starts rewriting the file now, rather than waiting for the edits to pause
+    void compact(const QString& annotationsFilename);
+
+    // Returns once the file is up to date
+    void waitFor(const QString& annotationsFilename);
+
+    // Returns once all the files are up to date
+    void flush();
+
+    // For when the annotations themselves are deleted: drops the edits not
+    // written yet, and the journal, so that recover does not bring them back
+    void discard(const QString& annotationsFilename);
+
+signals:
+    void failed(const QString& error);
+
+private slots:
+    void onIdle();
+
+private:
+    class Writer;
+
+    struct Snapshot {
+        QString imageFilename;
+        Results results;
+        QHash<QRgb, QString> classNames;
+        quint64 sequence = 0; // of the last edit included
+    };
+
+    struct Record {
+        quint64 sequence = 0;
+        QByteArray data;
+    };
+
+    static QString getJournalFilename(const QString& annotationsFilename);
+    static bool writeJournal(const QString& journalFilename, uint baseFingerprint, const std::vector<Record>& records);
+    static bool appendToJournal(const QString& journalFilename, const Record& record);
+
+    void enqueue(const QString& annotationsFilename, Snapshot snapshot);
+    void work();
+    void compactJournal(const QString& annotationsFilename, const Snapshot& snapshot);
+    static bool write(const QString& annotationsFilename, const Snapshot& snapshot, QString& error);
+
+    ImageLoader* const imageLoader;
+
+    QTimer* idleTimer = nullptr;
+    QThreadPool threadPool;
+
+    // Waiting for the edits to pause, by the annotations filename (GUI thread only)
+    QHash<QString, Snapshot> idle;
+
+    QMutex mutex;
+    QWaitCondition written;
+    QHash<QString, Snapshot> pending; // by the annotations filename; not started yet
+    QSet<QString> writing;
+    QHash<QString, std::vector<Record>> journals; // the edits not in the files yet
+    QSet<QString> compacting; // the journals being rewritten; the edits meanwhile are appended afterwards
+    quint64 nextSequence = 1;
+    bool writerRunning = false;
+    bool journalFailing = false; // so as not to report the same problem on every edit
+};
+
+#endif // THINGANNOTATIONSAVER_H
@@ -0,0 +1,449 @@
+#include "tiledmask.h"
+#include "binaryio.h"
+#include "maskpalette.h"
+
+#include <QDateTime>
+#include <QFile>
+#include <QFileInfo>
+#include <QFuture>
+#include <QSaveFile>
+#include <QtConcurrent/QtConcurrentRun>
+#include <algorithm>
+#include <set>
+#include <string.h>
+#include <vector>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace {
+    const char magic[8] = { 'A', 'N', 'N', 'O', 'T', 'I', 'L', '1' };
+    const quint32 currentVersion = 1;
+
+    // magic, version, width, height, tile size, offset of the tile table, bytes of live tile data
+    const qint64 headerSize = 8 + 4 + 4 + 4 + 4 + 8 + 8;
+
+    // zlib (rather than, say, zstd or LZ4) because it comes with Qt, so there
+    // is no dependency to add; the masks are mostly long runs, which even its
+    // fastest level compresses well and quickly
+    const int compressionLevel = 1;
+
+    struct Header {
+        quint32 width = 0;
+        quint32 height = 0;
+        qint64 tileTableOffset = 0;
+        qint64 liveBytes = 0;
+    };
+
+    struct TileEntry {
+        qint64 offset = 0;
+        quint32 length = 0; // 0 if the tile is fully transparent
+    };
+
+    int getTileCount(int length)
+    {
+        return (length + TiledMask::tileSize - 1) / TiledMask::tileSize;
+    }
+
+    void writeHeader(BinaryWriter& writer, const Header& header)
+    {
+        for (char c : magic) {
+            writer.write<qint8>(c);
+        }
+        writer.write<quint32>(currentVersion);
+        writer.write<quint32>(header.width);
+        writer.write<quint32>(header.height);
+        writer.write<quint32>(TiledMask::tileSize);
+        writer.write<qint64>(header.tileTableOffset);
+        writer.write<qint64>(header.liveBytes);
+    }
+
+    void writeTileTable(BinaryWriter& writer, const std::vector<TileEntry>& tiles)
+    {
+        for (const TileEntry& tile : tiles) {
+            writer.write<qint64>(tile.offset);
+            writer.write<quint32>(tile.length);
+        }
+    }
+
+    bool readHeaderAndTileTable(const uchar* data, qint64 size, Header& header, std::vector<TileEntry>& tiles)
+    {
+        if (data == nullptr || size < headerSize || memcmp(data, magic, sizeof(magic)) != 0) {
+            return false;
+        }
+
+        BinaryReader reader(data, size, sizeof(magic));
+        quint32 version = 0;
+        quint32 tileSize = 0;
+
+        if (!reader.read(version) || version != currentVersion
+                || !reader.read(header.width)
+                || !reader.read(header.height)
+                || !reader.read(tileSize) || tileSize != TiledMask::tileSize
+                || !reader.read(header.tileTableOffset)
+                || !reader.read(header.liveBytes)
+                || header.width == 0 || header.height == 0
+                || header.width > 0xffffff || header.height > 0xffffff) {
+            return false;
+        }
+
+        tiles.resize(static_cast<size_t>(getTileCount(header.width)) * getTileCount(header.height));
+
+        BinaryReader tileTable(data, size, header.tileTableOffset);
+        for (TileEntry& tile : tiles) {
+            if (!tileTable.read(tile.offset) || !tileTable.read(tile.length)
+                    || tile.offset < 0 || tile.offset + tile.length > size) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Returns once what was written is on the disk, and not just handed to the
+    // operating system, which might otherwise store later writes first
+    bool syncToDisk(QFile& file)
+    {
+        if (!file.flush()) {
+            return false;
+        }
+#ifdef _WIN32
+        return _commit(file.handle()) == 0;
+#else
+        return fsync(file.handle()) == 0;
+#endif
+    }
+
+    // Returns an empty array for a fully transparent tile
+    QByteArray compressTile(const QImage& tile)
+    {
+        if (tile.isNull()) {
+            return QByteArray();
+        }
+        return qCompress(tile.constBits(), static_cast<int>(tile.sizeInBytes()), compressionLevel);
+    }
+
+    // Compresses the tiles in parallel
+    std::vector<QByteArray> compressTiles(const SparseMask& mask, const std::vector<int>& tileIndices)
+    {
+        const int columns = mask.columns();
+
+        std::vector<QFuture<QByteArray>> futures;
+        futures.reserve(tileIndices.size());
+
+        for (int tileIndex : tileIndices) {
+            futures.push_back(QtConcurrent::run(compressTile, mask.tile(tileIndex % columns, tileIndex / columns)));
+        }
+
+        std::vector<QByteArray> compressed;
+        compressed.reserve(futures.size());
+
+        for (QFuture<QByteArray>& future : futures) {
+            compressed.push_back(future.result());
+        }
+
+        return compressed;
+    }
+
+    // Returns a null image, if the tile is transparent or broken
+    QImage decompressTile(const uchar* data, const TileEntry& tile, const QSize& size)
+    {
+        if (tile.length == 0) {
+            return QImage();
+        }
+        const QByteArray pixels = qUncompress(data + tile.offset, static_cast<int>(tile.length));
+        QImage image(size, QImage::Format_ARGB32);
+        if (image.isNull() || pixels.size() != image.sizeInBytes()) {
+            return QImage();
+        }
+        memcpy(image.bits(), pixels.constData(), pixels.size());
+        return image;
+    }
+
+    // Decodes in parallel the tiles that intersect the rectangle
+    bool readTiles(const QString& filename, const QRect& rect, SparseMask& mask)
+    {
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+
+        const qint64 size = file.size();
+        const uchar* data = file.map(0, size);
+
+        Header header;
+        std::vector<TileEntry> tiles;
+        if (!readHeaderAndTileTable(data, size, header, tiles)) {
+            return false;
+        }
+
+        mask = SparseMask(QSize(header.width, header.height));
+
+        const QRect area = rect.isNull() ? mask.rect() : rect & mask.rect();
+        if (area.isEmpty()) {
+            return true;
+        }
+
+        const int columns = mask.columns();
+
+        struct Decoded {
+            int column;
+            int row;
+            QFuture<QImage> future;
+        };
+        std::vector<Decoded> decoded;
+
+        for (int row = area.top() / TiledMask::tileSize, lastRow = area.bottom() / TiledMask::tileSize; row <= lastRow; ++row) {
+            for (int column = area.left() / TiledMask::tileSize, lastColumn = area.right() / TiledMask::tileSize; column <= lastColumn; ++column) {
+                const TileEntry& tile = tiles[row * columns + column];
+                if (tile.length > 0) {
+                    decoded.push_back(Decoded { column, row, QtConcurrent::run(decompressTile, data, tile, mask.tileRect(column, row).size()) });
+                }
+            }
+        }
+
+        bool ok = true;
+        for (Decoded& item : decoded) {
+            const QImage tile = item.future.result();
+            ok = ok && !tile.isNull();
+            mask.setTile(item.column, item.row, tile);
+        }
+
+        return ok;
+    }
+
+    bool writeTiles(BinaryWriter& writer, const std::vector<QByteArray>& compressed, const std::vector<int>& tileIndices, std::vector<TileEntry>& tiles, qint64& liveBytes)
+    {
+        for (size_t i = 0; i < compressed.size(); ++i) {
+            TileEntry& tile = tiles[tileIndices[i]];
+            liveBytes -= tile.length;
+            tile.offset = writer.position();
+            tile.length = static_cast<quint32>(compressed[i].size());
+            liveBytes += tile.length;
+            if (!writer.writeBytes(compressed[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+}
+
+QString TiledMask::getFilenameSuffix()
+{
+    return "_mask.tiles";
+}
+
+SparseMask TiledMask::read(const QString& filename)
+{
+    SparseMask mask;
+    return readTiles(filename, QRect(), mask) ? mask : SparseMask();
+}
+
+QImage TiledMask::readRect(const QString& filename, const QRect& rect)
+{
+    SparseMask mask;
+    if (!readTiles(filename, rect, mask)) {
+        return QImage();
+    }
+
+    const QRect area = rect & mask.rect();
+    if (area.isEmpty()) {
+        return QImage();
+    }
+
+    QImage result(area.size(), QImage::Format_ARGB32);
+    if (result.isNull()) {
+        return QImage();
+    }
+    result.fill(Qt::transparent);
+
+    for (int row = area.top() / tileSize, lastRow = area.bottom() / tileSize; row <= lastRow; ++row) {
+        for (int column = area.left() / tileSize, lastColumn = area.right() / tileSize; column <= lastColumn; ++column) {
+            const QImage& tile = mask.tile(column, row);
+            if (tile.isNull()) {
+                continue;
+            }
+            const QRect tileRect = mask.tileRect(column, row);
+            const QRect visibleRect = tileRect & area;
+            for (int y = visibleRect.top(); y <= visibleRect.bottom(); ++y) {
+                const uchar* source = tile.constScanLine(y - tileRect.y()) + (visibleRect.x() - tileRect.x()) * 4;
+                uchar* target = result.scanLine(y - area.y()) + (visibleRect.x() - area.x()) * 4;
+                memcpy(target, source, visibleRect.width() * 4);
+            }
+        }
+    }
+
+    return result;
+}
+
+bool TiledMask::write(const QString& filename, const SparseMask& mask)
+{
+    if (mask.isNull()) {
+        return false;
+    }
+
+    QSaveFile file(filename);
+    if (!file.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    Header header;
+    header.width = static_cast<quint32>(mask.width());
+    header.height = static_cast<quint32>(mask.height());
+
+    BinaryWriter writer(file);
+
+    writeHeader(writer, Header()); // a placeholder, until we know the offsets
+
+    std::vector<TileEntry> tiles(static_cast<size_t>(mask.columns()) * mask.rows());
+
+    std::vector<int> tileIndices(tiles.size());
+    for (size_t i = 0; i < tileIndices.size(); ++i) {
+        tileIndices[i] = static_cast<int>(i);
+    }
+
+    if (!writeTiles(writer, compressTiles(mask, tileIndices), tileIndices, tiles, header.liveBytes)) {
+        file.cancelWriting();
+        return false;
+    }
+
+    header.tileTableOffset = writer.position();
+    writeTileTable(writer, tiles);
+
+    if (!writer.flush() || !file.seek(0)) {
+        file.cancelWriting();
+        return false;
+    }
+
+    writeHeader(writer, header);
+
+    if (!writer.flush()) {
+        file.cancelWriting();
+        return false;
+    }
+
+    return file.commit();
+}
+
+bool TiledMask::update(const QString& filename, const SparseMask& mask, const QRegion& changedRegion)
+{
+    if (mask.isNull()) {
+        return false;
+    }
+
+    QFile file(filename);
+    if (!file.open(QIODevice::ReadWrite)) {
+        return write(filename, mask);
+    }
+
+    const qint64 size = file.size();
+
+    Header header;
+    std::vector<TileEntry> tiles;
+
+    {
+        const uchar* data = file.map(0, size);
+        const bool ok = readHeaderAndTileTable(data, size, header, tiles);
+        if (data) {
+            file.unmap(const_cast<uchar*>(data));
+        }
+        if (!ok || header.width != static_cast<quint32>(mask.width()) || header.height != static_cast<quint32>(mask.height())) {
+            file.close();
+            return write(filename, mask);
+        }
+    }
+
+    const int columns = mask.columns();
+
+    std::set<int> changedTiles;
+    for (const QRect& rect : changedRegion) {
+        const QRect clipped = rect & mask.rect();
+        if (clipped.isEmpty()) {
+            continue;
+        }
+        for (int row = clipped.top() / tileSize, lastRow = clipped.bottom() / tileSize; row <= lastRow; ++row) {
+            for (int column = clipped.left() / tileSize, lastColumn = clipped.right() / tileSize; column <= lastColumn; ++column) {
+                changedTiles.insert(row * columns + column);
+            }
+        }
+    }
+
+    if (changedTiles.empty()) {
+        return true;
+    }
+
+    const std::vector<int> tileIndices(changedTiles.begin(), changedTiles.end());
+    const std::vector<QByteArray> compressed = compressTiles(mask, tileIndices);
+
+    // Once most of the file would be garbage, it's time to start over
+    qint64 appendedBytes = static_cast<qint64>(tiles.size()) * (8 + 4);
+    for (const QByteArray& tile : compressed) {
+        appendedBytes += tile.size();
+    }
+    const qint64 tileTableBytes = static_cast<qint64>(tiles.size()) * (8 + 4);
+    if (size + appendedBytes - header.liveBytes - tileTableBytes - headerSize > std::max<qint64>(header.liveBytes, 1024 * 1024)) {
+        file.close();
+        return write(filename, mask);
+    }
+
+    if (!file.seek(size)) {
+        return false;
+    }
+
+    BinaryWriter writer(file);
+
+    if (!writeTiles(writer, compressed, tileIndices, tiles, header.liveBytes)) {
+        return false;
+    }
+
+    header.tileTableOffset = writer.position();
+    writeTileTable(writer, tiles);
+
+    // Only now that everything else is on the disk, switch over to the new
+    // table. The header is small and at the very start of the file, so it
+    // gets written all at once; until then, the old table is in effect.
+    if (!writer.flush() || !syncToDisk(file) || !file.seek(0)) {
+        return false;
+    }
+
+    writeHeader(writer, header);
+
+    return writer.flush() && syncToDisk(file);
+}
+
+SparseMask TiledMask::readNewest(const QString& pngFilename, const QString& tiledFilename)
+{
+    const QFileInfo png(pngFilename);
+    const QFileInfo tiled(tiledFilename);
+
+    if (tiled.exists() && (!png.exists() || tiled.lastModified() >= png.lastModified())) {
+        const SparseMask mask = read(tiledFilename);
+        if (!mask.isNull() || !png.exists()) {
+            return mask;
+        }
+    }
+
+    return SparseMask::fromImage(fromIndexedMask(QImage(pngFilename))); // or just converted, if not indexed
+}
+
+bool TiledMask::convertFromPng(const QString& pngFilename, const QString& tiledFilename)
+{
+    const SparseMask mask = SparseMask::fromImage(fromIndexedMask(QImage(pngFilename)));
+    return !mask.isNull() && write(tiledFilename, mask);
+}
+
+bool TiledMask::convertToPng(const QString& tiledFilename, const QString& pngFilename)
+{
+    const QImage mask = read(tiledFilename).toImage();
+    if (mask.isNull()) {
+        return false;
+    }
+
+    QSaveFile file(pngFilename);
+    return file.open(QIODevice::WriteOnly)
+            && mask.save(&file, "PNG")
+            && file.commit();
+}
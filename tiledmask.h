@@ -0,0 +1,56 @@
+#ifndef TILEDMASK_H
+#define TILEDMASK_H
+
+#include "sparsemask.h"
+
+#include <QImage>
+#include <QRect>
+#include <QRegion>
+#include <QString>
+
+// A mask sidecar (next to the image, like the PNG mask) made of independently
+// compressed tiles of 512 x 512 pixels, plus an index of where each tile is.
+// The tiles are those of SparseMask, so nothing needs to be converted.
+// Unlike a PNG, it can be decoded on all cores at once, a part of it can be
+// read without touching the rest, and a save can rewrite just the tiles that
+// changed.
+//
+// The file starts with a header, followed by the tile data and the tile table
+// (the offset and the compressed length of each tile, row by row). The tiles
+// are the raw ARGB32 pixels compressed with zlib; a fully transparent tile is
+// not stored at all. An update appends the changed tiles and a new tile table,
+// waits for them to reach the disk, and only then points the header to the new
+// table, so that an update interrupted even by a crash or a power failure
+// leaves the previous version intact. Once there is more garbage than
+// live data, the file is rewritten.
+//
+// If both a PNG mask and a tiled mask exist, the newer one counts.
+class TiledMask
+{
+public:
+    static const int tileSize = SparseMask::tileSize;
+
+    static QString getFilenameSuffix();
+
+    // Returns a null mask, in case of an error
+    static SparseMask read(const QString& filename);
+
+    // Returns just the part of the mask within the rectangle, in Format_ARGB32;
+    // or a null image, in case of an error
+    static QImage readRect(const QString& filename, const QRect& rect);
+
+    // Writes the whole mask to a new file
+    static bool write(const QString& filename, const SparseMask& mask);
+
+    // Rewrites only the tiles that intersect the region; falls back to writing
+    // the whole mask, if the file is not there or does not match the mask
+    static bool update(const QString& filename, const SparseMask& mask, const QRegion& changedRegion);
+
+    // Reads whichever of the two is newer; either may be missing
+    static SparseMask readNewest(const QString& pngFilename, const QString& tiledFilename);
+
+    static bool convertFromPng(const QString& pngFilename, const QString& tiledFilename);
+    static bool convertToPng(const QString& tiledFilename, const QString& pngFilename);
+};
+
+#endif // TILEDMASK_H
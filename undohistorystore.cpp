@@ -0,0 +1,141 @@
+#include "undohistorystore.h"
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QFile>
+#include <QStandardPaths>
+#include <iterator>
+
+UndoHistoryStore::UndoHistoryStore(size_t maxMemoryBytes, size_t maxDiskBytes)
+    : maxMemoryBytes(maxMemoryBytes)
+    , maxDiskBytes(maxDiskBytes)
+{
+    const QString cacheDirectory = QStandardPaths::writableLocation(QStandardPaths::CacheLocation);
+    if (!cacheDirectory.isEmpty()) {
+        // Per process, so that several instances do not mix their histories
+        spillDirectory = cacheDirectory + "/undo-history/" + QString::number(QCoreApplication::applicationPid());
+    }
+}
+
+UndoHistoryStore::~UndoHistoryStore()
+{
+    clear();
+}
+
+void UndoHistoryStore::put(const QString& imageFilename, const QByteArray& history)
+{
+    const auto i = index.find(imageFilename);
+    if (i != index.end()) {
+        remove(i.value());
+    }
+
+    Entry entry;
+    entry.imageFilename = imageFilename;
+    entry.compressed = qCompress(history);
+    entry.bytes = static_cast<size_t>(entry.compressed.size());
+
+    memoryBytes += entry.bytes;
+
+    entries.push_front(entry);
+    index.insert(imageFilename, entries.begin());
+
+    spill();
+}
+
+QByteArray UndoHistoryStore::take(const QString& imageFilename)
+{
+    const auto i = index.find(imageFilename);
+    if (i == index.end()) {
+        return QByteArray();
+    }
+
+    QByteArray compressed = i.value()->compressed;
+
+    if (compressed.isEmpty()) {
+        QFile file(getSpillFilename(imageFilename));
+        if (file.open(QIODevice::ReadOnly)) {
+            compressed = file.readAll();
+        }
+    }
+
+    remove(i.value());
+
+    return compressed.isEmpty() ? QByteArray() : qUncompress(compressed);
+}
+
+void UndoHistoryStore::clear()
+{
+    entries.clear();
+    index.clear();
+    memoryBytes = 0;
+    diskBytes = 0;
+
+    if (!spillDirectory.isEmpty()) {
+        QDir(spillDirectory).removeRecursively();
+    }
+}
+
+void UndoHistoryStore::remove(Entries::iterator entry)
+{
+    if (entry->compressed.isEmpty()) {
+        QFile::remove(getSpillFilename(entry->imageFilename));
+        diskBytes -= entry->bytes;
+    }
+    else {
+        memoryBytes -= entry->bytes;
+    }
+
+    index.remove(entry->imageFilename);
+    entries.erase(entry);
+}
+
+void UndoHistoryStore::spill()
+{
+    // Spill the least recently used ones first, but keep the latest one in memory in any case
+    for (auto i = entries.end(); memoryBytes > maxMemoryBytes && i != entries.begin(); ) {
+        --i;
+        if (i == entries.begin() || i->compressed.isEmpty()) {
+            continue;
+        }
+
+        QFile file(getSpillFilename(i->imageFilename));
+        const bool spilled = !spillDirectory.isEmpty()
+                && QDir().mkpath(spillDirectory)
+                && file.open(QIODevice::WriteOnly)
+                && file.write(i->compressed) == i->compressed.size();
+
+        file.close();
+
+        if (spilled) {
+            i->compressed.clear();
+            memoryBytes -= i->bytes;
+            diskBytes += i->bytes;
+        }
+        else {
+            file.remove();
+            auto next = std::next(i);
+            remove(i);
+            i = next;
+        }
+    }
+
+    while (diskBytes > maxDiskBytes) {
+        auto oldestSpilled = entries.end();
+        for (auto i = entries.begin(); i != entries.end(); ++i) {
+            if (i->compressed.isEmpty()) {
+                oldestSpilled = i;
+            }
+        }
+        if (oldestSpilled == entries.end()) {
+            break;
+        }
+        remove(oldestSpilled);
+    }
+}
+
+QString UndoHistoryStore::getSpillFilename(const QString& imageFilename) const
+{
+    const QByteArray key = QCryptographicHash::hash(imageFilename.toUtf8(), QCryptographicHash::Sha1).toHex();
+    return spillDirectory + "/" + QString::fromLatin1(key) + ".undo";
+}
@@ -0,0 +1,51 @@
+#ifndef UNDOHISTORYSTORE_H
+#define UNDOHISTORYSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <list>
+
+// Keeps the undo history of the images not currently shown, so that it can be
+// restored when getting back to an image. The histories are compressed, and
+// the least recently used ones are spilled to a directory in the cache when
+// there is too much in memory. If there is too much on disk too, the oldest
+// histories are dropped. The histories last for the session only.
+class UndoHistoryStore
+{
+public:
+    UndoHistoryStore(size_t maxMemoryBytes, size_t maxDiskBytes);
+    ~UndoHistoryStore();
+
+    void put(const QString& imageFilename, const QByteArray& history);
+
+    // Returns an empty array if there is no history for the image
+    QByteArray take(const QString& imageFilename);
+
+    void clear();
+
+private:
+    struct Entry {
+        QString imageFilename;
+        QByteArray compressed; // empty, if spilled to disk
+        size_t bytes; // compressed
+    };
+
+    typedef std::list<Entry> Entries;
+
+    void remove(Entries::iterator entry);
+    void spill();
+    QString getSpillFilename(const QString& imageFilename) const;
+
+    Entries entries; // the most recently used first
+    QHash<QString, Entries::iterator> index;
+
+    const size_t maxMemoryBytes;
+    const size_t maxDiskBytes;
+    size_t memoryBytes = 0;
+    size_t diskBytes = 0;
+
+    QString spillDirectory;
+};
+
+#endif // UNDOHISTORYSTORE_H
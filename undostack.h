@@ -0,0 +1,75 @@
+#ifndef UNDOSTACK_H
+#define UNDOSTACK_H
+
+#include <QDataStream>
+#include <deque>
+
+// A stack of undo (or redo) steps, bounded by their total size; when full, the
+// oldest steps are dropped first. The steps need to tell their size in bytes,
+// and to be serializable with QDataStream.
+template <typename Step>
+class UndoStack
+{
+public:
+    explicit UndoStack(size_t maxBytes)
+        : maxBytes(maxBytes)
+    {}
+
+    bool empty() const {
+        return steps.empty();
+    }
+
+    size_t bytes() const {
+        return totalBytes;
+    }
+
+    void push(Step step) {
+        totalBytes += step.bytes();
+        steps.push_back(std::move(step));
+
+        // Keep at least the latest one, however large
+        while (steps.size() > 1 && totalBytes > maxBytes) {
+            totalBytes -= steps.front().bytes();
+            steps.pop_front();
+        }
+    }
+
+    Step pop() {
+        Step step = std::move(steps.back());
+        steps.pop_back();
+        totalBytes -= step.bytes();
+        return step;
+    }
+
+    void clear() {
+        steps.clear();
+        totalBytes = 0;
+    }
+
+    friend QDataStream& operator<<(QDataStream& stream, const UndoStack& stack) {
+        stream << static_cast<quint32>(stack.steps.size());
+        for (const Step& step : stack.steps) {
+            stream << step;
+        }
+        return stream;
+    }
+
+    friend QDataStream& operator>>(QDataStream& stream, UndoStack& stack) {
+        stack.clear();
+        quint32 count = 0;
+        stream >> count;
+        for (quint32 i = 0; i < count && stream.status() == QDataStream::Ok; ++i) {
+            Step step;
+            stream >> step;
+            stack.push(std::move(step));
+        }
+        return stream;
+    }
+
+private:
+    std::deque<Step> steps;
+    size_t totalBytes = 0;
+    const size_t maxBytes;
+};
+
+#endif // UNDOSTACK_H